@@ -3,7 +3,20 @@
         "target_name": "menoh",
         "sources": [
             "src/menoh.cpp",
-            "src/model.cpp"
+            "src/addon_data.cpp",
+            "src/model.cpp",
+            "src/model_data_cache.cpp",
+            "src/model_registry.cpp",
+            "src/model_pool.cpp",
+            "src/result_cache.cpp",
+            "src/hash.cpp",
+            "src/shared_ring.cpp",
+            "src/thread_budget.cpp",
+            "src/tensor_arena.cpp",
+            "src/variable.cpp",
+            "src/convert.cpp",
+            "src/tiled_run.cpp",
+            "src/vector_index.cpp"
         ],
         "include_dirs" : [
             "<!(node -e \"require('nan')\")"
@@ -15,11 +28,14 @@
                     "-std=c++11",
                     "-Wall",
                     "-g",
+                    "-ffp-contract=off",
                     "-rdynamic"
                 ],
+                "libraries": [ "-lrt", "-ldl" ],
             }],
             [ 'OS=="mac"', {
                 "xcode_settings": {
+                    "OTHER_CFLAGS": [ "-ffp-contract=off" ],
                     "MACOSX_DEPLOYMENT_TARGET": "10.9",
                     "GCC_ENABLE_CPP_RTTI": "NO",
                     "GCC_ENABLE_CPP_EXCEPTIONS": "NO"
@@ -0,0 +1,97 @@
+'use strict';
+
+// Compares the run paths of a small model: the number of runs per second
+// and the garbage collections per 10k runs, which reflect the per-run
+// allocations.
+//
+// Usage: node bench_run.js [runs]
+
+const { PerformanceObserver, constants } = require('perf_hooks');
+const menoh = require('..'); // This menoh module
+
+const MNIST_IN_NAME = "139900320569040"
+const MNIST_OUT_NAME = "139898462888656"
+const RUNS = parseInt(process.argv[2] || '20000', 10);
+
+let scavenges = 0;
+let markSweeps = 0;
+const obs = new PerformanceObserver((list) => {
+    list.getEntries().forEach((entry) => {
+        if (entry.kind === constants.NODE_PERFORMANCE_GC_MINOR) {
+            scavenges++;
+        } else if (entry.kind === constants.NODE_PERFORMANCE_GC_MAJOR) {
+            markSweeps++;
+        }
+    });
+});
+obs.observe({ entryTypes: [ 'gc' ] });
+
+function runWithCallback(model, n) {
+    return new Promise((resolve, reject) => {
+        const next = (err) => {
+            if (err) {
+                return reject(err);
+            }
+            if (n-- === 0) {
+                return resolve();
+            }
+            model.run(next);
+        };
+        next();
+    });
+}
+
+async function runWithPromise(model, n) {
+    for (let i = 0; i < n; ++i) {
+        await model.run();
+    }
+}
+
+function runSync(model, n) {
+    for (let i = 0; i < n; ++i) {
+        model.runSync();
+    }
+    return Promise.resolve();
+}
+
+function measure(name, model, fn) {
+    // Let the observer catch up with the previous measurement.
+    return new Promise((resolve) => setTimeout(resolve, 100))
+    .then(() => {
+        scavenges = 0;
+        markSweeps = 0;
+        const start = process.hrtime();
+        return fn(model, RUNS)
+        .then(() => {
+            const [ s, ns ] = process.hrtime(start);
+            const sec = s + ns / 1e9;
+            return new Promise((resolve) => setTimeout(resolve, 100))
+            .then(() => {
+                console.log('%s: %d runs/s, %d us/run, %s scavenges and %s mark-sweeps per 10k runs',
+                    name.padEnd(10),
+                    Math.round(RUNS / sec),
+                    (sec * 1e6 / RUNS).toFixed(1),
+                    (scavenges * 10000 / RUNS).toFixed(1),
+                    (markSweeps * 10000 / RUNS).toFixed(1));
+            });
+        });
+    });
+}
+
+return menoh.create('../test/data/mnist/mnist.onnx')
+.then((builder) => {
+    builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+    builder.addOutput(MNIST_OUT_NAME);
+    const model = builder.buildModel({ warmup: { iterations: 100 } });
+
+    return measure('callback', model, runWithCallback)
+    .then(() => measure('promise', model, runWithPromise))
+    .then(() => measure('sync', model, runSync))
+    .then(() => {
+        obs.disconnect();
+        console.log(model.getRunStats());
+    });
+})
+.catch((err) => {
+    console.log('Error:', err);
+});
@@ -1,5 +1,6 @@
 'use strict';
 
+const stream = require('stream');
 const addon = require('./build/Release/menoh.node');
 
 // Promisify addon.create()
@@ -23,17 +24,78 @@ const addon = require('./build/Release/menoh.node');
     }
 })();
 
+// Calls `cancel` when `signal` (an AbortSignal) is aborted. Returns a
+// function to stop watching the signal.
+function watchSignal(signal, cancel) {
+    if (!signal) {
+        return () => {};
+    }
+    if (signal.aborted) {
+        cancel();
+        return () => {};
+    }
+    signal.addEventListener('abort', cancel);
+    return () => signal.removeEventListener('abort', cancel);
+}
+
 // Promisify addon.Model.prototype.run()
 (function () {
     const run = addon.Model.prototype.run;
-    addon.Model.prototype.run = function (cb) {
+    const runPromise = addon.Model.prototype.runPromise; // absent on old Node.js
+    addon.Model.prototype.run = function (options, cb) {
+        if (typeof options === 'function') {
+            cb = options;
+            options = {};
+        }
+
+        // Fast path: a native promise, settled by a worker reused by all
+        // the runs of the model, without closures.
+        if (!cb && runPromise && !(options && options.signal)) {
+            try {
+                return runPromise.call(this, options ? options.outputs : undefined);
+            } catch (err) {
+                return Promise.reject(err);
+            }
+        }
+
+        options = options || {};
+        const start = (done) => {
+            let unwatch = () => {};
+            run.call(this, (err, outputs) => {
+                unwatch();
+                done(err, outputs);
+            }, options.outputs);
+            unwatch = watchSignal(options.signal, () => this.cancel());
+        };
+
         if (cb) {
-            run.call(this, cb);
+            start(cb);
             return;
         }
 
         return new Promise((resolve, reject) => {
-            run.call(this, (err) => {
+            start((err, outputs) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(outputs);
+            });
+        });
+    }
+})();
+
+// Promisify addon.Model.prototype.swapWeights()
+(function () {
+    const swapWeights = addon.Model.prototype.swapWeights;
+    addon.Model.prototype.swapWeights = function (path, cb) {
+        if (cb) {
+            swapWeights.call(this, path, cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            swapWeights.call(this, path, (err) => {
                 if (err) {
                     reject(err);
                     return;
@@ -44,5 +106,351 @@ const addon = require('./build/Release/menoh.node');
     }
 })();
 
+// Promisify addon.Model.prototype.warmup()
+(function () {
+    const warmup = addon.Model.prototype.warmup;
+    addon.Model.prototype.warmup = function (options, cb) {
+        if (typeof options === 'function') {
+            cb = options;
+            options = undefined;
+        }
+        if (cb) {
+            warmup.call(this, options, cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            warmup.call(this, options, (err, stats) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(stats);
+            });
+        });
+    }
+})();
+
+// Promisify addon.Model.prototype.runTiled()
+(function () {
+    const runTiled = addon.Model.prototype.runTiled;
+    addon.Model.prototype.runTiled = function (image, options, cb) {
+        if (typeof options === 'function') {
+            cb = options;
+            options = undefined;
+        }
+        if (cb) {
+            runTiled.call(this, image, options, cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            runTiled.call(this, image, options, (err, outputs) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(outputs);
+            });
+        });
+    }
+})();
+
+// Promisify addon.ModelPool.prototype.run()
+(function () {
+    const run = addon.ModelPool.prototype.run;
+    addon.ModelPool.prototype.run = function (inputs, options, cb) {
+        if (typeof options === 'function') {
+            cb = options;
+            options = {};
+        }
+        options = options || {};
+        const start = (done) => {
+            let unwatch = () => {};
+            const id = run.call(this, inputs, options, (err, outputs) => {
+                unwatch();
+                done(err, outputs);
+            });
+            unwatch = watchSignal(options.signal, () => this.cancel(id));
+        };
+
+        if (cb) {
+            start(cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            start((err, outputs) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(outputs);
+            });
+        });
+    }
+})();
+
+// Promisify addon.ModelPool.prototype.runLarge()
+(function () {
+    const runLarge = addon.ModelPool.prototype.runLarge;
+    addon.ModelPool.prototype.runLarge = function (inputs, options, cb) {
+        if (typeof options === 'function') {
+            cb = options;
+            options = {};
+        }
+        options = options || {};
+        const start = (done) => {
+            let unwatch = () => {};
+            const ids = runLarge.call(this, inputs, options, (err, outputs) => {
+                unwatch();
+                done(err, outputs);
+            });
+            unwatch = watchSignal(options.signal, () => ids.forEach((id) => this.cancel(id)));
+        };
+
+        if (cb) {
+            start(cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            start((err, outputs) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(outputs);
+            });
+        });
+    }
+})();
+
+// Promisify addon.SharedRing.prototype.run() and serve()
+(function () {
+    const run = addon.SharedRing.prototype.run;
+    addon.SharedRing.prototype.run = function (input, cb) {
+        if (cb) {
+            run.call(this, input, cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            run.call(this, input, (err, outputs) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(outputs);
+            });
+        });
+    }
+
+    const serve = addon.SharedRing.prototype.serve;
+    addon.SharedRing.prototype.serve = function (model, cb) {
+        if (cb) {
+            serve.call(this, model, cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            serve.call(this, model, (err, served) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(served);
+            });
+        });
+    }
+})();
+
+// Promisify addon.VectorIndex.prototype.search()
+(function () {
+    const search = addon.VectorIndex.prototype.search;
+    addon.VectorIndex.prototype.search = function (queries, k, options, cb) {
+        if (typeof options === 'function') {
+            cb = options;
+            options = undefined;
+        }
+        if (cb) {
+            search.call(this, queries, k, options, cb);
+            return;
+        }
+
+        return new Promise((resolve, reject) => {
+            search.call(this, queries, k, options, (err, results) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                resolve(results);
+            });
+        });
+    }
+})();
+
+// Add addon.Model.prototype.createInferenceStream()
+(function () {
+    // Typed arrays of the raw data of each dtype (float16 as bits)
+    const viewTypes = {
+        float32: Float32Array,
+        uint8: Uint8Array,
+        int16: Int16Array,
+        float16: Uint16Array
+    };
+
+    // Returns typed array views of the model buffers, by name.
+    function getViews(model, names) {
+        const views = {};
+        names.forEach((name) => {
+            const profile = model.getProfile(name);
+            const View = viewTypes[profile.dtype];
+            const buf = profile.buf;
+            views[name] = new View(buf.buffer, buf.byteOffset, buf.length / View.BYTES_PER_ELEMENT);
+        });
+        return views;
+    }
+
+    addon.Model.prototype.createInferenceStream = function (options) {
+        options = options || {};
+        const names = this.getVarNames();
+        const models = [ this ].concat(options.replicas || []);
+        const capacity = this.getProfile(names.inputs[0]).dims[0];
+        const batchSize = options.batchSize || capacity;
+        if (batchSize > capacity) {
+            throw new RangeError('node-menoh batchSize exceeds the batch size of the model');
+        }
+
+        // Per-sample sizes, and views of the buffers of each model.
+        const slots = models.map((model) => ({
+            model: model,
+            inputs: getViews(model, names.inputs),
+            outputs: getViews(model, names.outputs)
+        }));
+        const inSizes = {};
+        names.inputs.forEach((name) => {
+            inSizes[name] = slots[0].inputs[name].length / capacity;
+        });
+        const outSizes = {};
+        names.outputs.forEach((name) => {
+            outSizes[name] = slots[0].outputs[name].length / capacity;
+        });
+
+        const free = slots.slice();
+        const done = new Map(); // seq => outputs of a completed batch
+        let pending = [];       // samples of the batch being packed
+        let nextSeq = 0;        // seq of the next batch to dispatch
+        let emitSeq = 0;        // seq of the next batch to emit
+        let waiting = null;     // transform callback held for backpressure
+        let flushed = null;     // flush callback held until all batches are done
+        let failed = false;
+
+        const s = new stream.Transform({
+            objectMode: true,
+            highWaterMark: options.highWaterMark || 2 * batchSize,
+            transform(sample, encoding, cb) {
+                pending.push(sample);
+                if (pending.length < batchSize) {
+                    cb();
+                    return;
+                }
+                if (free.length > 0) {
+                    dispatch();
+                    cb();
+                    return;
+                }
+                waiting = cb; // all models are busy
+            },
+            flush(cb) {
+                if (pending.length > 0 && free.length > 0) {
+                    dispatch();
+                }
+                flushed = cb;
+                settle();
+            }
+        });
+
+        function dispatch() {
+            const slot = free.shift();
+            const samples = pending;
+            const seq = nextSeq++;
+            pending = [];
+
+            try {
+                samples.forEach((sample, i) => {
+                    names.inputs.forEach((name) => {
+                        const data = (ArrayBuffer.isView(sample) || Array.isArray(sample)) ?
+                            sample : sample[name];
+                        if (data.length !== inSizes[name]) {
+                            throw new RangeError(`node-menoh sample size of ${name} must be ${inSizes[name]}`);
+                        }
+                        slot.inputs[name].set(data, i * inSizes[name]);
+                    });
+                });
+            } catch (err) {
+                free.push(slot);
+                fail(err);
+                return;
+            }
+
+            slot.model.run((err) => {
+                free.push(slot);
+                if (err) {
+                    fail(err);
+                    return;
+                }
+
+                const results = samples.map((_, i) => {
+                    const outputs = {};
+                    names.outputs.forEach((name) => {
+                        const size = outSizes[name];
+                        outputs[name] = slot.outputs[name].slice(i * size, (i + 1) * size);
+                    });
+                    return (names.outputs.length === 1) ? outputs[names.outputs[0]] : outputs;
+                });
+                done.set(seq, results);
+                settle();
+            });
+        }
+
+        // Emits completed batches in order and resumes the held callbacks.
+        function settle() {
+            if (failed) {
+                return;
+            }
+            while (done.has(emitSeq)) {
+                done.get(emitSeq).forEach((result) => s.push(result));
+                done.delete(emitSeq++);
+            }
+            if (waiting && free.length > 0) {
+                const cb = waiting;
+                waiting = null;
+                dispatch();
+                cb();
+            }
+            if (flushed) {
+                if (pending.length > 0 && free.length > 0) {
+                    dispatch();
+                }
+                if (pending.length === 0 && emitSeq === nextSeq) {
+                    const cb = flushed;
+                    flushed = null;
+                    cb();
+                }
+            }
+        }
+
+        function fail(err) {
+            if (!failed) {
+                failed = true;
+                s.destroy(err);
+            }
+        }
+
+        return s;
+    }
+})();
+
 module.exports = addon;
 
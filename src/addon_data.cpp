@@ -0,0 +1,43 @@
+
+#include "addon_data.h"
+
+namespace nodeMenoh {
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AddonData class
+
+AddonData::AddonData(v8::Isolate *isolate) {
+#if NODE_MAJOR_VERSION > 10 || (NODE_MAJOR_VERSION == 10 && NODE_MINOR_VERSION >= 2)
+    node::AddEnvironmentCleanupHook(isolate, cleanup, this);
+#else
+    // No worker threads. The instance lives as long as the process.
+    (void)isolate;
+#endif
+}
+
+AddonData::~AddonData() {
+    modelBuilderCons.Reset();
+    modelCons.Reset();
+    modelRegistryCons.Reset();
+    resultCacheCons.Reset();
+    sharedRingCons.Reset();
+    modelPoolCons.Reset();
+    variableCons.Reset();
+    vectorIndexCons.Reset();
+}
+
+AddonData* AddonData::from(Nan::FunctionCallbackInfo<v8::Value> const& info) {
+    return static_cast<AddonData*>(info.Data().As<v8::External>()->Value());
+}
+
+v8::Local<v8::Value> AddonData::external() {
+    return Nan::New<v8::External>(this);
+}
+
+void AddonData::cleanup(void *arg) {
+    delete static_cast<AddonData*>(arg);
+}
+
+
+}  // namespace nodeMenoh
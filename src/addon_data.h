@@ -0,0 +1,39 @@
+#ifndef NODEMENOH_ADDON_DATA_H
+#define NODEMENOH_ADDON_DATA_H
+
+#include <nan.h>
+
+namespace nodeMenoh {
+
+// State of one instance of the addon. The addon is loaded once per
+// isolate (the main thread and each worker thread), so constructors are
+// kept here instead of in static members. The instance is passed to the
+// methods as the function data (see AddonData::from).
+class AddonData {
+    public:
+        explicit AddonData(v8::Isolate *isolate);
+        ~AddonData();
+
+        // Returns the instance the called function belongs to.
+        static AddonData* from(Nan::FunctionCallbackInfo<v8::Value> const& info);
+
+        // Returns the function data to pass to the function templates.
+        v8::Local<v8::Value> external();
+
+        Nan::Persistent<v8::Function> modelBuilderCons;
+        Nan::Persistent<v8::Function> modelCons;
+        Nan::Persistent<v8::Function> modelRegistryCons;
+        Nan::Persistent<v8::Function> resultCacheCons;
+        Nan::Persistent<v8::Function> sharedRingCons;
+        Nan::Persistent<v8::Function> modelPoolCons;
+        Nan::Persistent<v8::Function> variableCons;
+        Nan::Persistent<v8::Function> vectorIndexCons;
+
+    private:
+        // Called when the environment (e.g. a worker thread) is torn down.
+        static void cleanup(void *arg);
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_ADDON_DATA_H
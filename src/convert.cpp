@@ -0,0 +1,412 @@
+
+#include <cmath>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "convert.h"
+#include "convert_kernels.h"
+
+namespace nodeMenoh {
+
+
+size_t dtypeSize(Dtype dtype) {
+    switch (dtype) {
+    case kUint8:    return 1;
+    case kInt16:    return 2;
+    case kFloat16:  return 2;
+    default:        return 4;
+    }
+}
+
+char const* dtypeName(Dtype dtype) {
+    switch (dtype) {
+    case kUint8:    return "uint8";
+    case kInt16:    return "int16";
+    case kFloat16:  return "float16";
+    default:        return "float32";
+    }
+}
+
+bool toDtype(std::string const& name, Dtype *dtype) {
+    static const Dtype dtypes[] = { kFloat32, kUint8, kInt16, kFloat16 };
+    for (size_t i = 0; i < sizeof(dtypes) / sizeof(dtypes[0]); ++i) {
+        if (name == dtypeName(dtypes[i])) {
+            *dtype = dtypes[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+float fromFloat16(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        // Inf, or NaN quieted with its payload (as F16C does)
+        bits = sign | 0x7f800000 | (mant ? 0x400000 : 0) | (mant << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // Subnormal: normalize the mantissa.
+        exp = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    ::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+uint16_t toFloat16(float f) {
+    uint32_t bits;
+    ::memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t exp = (bits >> 23) & 0xff;
+    uint32_t mant = bits & 0x7fffff;
+
+    if (exp == 0xff) {
+        // Inf, or NaN quieted with the top of its payload (as F16C does)
+        return sign | 0x7c00 | (mant ? 0x200 | (mant >> 13) : 0);
+    }
+    int e = (int)exp - 127 + 15;
+    if (e >= 0x1f) {
+        return sign | 0x7c00;   // overflow to Inf
+    }
+    if (e <= 0) {
+        if (e < -10) {
+            return sign;        // underflow to zero
+        }
+        // Subnormal, rounded to nearest even.
+        mant |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - e);
+        uint32_t h = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rest > half || (rest == half && (h & 1))) {
+            h++;
+        }
+        return sign | (uint16_t)h;
+    }
+
+    // Normal, rounded to nearest even. (A carry into the exponent is right.)
+    uint32_t h = ((uint32_t)e << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        h++;
+    }
+    return sign | (uint16_t)h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Kernel dispatch
+
+#ifdef NODEMENOH_X86
+static void cpuid(uint32_t leaf, uint32_t sub, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, (int)leaf, (int)sub);
+    for (int i = 0; i < 4; ++i) {
+        regs[i] = (uint32_t)r[i];
+    }
+#else
+    __cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register states enabled by the OS (XCR0)
+static uint64_t xgetbv0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+static Isa probeIsa() {
+    uint32_t r[4];
+    cpuid(0, 0, r);
+    uint32_t maxLeaf = r[0];
+    if (maxLeaf < 1) {
+        return kIsaScalar;
+    }
+
+    cpuid(1, 0, r);
+    bool sse41 = (r[2] >> 19) & 1;
+    bool osxsave = (r[2] >> 27) & 1;
+    bool avx = (r[2] >> 28) & 1;
+    bool f16c = (r[2] >> 29) & 1;
+    if (!sse41) {
+        return kIsaScalar;
+    }
+    if (!osxsave || !avx || !f16c || maxLeaf < 7) {
+        return kIsaSse4;
+    }
+
+    uint64_t xcr0 = xgetbv0();
+    if ((xcr0 & 0x6) != 0x6) {
+        return kIsaSse4;    // YMM state not enabled
+    }
+    cpuid(7, 0, r);
+    bool avx2 = (r[1] >> 5) & 1;
+    bool avx512f = (r[1] >> 16) & 1;
+    if (!avx2) {
+        return kIsaSse4;
+    }
+    if (!avx512f || (xcr0 & 0xe6) != 0xe6) {
+        return kIsaAvx2;    // or ZMM state not enabled
+    }
+    return kIsaAvx512;
+}
+#else
+static Isa probeIsa() {
+    return kIsaScalar;
+}
+#endif
+
+Isa detectIsa() {
+    static const Isa isa = probeIsa();
+    return isa;
+}
+
+char const* isaName(Isa isa) {
+    switch (isa) {
+    case kIsaSse4:      return "sse4";
+    case kIsaAvx2:      return "avx2";
+    case kIsaAvx512:    return "avx512";
+    default:            return "scalar";
+    }
+}
+
+bool toIsa(std::string const& name, Isa *isa) {
+    for (int i = 0; i < kNumIsas; ++i) {
+        if (name == isaName((Isa)i)) {
+            *isa = (Isa)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef void (*Kernel)(void const *src, void *dst, size_t n, float scale, float bias);
+
+template <Dtype S, Dtype D, bool A>
+static void scalarKernel(void const *src, void *dst, size_t n, float scale, float bias) {
+    kernels::convertScalar<S, D, A>(src, dst, 0, n, scale, bias);
+}
+
+template <Dtype S, Dtype D, bool A>
+static Kernel kernelOf(Isa isa) {
+    switch (isa) {
+#ifdef NODEMENOH_X86
+    case kIsaSse4:      return kernels::convertSse4<S, D, A>;
+    case kIsaAvx2:      return kernels::convertAvx2<S, D, A>;
+    case kIsaAvx512:    return kernels::convertAvx512<S, D, A>;
+#endif
+    default:            return scalarKernel<S, D, A>;
+    }
+}
+
+template <Dtype S, bool A>
+static Kernel kernelOf(Dtype dst, Isa isa) {
+    switch (dst) {
+    case kUint8:    return kernelOf<S, kUint8, A>(isa);
+    case kInt16:    return kernelOf<S, kInt16, A>(isa);
+    case kFloat16:  return kernelOf<S, kFloat16, A>(isa);
+    default:        return kernelOf<S, kFloat32, A>(isa);
+    }
+}
+
+template <bool A>
+static Kernel kernelOf(Dtype src, Dtype dst, Isa isa) {
+    switch (src) {
+    case kUint8:    return kernelOf<kUint8, A>(dst, isa);
+    case kInt16:    return kernelOf<kInt16, A>(dst, isa);
+    case kFloat16:  return kernelOf<kFloat16, A>(dst, isa);
+    default:        return kernelOf<kFloat32, A>(dst, isa);
+    }
+}
+
+void convert(   Dtype srcDtype, void const *src,
+                Dtype dstDtype, void *dst,
+                size_t n,
+                Affine const *affine,
+                Isa isa) {
+    if (srcDtype == dstDtype && !affine) {
+        ::memcpy(dst, src, n * dtypeSize(srcDtype));
+        return;
+    }
+    if (isa == kIsaAuto) {
+        isa = detectIsa();
+    }
+    if (affine) {
+        kernelOf<true>(srcDtype, dstDtype, isa)(src, dst, n, affine->scale, affine->bias);
+    } else {
+        kernelOf<false>(srcDtype, dstDtype, isa)(src, dst, n, 1.0f, 0.0f);
+    }
+}
+
+void widen(Dtype dtype, void const *src, float *dst, size_t n) {
+    convert(dtype, src, kFloat32, dst, n);
+}
+
+bool typedArrayDtype(v8::Local<v8::Value> val, Dtype *dtype) {
+    if (val->IsFloat32Array()) {
+        *dtype = kFloat32;
+    } else if (val->IsUint8Array() || val->IsUint8ClampedArray()) {
+        *dtype = kUint8;
+    } else if (val->IsInt16Array()) {
+        *dtype = kInt16;
+    } else if (val->IsUint16Array()) {
+        *dtype = kFloat16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+double loadElement(Dtype dtype, void const *buf, size_t i) {
+    switch (dtype) {
+    case kUint8:    return static_cast<uint8_t const*>(buf)[i];
+    case kInt16:    return static_cast<int16_t const*>(buf)[i];
+    case kFloat16:  return fromFloat16(static_cast<uint16_t const*>(buf)[i]);
+    default:        return static_cast<float const*>(buf)[i];
+    }
+}
+
+static double saturate(double v, double lo, double hi) {
+    if (std::isnan(v)) {
+        return 0;
+    }
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+void storeElement(Dtype dtype, void *buf, size_t i, double value) {
+    switch (dtype) {
+    case kUint8:
+        static_cast<uint8_t*>(buf)[i] = (uint8_t)saturate(value, 0, 255);
+        break;
+    case kInt16:
+        static_cast<int16_t*>(buf)[i] = (int16_t)saturate(value, -32768, 32767);
+        break;
+    case kFloat16:
+        static_cast<uint16_t*>(buf)[i] = toFloat16((float)value);
+        break;
+    default:
+        static_cast<float*>(buf)[i] = (float)value;
+        break;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ConvertKernels class
+
+void ConvertKernels::Init(v8::Local<v8::Object> exports) {
+    exports->Set(Nan::New("convert").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(Convert)->GetFunction());
+    exports->Set(Nan::New("getConvertKernels").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(GetConvertKernels)->GetFunction());
+}
+
+NAN_METHOD(ConvertKernels::Convert) {
+    if (info.Length() < 2) {
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    Dtype srcDtype, dstDtype;
+    if (!typedArrayDtype(info[0], &srcDtype)) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a Float32Array, Uint8Array, Int16Array or Uint16Array");
+        return;
+    }
+    if (!typedArrayDtype(info[1], &dstDtype)) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be a Float32Array, Uint8Array, Int16Array or Uint16Array");
+        return;
+    }
+
+    Nan::TypedArrayContents<char> src(info[0]);
+    Nan::TypedArrayContents<char> dst(info[1]);
+    size_t n = src.length() / dtypeSize(srcDtype);
+    if (dst.length() / dtypeSize(dstDtype) != n) {
+        Nan::ThrowRangeError("node-menoh arrays must have the same length");
+        return;
+    }
+
+    // info[2] - options (optional)
+    Affine affine = { 1.0f, 0.0f };
+    bool normalize = false;
+    Isa isa = kIsaAuto;
+    if (info.Length() > 2 && !info[2]->IsUndefined()) {
+        if (!info[2]->IsObject()) {
+            Nan::ThrowTypeError("node-menoh arg 3 must be an object");
+            return;
+        }
+        v8::Local<v8::Object> options = info[2]->ToObject();
+        v8::Local<v8::String> key;
+
+        key = Nan::New("scale").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            if (!val->IsNumber()) {
+                Nan::ThrowTypeError("node-menoh scale must be a number");
+                return;
+            }
+            affine.scale = (float)val->NumberValue();
+            normalize = true;
+        }
+
+        key = Nan::New("bias").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            if (!val->IsNumber()) {
+                Nan::ThrowTypeError("node-menoh bias must be a number");
+                return;
+            }
+            affine.bias = (float)val->NumberValue();
+            normalize = true;
+        }
+
+        key = Nan::New("isa").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            if (!val->IsString() || !toIsa(*Nan::Utf8String(val), &isa)) {
+                Nan::ThrowTypeError("node-menoh isa must be 'scalar', 'sse4', 'avx2' or 'avx512'");
+                return;
+            }
+            if (isa > detectIsa()) {
+                Nan::ThrowError("node-menoh isa is not supported by the CPU");
+                return;
+            }
+        }
+    }
+
+    convert(srcDtype, *src, dstDtype, *dst, n, normalize ? &affine : NULL, isa);
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(ConvertKernels::GetConvertKernels) {
+    Isa best = detectIsa();
+    v8::Local<v8::Array> supported = Nan::New<v8::Array>();
+    for (int i = 0; i <= (int)best; ++i) {
+        supported->Set((uint32_t)i, Nan::New(isaName((Isa)i)).ToLocalChecked());
+    }
+
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    results->Set(Nan::New("isa").ToLocalChecked(), Nan::New(isaName(best)).ToLocalChecked());
+    results->Set(Nan::New("supported").ToLocalChecked(), supported);
+    info.GetReturnValue().Set(results);
+}
+
+
+}  // namespace nodeMenoh
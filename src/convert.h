@@ -0,0 +1,87 @@
+#ifndef NODEMENOH_CONVERT_H
+#define NODEMENOH_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <nan.h>
+
+namespace nodeMenoh {
+
+// Element types of the input buffers exchanged with JavaScript. The models
+// compute in float32; compact inputs (e.g. uint8 images) are widened to
+// float32 by the worker thread before a run.
+enum Dtype {
+    kFloat32 = 0,
+    kUint8,
+    kInt16,
+    kFloat16    // IEEE 754 half precision, as raw uint16 bits in JavaScript
+};
+
+size_t dtypeSize(Dtype dtype);
+char const* dtypeName(Dtype dtype);
+
+// Reads a dtype name. Returns false if unknown.
+bool toDtype(std::string const& name, Dtype *dtype);
+
+// Converts a half precision value to/from float32.
+float fromFloat16(uint16_t h);
+uint16_t toFloat16(float f);
+
+// Instruction sets of the conversion kernels (see convert_kernels.h)
+enum Isa {
+    kIsaAuto = -1,  // the best one supported by the CPU
+    kIsaScalar = 0,
+    kIsaSse4,       // SSE4.1
+    kIsaAvx2,       // AVX2 and F16C
+    kIsaAvx512,     // AVX-512F
+    kNumIsas
+};
+
+// Returns the best instruction set supported by the CPU and the OS.
+Isa detectIsa();
+char const* isaName(Isa isa);
+
+// Reads an instruction set name. Returns false if unknown.
+bool toIsa(std::string const& name, Isa *isa);
+
+// y = x * scale + bias, applied in float32 between the load and the store
+struct Affine {
+    float scale;
+    float bias;
+};
+
+// Converts `n` elements of `src` into `dst`, optionally normalizing them,
+// with the kernel of `isa`, which must be supported. The results do not
+// depend on the instruction set. (any thread)
+void convert(   Dtype srcDtype, void const *src,
+                Dtype dstDtype, void *dst,
+                size_t n,
+                Affine const *affine = NULL,
+                Isa isa = kIsaAuto);
+
+// Widens `n` elements of `src` to float32. (any thread)
+void widen(Dtype dtype, void const *src, float *dst, size_t n);
+
+// Returns the dtype of the elements of a typed array (Uint16Array for
+// float16, Uint8ClampedArray for uint8). Returns false for other values.
+bool typedArrayDtype(v8::Local<v8::Value> val, Dtype *dtype);
+
+// Conversion functions exported to JavaScript
+class ConvertKernels {
+    public:
+        static void Init(v8::Local<v8::Object> exports);
+
+    private:
+        static NAN_METHOD(Convert);
+        static NAN_METHOD(GetConvertKernels);
+};
+
+// Reads/writes the `i`th element of a buffer of `dtype` as a number.
+// Values out of range of integer types are saturated.
+double loadElement(Dtype dtype, void const *buf, size_t i);
+void storeElement(Dtype dtype, void *buf, size_t i, double value);
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_CONVERT_H
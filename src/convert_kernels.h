@@ -0,0 +1,285 @@
+#ifndef NODEMENOH_CONVERT_KERNELS_H
+#define NODEMENOH_CONVERT_KERNELS_H
+
+// Conversion kernels, instantiated for every source dtype x destination
+// dtype x (with or without) affine normalization, on top of a set of
+// vector operations per instruction set. Only convert.cpp includes this.
+//
+// Every kernel computes exactly what the scalar one does: elements are
+// loaded as float32, optionally mapped by y = x * scale + bias (a multiply
+// then an add, never fused), and stored with
+//   float32: as is
+//   float16: rounded to nearest even (NaN quieted, as F16C does)
+//   uint8, int16: NaN as 0, saturated, truncated toward zero
+// so the variant picked at runtime never changes a result. (The addon is
+// built with -ffp-contract=off for the same reason.)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "convert.h"
+#include "simd.h"
+
+namespace nodeMenoh {
+namespace kernels {
+
+template <Dtype D> struct Tag {};
+
+// Scalar element operations
+struct Scalar {
+    static float load(Tag<kFloat32>, void const *p, size_t i) {
+        return static_cast<float const*>(p)[i];
+    }
+    static float load(Tag<kUint8>, void const *p, size_t i) {
+        return static_cast<uint8_t const*>(p)[i];
+    }
+    static float load(Tag<kInt16>, void const *p, size_t i) {
+        return static_cast<int16_t const*>(p)[i];
+    }
+    static float load(Tag<kFloat16>, void const *p, size_t i) {
+        return fromFloat16(static_cast<uint16_t const*>(p)[i]);
+    }
+
+    static float clamp(float x, float lo, float hi) {
+        if (x != x) {
+            return 0;   // NaN
+        }
+        return x < lo ? lo : (x > hi ? hi : x);
+    }
+
+    static void store(Tag<kFloat32>, void *p, size_t i, float x) {
+        static_cast<float*>(p)[i] = x;
+    }
+    static void store(Tag<kUint8>, void *p, size_t i, float x) {
+        static_cast<uint8_t*>(p)[i] = (uint8_t)clamp(x, 0.0f, 255.0f);
+    }
+    static void store(Tag<kInt16>, void *p, size_t i, float x) {
+        static_cast<int16_t*>(p)[i] = (int16_t)clamp(x, -32768.0f, 32767.0f);
+    }
+    static void store(Tag<kFloat16>, void *p, size_t i, float x) {
+        static_cast<uint16_t*>(p)[i] = toFloat16(x);
+    }
+};
+
+// Converts elements [begin, n) one by one.
+template <Dtype S, Dtype D, bool Affine>
+void convertScalar(void const *src, void *dst, size_t begin, size_t n, float scale, float bias) {
+    for (size_t i = begin; i < n; ++i) {
+        float x = Scalar::load(Tag<S>(), src, i);
+        if (Affine) {
+            x = x * scale;
+            x = x + bias;
+        }
+        Scalar::store(Tag<D>(), dst, i, x);
+    }
+}
+
+#ifdef NODEMENOH_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE4.1: 4 elements at a time. float16 goes through the scalar conversion
+// (F16C comes with AVX).
+
+struct Sse4 {
+    typedef __m128 F;
+    static const size_t N = 4;
+
+    NODEMENOH_SSE4 static F load(Tag<kFloat32>, void const *p, size_t i) {
+        return _mm_loadu_ps(static_cast<float const*>(p) + i);
+    }
+    NODEMENOH_SSE4 static F load(Tag<kUint8>, void const *p, size_t i) {
+        int32_t v;
+        ::memcpy(&v, static_cast<uint8_t const*>(p) + i, sizeof(v));
+        return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+    }
+    NODEMENOH_SSE4 static F load(Tag<kInt16>, void const *p, size_t i) {
+        __m128i v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(static_cast<int16_t const*>(p) + i));
+        return _mm_cvtepi32_ps(_mm_cvtepi16_epi32(v));
+    }
+    NODEMENOH_SSE4 static F load(Tag<kFloat16>, void const *p, size_t i) {
+        uint16_t const *h = static_cast<uint16_t const*>(p) + i;
+        return _mm_setr_ps(fromFloat16(h[0]), fromFloat16(h[1]), fromFloat16(h[2]), fromFloat16(h[3]));
+    }
+
+    NODEMENOH_SSE4 static F affine(F x, float scale, float bias) {
+        return _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(scale)), _mm_set1_ps(bias));
+    }
+
+    // NaN as 0, saturated, truncated
+    NODEMENOH_SSE4 static __m128i toInt(F x, float lo, float hi) {
+        x = _mm_and_ps(x, _mm_cmpord_ps(x, x));
+        x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(lo)), _mm_set1_ps(hi));
+        return _mm_cvttps_epi32(x);
+    }
+
+    NODEMENOH_SSE4 static void store(Tag<kFloat32>, void *p, size_t i, F x) {
+        _mm_storeu_ps(static_cast<float*>(p) + i, x);
+    }
+    NODEMENOH_SSE4 static void store(Tag<kUint8>, void *p, size_t i, F x) {
+        __m128i v = _mm_packus_epi32(toInt(x, 0.0f, 255.0f), _mm_setzero_si128());
+        int32_t b = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+        ::memcpy(static_cast<uint8_t*>(p) + i, &b, sizeof(b));
+    }
+    NODEMENOH_SSE4 static void store(Tag<kInt16>, void *p, size_t i, F x) {
+        __m128i v = _mm_packs_epi32(toInt(x, -32768.0f, 32767.0f), _mm_setzero_si128());
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(static_cast<int16_t*>(p) + i), v);
+    }
+    NODEMENOH_SSE4 static void store(Tag<kFloat16>, void *p, size_t i, F x) {
+        float f[4];
+        _mm_storeu_ps(f, x);
+        uint16_t *h = static_cast<uint16_t*>(p) + i;
+        for (size_t k = 0; k < 4; ++k) {
+            h[k] = toFloat16(f[k]);
+        }
+    }
+};
+
+template <Dtype S, Dtype D, bool Affine>
+NODEMENOH_SSE4 void convertSse4(void const *src, void *dst, size_t n, float scale, float bias) {
+    size_t i = 0;
+    for (; i + Sse4::N <= n; i += Sse4::N) {
+        Sse4::F x = Sse4::load(Tag<S>(), src, i);
+        if (Affine) {
+            x = Sse4::affine(x, scale, bias);
+        }
+        Sse4::store(Tag<D>(), dst, i, x);
+    }
+    convertScalar<S, D, Affine>(src, dst, i, n, scale, bias);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 + F16C: 8 elements at a time.
+
+struct Avx2 {
+    typedef __m256 F;
+    static const size_t N = 8;
+
+    NODEMENOH_AVX2 static F load(Tag<kFloat32>, void const *p, size_t i) {
+        return _mm256_loadu_ps(static_cast<float const*>(p) + i);
+    }
+    NODEMENOH_AVX2 static F load(Tag<kUint8>, void const *p, size_t i) {
+        __m128i v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(static_cast<uint8_t const*>(p) + i));
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+    }
+    NODEMENOH_AVX2 static F load(Tag<kInt16>, void const *p, size_t i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(static_cast<int16_t const*>(p) + i));
+        return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+    }
+    NODEMENOH_AVX2 static F load(Tag<kFloat16>, void const *p, size_t i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(static_cast<uint16_t const*>(p) + i));
+        return _mm256_cvtph_ps(v);
+    }
+
+    NODEMENOH_AVX2 static F affine(F x, float scale, float bias) {
+        return _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(scale)), _mm256_set1_ps(bias));
+    }
+
+    // NaN as 0, saturated, truncated
+    NODEMENOH_AVX2 static __m256i toInt(F x, float lo, float hi) {
+        x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q));
+        x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(lo)), _mm256_set1_ps(hi));
+        return _mm256_cvttps_epi32(x);
+    }
+
+    NODEMENOH_AVX2 static void store(Tag<kFloat32>, void *p, size_t i, F x) {
+        _mm256_storeu_ps(static_cast<float*>(p) + i, x);
+    }
+    NODEMENOH_AVX2 static void store(Tag<kUint8>, void *p, size_t i, F x) {
+        __m256i v = toInt(x, 0.0f, 255.0f);
+        __m128i w = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(static_cast<uint8_t*>(p) + i), _mm_packus_epi16(w, w));
+    }
+    NODEMENOH_AVX2 static void store(Tag<kInt16>, void *p, size_t i, F x) {
+        __m256i v = toInt(x, -32768.0f, 32767.0f);
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(static_cast<int16_t*>(p) + i), w);
+    }
+    NODEMENOH_AVX2 static void store(Tag<kFloat16>, void *p, size_t i, F x) {
+        __m128i h = _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(static_cast<uint16_t*>(p) + i), h);
+    }
+};
+
+template <Dtype S, Dtype D, bool Affine>
+NODEMENOH_AVX2 void convertAvx2(void const *src, void *dst, size_t n, float scale, float bias) {
+    size_t i = 0;
+    for (; i + Avx2::N <= n; i += Avx2::N) {
+        Avx2::F x = Avx2::load(Tag<S>(), src, i);
+        if (Affine) {
+            x = Avx2::affine(x, scale, bias);
+        }
+        Avx2::store(Tag<D>(), dst, i, x);
+    }
+    convertScalar<S, D, Affine>(src, dst, i, n, scale, bias);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512F: 16 elements at a time.
+
+struct Avx512 {
+    typedef __m512 F;
+    static const size_t N = 16;
+
+    NODEMENOH_AVX512 static F load(Tag<kFloat32>, void const *p, size_t i) {
+        return _mm512_loadu_ps(static_cast<float const*>(p) + i);
+    }
+    NODEMENOH_AVX512 static F load(Tag<kUint8>, void const *p, size_t i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(static_cast<uint8_t const*>(p) + i));
+        return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(v));
+    }
+    NODEMENOH_AVX512 static F load(Tag<kInt16>, void const *p, size_t i) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(static_cast<int16_t const*>(p) + i));
+        return _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(v));
+    }
+    NODEMENOH_AVX512 static F load(Tag<kFloat16>, void const *p, size_t i) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(static_cast<uint16_t const*>(p) + i));
+        return _mm512_cvtph_ps(v);
+    }
+
+    NODEMENOH_AVX512 static F affine(F x, float scale, float bias) {
+        return _mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(scale)), _mm512_set1_ps(bias));
+    }
+
+    // NaN as 0, saturated, truncated
+    NODEMENOH_AVX512 static __m512i toInt(F x, float lo, float hi) {
+        x = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, x, _CMP_ORD_Q), x);
+        x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(lo)), _mm512_set1_ps(hi));
+        return _mm512_cvttps_epi32(x);
+    }
+
+    NODEMENOH_AVX512 static void store(Tag<kFloat32>, void *p, size_t i, F x) {
+        _mm512_storeu_ps(static_cast<float*>(p) + i, x);
+    }
+    NODEMENOH_AVX512 static void store(Tag<kUint8>, void *p, size_t i, F x) {
+        __m128i v = _mm512_cvtusepi32_epi8(toInt(x, 0.0f, 255.0f));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(static_cast<uint8_t*>(p) + i), v);
+    }
+    NODEMENOH_AVX512 static void store(Tag<kInt16>, void *p, size_t i, F x) {
+        __m256i v = _mm512_cvtsepi32_epi16(toInt(x, -32768.0f, 32767.0f));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(static_cast<int16_t*>(p) + i), v);
+    }
+    NODEMENOH_AVX512 static void store(Tag<kFloat16>, void *p, size_t i, F x) {
+        __m256i h = _mm512_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(static_cast<uint16_t*>(p) + i), h);
+    }
+};
+
+template <Dtype S, Dtype D, bool Affine>
+NODEMENOH_AVX512 void convertAvx512(void const *src, void *dst, size_t n, float scale, float bias) {
+    size_t i = 0;
+    for (; i + Avx512::N <= n; i += Avx512::N) {
+        Avx512::F x = Avx512::load(Tag<S>(), src, i);
+        if (Affine) {
+            x = Avx512::affine(x, scale, bias);
+        }
+        Avx512::store(Tag<D>(), dst, i, x);
+    }
+    convertScalar<S, D, Affine>(src, dst, i, n, scale, bias);
+}
+
+#endif  // NODEMENOH_X86
+
+}  // namespace kernels
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_CONVERT_KERNELS_H
@@ -0,0 +1,200 @@
+#ifndef NODEMENOH_DISTANCE_KERNELS_H
+#define NODEMENOH_DISTANCE_KERNELS_H
+
+// Distance kernels of the vector index, one set per instruction set. Only
+// vector_index.cpp includes this.
+//
+// Each kernel reduces a float32 query against a stored row of float32 or
+// int8 elements. The variants sum the elements in a different order, so
+// the last bits of a distance may depend on the instruction set.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "simd.h"
+
+namespace nodeMenoh {
+namespace kernels {
+
+// a . b
+inline float dotScalar(float const *a, float const *b, size_t n) {
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        s += a[i] * b[i];
+    }
+    return s;
+}
+
+// |a - b|^2
+inline float l2Scalar(float const *a, float const *b, size_t n) {
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float d = a[i] - b[i];
+        s += d * d;
+    }
+    return s;
+}
+
+// a . b with int8 elements in `b`
+inline float dotInt8Scalar(float const *a, int8_t const *b, size_t n) {
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        s += a[i] * b[i];
+    }
+    return s;
+}
+
+#ifdef NODEMENOH_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE4.1: 4 elements at a time, with two accumulators.
+
+NODEMENOH_SSE4 inline float sumSse4(__m128 x) {
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+
+NODEMENOH_SSE4 inline __m128 loadInt8Sse4(int8_t const *p) {
+    int32_t v;
+    ::memcpy(&v, p, sizeof(v));
+    return _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(v)));
+}
+
+NODEMENOH_SSE4 inline float dotSse4(float const *a, float const *b, size_t n) {
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    return sumSse4(_mm_add_ps(s0, s1)) + dotScalar(a + i, b + i, n - i);
+}
+
+NODEMENOH_SSE4 inline float l2Sse4(float const *a, float const *b, size_t n) {
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(d1, d1));
+    }
+    return sumSse4(_mm_add_ps(s0, s1)) + l2Scalar(a + i, b + i, n - i);
+}
+
+NODEMENOH_SSE4 inline float dotInt8Sse4(float const *a, int8_t const *b, size_t n) {
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), loadInt8Sse4(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), loadInt8Sse4(b + i + 4)));
+    }
+    return sumSse4(_mm_add_ps(s0, s1)) + dotInt8Scalar(a + i, b + i, n - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2: 8 elements at a time, with two accumulators.
+
+NODEMENOH_AVX2 inline float sumAvx2(__m256 x) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+NODEMENOH_AVX2 inline __m256 loadInt8Avx2(int8_t const *p) {
+    __m128i v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(v));
+}
+
+NODEMENOH_AVX2 inline float dotAvx2(float const *a, float const *b, size_t n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    return sumAvx2(_mm256_add_ps(s0, s1)) + dotScalar(a + i, b + i, n - i);
+}
+
+NODEMENOH_AVX2 inline float l2Avx2(float const *a, float const *b, size_t n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(d0, d0));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(d1, d1));
+    }
+    return sumAvx2(_mm256_add_ps(s0, s1)) + l2Scalar(a + i, b + i, n - i);
+}
+
+NODEMENOH_AVX2 inline float dotInt8Avx2(float const *a, int8_t const *b, size_t n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), loadInt8Avx2(b + i)));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), loadInt8Avx2(b + i + 8)));
+    }
+    return sumAvx2(_mm256_add_ps(s0, s1)) + dotInt8Scalar(a + i, b + i, n - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512F: 16 elements at a time.
+
+NODEMENOH_AVX512 inline float sumAvx512(__m512 x) {
+    __m256 lo = _mm512_castps512_ps256(x);
+    __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(x), 1));
+    __m256 y = _mm256_add_ps(lo, hi);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(y), _mm256_extractf128_ps(y, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+NODEMENOH_AVX512 inline __m512 loadInt8Avx512(int8_t const *p) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(v));
+}
+
+NODEMENOH_AVX512 inline float dotAvx512(float const *a, float const *b, size_t n) {
+    __m512 s = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s = _mm512_add_ps(s, _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    }
+    return sumAvx512(s) + dotScalar(a + i, b + i, n - i);
+}
+
+NODEMENOH_AVX512 inline float l2Avx512(float const *a, float const *b, size_t n) {
+    __m512 s = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        s = _mm512_add_ps(s, _mm512_mul_ps(d, d));
+    }
+    return sumAvx512(s) + l2Scalar(a + i, b + i, n - i);
+}
+
+NODEMENOH_AVX512 inline float dotInt8Avx512(float const *a, int8_t const *b, size_t n) {
+    __m512 s = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s = _mm512_add_ps(s, _mm512_mul_ps(_mm512_loadu_ps(a + i), loadInt8Avx512(b + i)));
+    }
+    return sumAvx512(s) + dotInt8Scalar(a + i, b + i, n - i);
+}
+
+#endif  // NODEMENOH_X86
+
+}  // namespace kernels
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_DISTANCE_KERNELS_H
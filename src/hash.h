@@ -0,0 +1,15 @@
+#ifndef NODEMENOH_HASH_H
+#define NODEMENOH_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace nodeMenoh {
+
+// 64-bit xxHash (XXH64) of the given bytes.
+// Multiple buffers can be hashed by passing the previous hash as the seed.
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_HASH_H
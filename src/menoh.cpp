@@ -1,14 +1,36 @@
 
 #include <nan.h>
+#include "addon_data.h"
+#include "convert.h"
 #include "model.h"
+#include "model_data_cache.h"
+#include "model_registry.h"
+#include "model_pool.h"
+#include "result_cache.h"
+#include "shared_ring.h"
+#include "thread_budget.h"
+#include "variable.h"
+#include "vector_index.h"
 
 namespace nodeMenoh {
 
 NAN_MODULE_INIT(InitAll) {
-    ModelBuilder::Init(target);
-    Model::Init(target);
+    // One instance per environment (the main thread or a worker thread).
+    AddonData *addon = new AddonData(v8::Isolate::GetCurrent());
+
+    ModelBuilder::Init(target, addon);
+    Model::Init(target, addon);
+    ModelRegistry::Init(target, addon);
+    ModelPool::Init(target, addon);
+    ResultCache::Init(target, addon);
+    SharedRing::Init(target, addon);
+    Variable::Init(target, addon);
+    VectorIndex::Init(target, addon);
+    ThreadBudget::Init(target);
+    ModelDataCache::Init(target);
+    ConvertKernels::Init(target);
 }
 
-NODE_MODULE(NODE_GYP_MODULE_NAME, InitAll)
+NAN_MODULE_WORKER_ENABLED(NODE_GYP_MODULE_NAME, InitAll)
 
 }  // namespace nodeMenoh
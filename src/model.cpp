@@ -3,8 +3,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string>
+#include <algorithm>
+#include <chrono>
 #include <menoh/version.h>
 #include "model.h"
+#include "model_registry.h"
+#include "thread_budget.h"
+#include "variable.h"
+#include "tiled_run.h"
+#include "hash.h"
 
 namespace nodeMenoh {
 
@@ -16,15 +23,159 @@ static void bufferFreeCallback(char* buf, void* hint) {
     // the model object goes away. (See Model::~Model)
 }
 
+// Reads the number of warm-up iterations. (a positive integer)
+static bool toIterations(v8::Local<v8::Value> options, uint32_t *iterations) {
+    *iterations = 10;
+    if (options->IsUndefined()) {
+        return true;
+    }
+    if (!options->IsObject()) {
+        return false;
+    }
+    v8::Local<v8::String> key = Nan::New("iterations").ToLocalChecked();
+    if (!Nan::Has(options->ToObject(), key).FromJust()) {
+        return true;
+    }
+    v8::Local<v8::Value> val = Nan::Get(options->ToObject(), key).ToLocalChecked();
+    if (!val->IsUint32() || val->Uint32Value() == 0) {
+        return false;
+    }
+    *iterations = val->Uint32Value();
+    return true;
+}
+
+// Reads a number, an array of numbers or a Float32Array into `values`.
+static bool toFloats(v8::Local<v8::Value> val, std::vector<float> *values) {
+    values->clear();
+    if (val->IsNumber()) {
+        values->push_back((float)val->NumberValue());
+        return true;
+    }
+    if (val->IsFloat32Array()) {
+        Nan::TypedArrayContents<float> contents(val);
+        values->assign(*contents, *contents + contents.length());
+        return true;
+    }
+    if (val->IsArray()) {
+        v8::Local<v8::Array> arr = v8::Local<v8::Array>::Cast(val);
+        for (uint32_t i = 0; i < arr->Length(); ++i) {
+            v8::Local<v8::Value> _it = Nan::Get(arr, i).ToLocalChecked();
+            if (!_it->IsNumber()) {
+                return false;
+            }
+            values->push_back((float)_it->NumberValue());
+        }
+        return true;
+    }
+    return false;
+}
+
+v8::Local<v8::Value> makeError(const char *msg, const char *code) {
+    v8::Local<v8::Object> err = Nan::Error(msg).As<v8::Object>();
+    Nan::Set(err, Nan::New("code").ToLocalChecked(), Nan::New(code).ToLocalChecked());
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CancelState class
+
+CancelState::CancelState() : _state(kQueued) {
+}
+
+bool CancelState::start() {
+    int expected = kQueued;
+    return _state.compare_exchange_strong(expected, (int)kStarted);
+}
+
+bool CancelState::cancel() {
+    int expected = kQueued;
+    return _state.compare_exchange_strong(expected, (int)kCancelled);
+}
+
+bool CancelState::cancelled() const {
+    return _state == kCancelled;
+}
+
+void CancelState::reset() {
+    _state = kQueued;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CachedRunWorker class
+
+CachedRunWorker::CachedRunWorker(
+    Nan::Callback *callback,
+    const char *resourceName) : Nan::AsyncWorker(callback, resourceName),
+                                _queuedOn(NULL),
+                                _cache(NULL),
+                                _resumed(false),
+                                _parked(false) {
+}
+
+bool CachedRunWorker::park() {
+    if (_cache && !_resumed) {
+        // The other run has not completed yet.
+        _parked = true;
+        _cache->hold();
+        return true;
+    }
+    // Ready for the next run of a reused worker.
+    _queuedOn = NULL;
+    _cache = NULL;
+    _resumed = false;
+    return false;
+}
+
+// Called by the main thread.
+void CachedRunWorker::WorkComplete() {
+    if (park()) {
+        return;
+    }
+    Nan::AsyncWorker::WorkComplete();
+}
+
+// Called by the main thread.
+void CachedRunWorker::Destroy() {
+    if (_parked) {
+        // Destroyed by resume().
+        return;
+    }
+    Nan::AsyncWorker::Destroy();
+}
+
+// Called by the main thread.
+void CachedRunWorker::resume(ResultCache::Outputs const *outputs, std::string const& error) {
+    if (outputs) {
+        _queuedOn->unpackOutputs(*outputs);
+        resumed(_queuedOn, NULL);
+    } else {
+        resumed(_queuedOn, &error);
+    }
+    _resumed = true;
+
+    if (_parked) {
+        _parked = false;
+        _cache->unhold();
+        WorkComplete();
+        Destroy();
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // ModelBuilder class
 
-Nan::Persistent<v8::Function> ModelBuilder::constructor;
 
 ModelBuilder::ModelBuilder() :  _data(NULL),
+                                _shared(NULL),
                                 _vptBuilder(NULL),
                                 _vpt(NULL),
-                                _ivNames() {
+                                _ivNames(),
+                                _ovNames(),
+                                _dataBytes(0),
+                                _params(),
+                                _paramRefs(),
+                                _sourceDtypes(),
+                                _edited(false) {
 }
 
 ModelBuilder::~ModelBuilder() {
@@ -36,25 +187,274 @@ ModelBuilder::~ModelBuilder() {
         menoh_delete_variable_profile_table_builder(_vptBuilder);
     }
 
-    if (_data) {
+    if (_shared) {
+        ModelDataCache::release(_shared);
+    } else if (_data) {
         menoh_delete_model_data(_data);
     }
+
+    std::vector<Nan::Persistent<v8::Object>*>::iterator it;
+    for (it = _paramRefs.begin(); it != _paramRefs.end(); ++it) {
+        (*it)->Reset();
+        delete *it;
+    }
+}
+
+menoh_error_code ModelBuilder::buildProfileTable() {
+    menoh_error_code ec;
+
+    if (_shared) {
+        std::string sig = profileSignature();
+        std::lock_guard<std::mutex> lock(_shared->mutex);
+
+        // The shared data is optimized in place only once. Builders with
+        // the same profiles reuse it as is.
+        if (_shared->optimizedFor.empty() || _shared->optimizedFor == sig) {
+            ec = menoh_build_variable_profile_table(_vptBuilder, _data, &_vpt);
+            if (ec) {
+                return ec;
+            }
+
+            if (_shared->optimizedFor.empty()) {
+                ec = menoh_model_data_optimize(_data, _vpt);
+                if (ec) {
+                    return ec;
+                }
+                _shared->optimizedFor = sig;
+            }
+            return menoh_error_code_success;
+        }
+    }
+
+    if (_shared) {
+        // The shared data has been trimmed for other profiles.
+        ec = detachData();
+        if (ec) {
+            return ec;
+        }
+    }
+
+    ec = menoh_build_variable_profile_table(_vptBuilder, _data, &_vpt);
+    if (ec) {
+        return ec;
+    }
+
+    return menoh_model_data_optimize(_data, _vpt);
+}
+
+menoh_error_code ModelBuilder::detachData() {
+    menoh_model_data_handle data;
+    menoh_error_code ec;
+    ec = menoh_make_model_data_from_onnx(_shared->path().c_str(), &data);
+    if (ec) {
+        return ec;
+    }
+
+    ModelDataCache::release(_shared);
+    _shared = NULL;
+    _data = data;
+    return menoh_error_code_success;
+}
+
+menoh_error_code ModelBuilder::prepareEdit() {
+    _edited = true;
+    if (_shared) {
+        return detachData();
+    }
+    return menoh_error_code_success;
+}
+
+menoh_error_code ModelBuilder::addParameter(std::string const& name,
+                                            std::vector<int32_t> const& dims,
+                                            std::vector<float> const& values) {
+    _params.push_back(values);
+
+    menoh_error_code ec = addParameter(name, dims, &_params.back()[0]);
+    if (ec) {
+        _params.pop_back();
+    }
+    return ec;
+}
+
+menoh_error_code ModelBuilder::addParameter(std::string const& name,
+                                            std::vector<int32_t> const& dims,
+                                            float *buf) {
+    menoh_error_code ec;
+    ec = menoh_model_data_add_parameter(
+        _data, name.c_str(), menoh_dtype_float,
+        (int32_t)dims.size(), &dims[0], buf);
+    if (ec) {
+        return ec;
+    }
+
+    size_t n = 1;
+    for (size_t i = 0; i < dims.size(); ++i) {
+        n *= (size_t)dims[i];
+    }
+    _dataBytes += n * sizeof(float);
+    return menoh_error_code_success;
+}
+
+menoh_error_code ModelBuilder::addNode( std::string const& opType,
+                                        std::vector<std::string> const& inputs,
+                                        std::vector<std::string> const& outputs) {
+    menoh_error_code ec;
+    ec = menoh_model_data_add_new_node(_data, opType.c_str());
+    if (ec) {
+        return ec;
+    }
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        ec = menoh_model_data_add_input_name_to_current_node(_data, inputs[i].c_str());
+        if (ec) {
+            return ec;
+        }
+    }
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        ec = menoh_model_data_add_output_name_to_current_node(_data, outputs[i].c_str());
+        if (ec) {
+            return ec;
+        }
+    }
+    return menoh_error_code_success;
+}
+
+bool ModelBuilder::toAttribute(  std::string const& name,
+                                v8::Local<v8::Value> value,
+                                Attribute *attr) {
+    attr->name = name;
+    attr->ints.clear();
+    attr->floats.clear();
+
+    // Explicitly typed value: { type: 'int'|'float'|'ints'|'floats', value: ... }
+    std::string type;
+    if (value->IsObject() && !value->IsArray() && !value->IsTypedArray()) {
+        v8::Local<v8::Object> obj = value->ToObject();
+        v8::Local<v8::Value> _type = Nan::Get(obj, Nan::New("type").ToLocalChecked()).ToLocalChecked();
+        v8::String::Utf8Value _typeStr(_type);
+        type.assign(*_typeStr, _typeStr.length());
+        value = Nan::Get(obj, Nan::New("value").ToLocalChecked()).ToLocalChecked();
+    }
+
+    if (!type.empty()) {
+        std::vector<float> floats;
+        if (!toFloats(value, &floats) || floats.empty()) {
+            return false;
+        }
+        if (type == "int") {
+            attr->type = Attribute::kInt;
+            attr->ints.push_back((int32_t)floats[0]);
+        } else if (type == "float") {
+            attr->type = Attribute::kFloat;
+            attr->floats.push_back(floats[0]);
+        } else if (type == "ints") {
+            attr->type = Attribute::kInts;
+            attr->ints.assign(floats.begin(), floats.end());
+        } else if (type == "floats") {
+            attr->type = Attribute::kFloats;
+            attr->floats.swap(floats);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Otherwise, integral numbers are ints unless given as a Float32Array.
+    if (value->IsNumber()) {
+        double v = value->NumberValue();
+        if (v == (double)(int32_t)v) {
+            attr->type = Attribute::kInt;
+            attr->ints.push_back((int32_t)v);
+        } else {
+            attr->type = Attribute::kFloat;
+            attr->floats.push_back((float)v);
+        }
+        return true;
+    }
+
+    if (value->IsInt32Array()) {
+        Nan::TypedArrayContents<int32_t> contents(value);
+        attr->type = Attribute::kInts;
+        attr->ints.assign(*contents, *contents + contents.length());
+        return true;
+    }
+
+    std::vector<float> floats;
+    if (!toFloats(value, &floats)) {
+        return false;
+    }
+
+    bool integral = !value->IsFloat32Array();
+    for (size_t i = 0; integral && i < floats.size(); ++i) {
+        integral = (floats[i] == (float)(int32_t)floats[i]);
+    }
+    if (integral) {
+        attr->type = Attribute::kInts;
+        attr->ints.assign(floats.begin(), floats.end());
+    } else {
+        attr->type = Attribute::kFloats;
+        attr->floats.swap(floats);
+    }
+    return true;
+}
+
+menoh_error_code ModelBuilder::addAttribute(Attribute const& attr) {
+    switch (attr.type) {
+    case Attribute::kInt:
+        return menoh_model_data_add_attribute_int_to_current_node(
+            _data, attr.name.c_str(), attr.ints[0]);
+    case Attribute::kFloat:
+        return menoh_model_data_add_attribute_float_to_current_node(
+            _data, attr.name.c_str(), attr.floats[0]);
+    case Attribute::kInts:
+        return menoh_model_data_add_attribute_ints_to_current_node(
+            _data, attr.name.c_str(), (int32_t)attr.ints.size(),
+            attr.ints.empty() ? NULL : &attr.ints[0]);
+    case Attribute::kFloats:
+        return menoh_model_data_add_attribute_floats_to_current_node(
+            _data, attr.name.c_str(), (int32_t)attr.floats.size(),
+            attr.floats.empty() ? NULL : &attr.floats[0]);
+    }
+    return menoh_error_code_invalid_attribute_type;
+}
+
+std::string ModelBuilder::profileSignature() const {
+    InputVarNames ivNames(_ivNames);
+    OutputVarNames ovNames(_ovNames);
+    std::sort(ivNames.begin(), ivNames.end());
+    std::sort(ovNames.begin(), ovNames.end());
+
+    std::string sig;
+    InputVarNames::const_iterator it;
+    for (it = ivNames.begin(); it != ivNames.end(); ++it) {
+        sig += *it + '\n';
+    }
+    sig += '\n';
+    for (it = ovNames.begin(); it != ovNames.end(); ++it) {
+        sig += *it + '\n';
+    }
+    return sig;
 }
 
 
-NAN_MODULE_INIT(ModelBuilder::Init) {
+void ModelBuilder::Init(v8::Local<v8::Object> target, AddonData *addon) {
     target->Set(Nan::New("create").ToLocalChecked(),
-                Nan::New<v8::FunctionTemplate>(Create)->GetFunction());
+                Nan::New<v8::FunctionTemplate>(Create, addon->external())->GetFunction());
+    target->Set(Nan::New("createEmpty").ToLocalChecked(),
+                Nan::New<v8::FunctionTemplate>(CreateEmpty, addon->external())->GetFunction());
     target->Set(Nan::New("getNativeVersion").ToLocalChecked(),
-                Nan::New<v8::FunctionTemplate>(GetNativeVersion)->GetFunction());
+                Nan::New<v8::FunctionTemplate>(GetNativeVersion, addon->external())->GetFunction());
 
-    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
     tpl->SetClassName(Nan::New("ModelBuilder").ToLocalChecked());
     tpl->InstanceTemplate()->SetInternalFieldCount(1);
-    Nan::SetPrototypeMethod(tpl, "addInput", AddInput);
-    Nan::SetPrototypeMethod(tpl, "addOutput", AddOutput);
-    Nan::SetPrototypeMethod(tpl, "buildModel", BuildModel);
-    constructor.Reset(tpl->GetFunction());
+    Nan::SetPrototypeMethod(tpl, "addInput", AddInput, addon->external());
+    Nan::SetPrototypeMethod(tpl, "addOutput", AddOutput, addon->external());
+    Nan::SetPrototypeMethod(tpl, "buildModel", BuildModel, addon->external());
+    Nan::SetPrototypeMethod(tpl, "prependNormalization", PrependNormalization, addon->external());
+    Nan::SetPrototypeMethod(tpl, "addParameter", AddParameter, addon->external());
+    Nan::SetPrototypeMethod(tpl, "addNode", AddNode, addon->external());
+    addon->modelBuilderCons.Reset(tpl->GetFunction());
     target->Set(Nan::New("ModelBuilder").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
 }
 
@@ -68,7 +468,7 @@ NAN_METHOD(ModelBuilder::New) {
     } else {
         // Invoked as plain function `ModelBuilder(...)`, turn into construct call.
         const int argc = 0;
-        v8::Local<v8::Function> cons = Nan::New<v8::Function>(constructor);
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(AddonData::from(info)->modelBuilderCons);
         info.GetReturnValue().Set(Nan::NewInstance(cons, argc, NULL).ToLocalChecked());
     }
 }
@@ -97,13 +497,35 @@ NAN_METHOD(ModelBuilder::Create) {
     Nan::Callback *cb = new Nan::Callback(info[1].As<v8::Function>());
 
     // Start import worker.
-    LoadWorker *w = new LoadWorker(cb, path);
+    LoadWorker *w = new LoadWorker(cb, AddonData::from(info), path);
     Nan::AsyncQueueWorker(w);
 
     info.GetReturnValue().Set(Nan::Undefined());
 }
 
 
+NAN_METHOD(ModelBuilder::CreateEmpty) {
+    const int argc = 0;
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(AddonData::from(info)->modelBuilderCons);
+    v8::Local<v8::Object> obj = Nan::NewInstance(cons, argc, NULL).ToLocalChecked();
+    ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(obj);
+
+    menoh_error_code ec;
+    ec = menoh_make_model_data(&mb->_data);
+    if (ec) {
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+
+    ec = menoh_make_variable_profile_table_builder(&mb->_vptBuilder);
+    if (ec) {
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+
+    info.GetReturnValue().Set(obj);
+}
+
 NAN_METHOD(ModelBuilder::GetNativeVersion) {
     info.GetReturnValue().Set(Nan::New(MENOH_VERSION_STRING).ToLocalChecked());
 }
@@ -142,9 +564,28 @@ NAN_METHOD(ModelBuilder::AddInput) {
         int it = _it->Int32Value();
         dims.push_back(it);
     }
-    
+
+    // info[2] - options (optional)
+    Dtype sourceDtype = kFloat32;
+    if (info.Length() > 2 && !info[2]->IsUndefined()) {
+        if (!info[2]->IsObject()) {
+            Nan::ThrowTypeError("node-menoh arg 3 must be an object");
+            return;
+        }
+        v8::Local<v8::Object> options = info[2]->ToObject();
+        v8::Local<v8::String> key = Nan::New("sourceDtype").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            if (!val->IsString() || !toDtype(*Nan::Utf8String(val), &sourceDtype)) {
+                Nan::ThrowTypeError("node-menoh sourceDtype must be 'float32', 'uint8', 'int16' or 'float16'");
+                return;
+            }
+        }
+    }
+
     menoh_error_code ec;
 
+    // The model takes float32. A compact source dtype is widened natively.
     ec = menoh_variable_profile_table_builder_add_input_profile(
         mb->_vptBuilder, name.c_str(), menoh_dtype_float,
         data->Length(), &dims[0]);
@@ -156,6 +597,11 @@ NAN_METHOD(ModelBuilder::AddInput) {
     // Remember the input variable name.
     // This is used later to determine the input buffer size.
     mb->_ivNames.push_back(name);
+    if (sourceDtype != kFloat32) {
+        mb->_sourceDtypes[name] = sourceDtype;
+    } else {
+        mb->_sourceDtypes.erase(name);
+    }
 
     info.GetReturnValue().Set(Nan::Undefined());
 }
@@ -187,6 +633,8 @@ NAN_METHOD(ModelBuilder::AddOutput) {
         return;
     }
 
+    mb->_ovNames.push_back(name);
+
     info.GetReturnValue().Set(Nan::Undefined());
 }
 
@@ -204,18 +652,49 @@ NAN_METHOD(ModelBuilder::BuildModel) {
 
     menoh_error_code ec;
     ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(info.Holder());
+    AddonData *addon = AddonData::from(info);
+    v8::Local<v8::Object> config = info[0]->ToObject();
+    v8::MaybeLocal<v8::Value> _val;
+    v8::Local<v8::String> key;
 
-    // Create vpt if not created yet.
-    if (!mb->_vpt) {
-        // build variable_profile_table
-        ec = menoh_build_variable_profile_table(mb->_vptBuilder, mb->_data, &mb->_vpt);
-        if (ec) {
-            Nan::ThrowTypeError(menoh_get_last_error_message());
+    // registry
+    ModelRegistry *registry = NULL;
+    v8::Local<v8::Object> registryObj;
+    key = Nan::New("registry").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(config, key).ToLocalChecked();
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->modelRegistryCons);
+        if (!val->IsObject() || !val->InstanceOf(Nan::GetCurrentContext(), cons).FromMaybe(false)) {
+            Nan::ThrowTypeError("node-menoh registry must be a ModelRegistry");
+            return;
+        }
+        registryObj = val->ToObject();
+        registry = ObjectWrap::Unwrap<ModelRegistry>(registryObj);
+    }
+
+    // resultCache
+    ResultCache *resultCache = NULL;
+    v8::Local<v8::Object> resultCacheObj;
+    key = Nan::New("resultCache").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(config, key).ToLocalChecked();
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->resultCacheCons);
+        if (!val->IsObject() || !val->InstanceOf(Nan::GetCurrentContext(), cons).FromMaybe(false)) {
+            Nan::ThrowTypeError("node-menoh resultCache must be a ResultCache");
             return;
         }
+        resultCacheObj = val->ToObject();
+        resultCache = ObjectWrap::Unwrap<ResultCache>(resultCacheObj);
+        if (!resultCache->bind(mb)) {
+            Nan::ThrowTypeError("node-menoh resultCache is used by another builder");
+            return;
+        }
+    }
 
-        // optimize
-        ec = menoh_model_data_optimize(mb->_data, mb->_vpt);
+    // Create vpt if not created yet.
+    if (!mb->_vpt) {
+        // build variable_profile_table and optimize
+        ec = mb->buildProfileTable();
         if (ec) {
             Nan::ThrowTypeError(menoh_get_last_error_message());
             return;
@@ -225,17 +704,13 @@ NAN_METHOD(ModelBuilder::BuildModel) {
     // Create a new Model instance.
     const int argc = 1;
     v8::Local<v8::Value> argv[argc] = { info.Holder() };
-    v8::Local<v8::Function> cons = Nan::New<v8::Function>(Model::constructor);
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->modelCons);
     v8::Local<v8::Object> wrappedModel = Nan::NewInstance(cons, argc, argv).ToLocalChecked();
     info.GetReturnValue().Set(wrappedModel);
 
     // Set up the model
     Model* model = ObjectWrap::Unwrap<Model>(wrappedModel);
 
-    v8::MaybeLocal<v8::Value> _val;
-    v8::Local<v8::Object> config = info[0]->ToObject();
-    v8::Local<v8::String> key;
-
     // backendName
     key = Nan::New("backendName").ToLocalChecked();
     if (Nan::Has(config, key).FromJust()) {
@@ -260,53 +735,424 @@ NAN_METHOD(ModelBuilder::BuildModel) {
         }
     }
 
-    ec = model->setUp(mb);
-    if (ec) {
-        Nan::ThrowTypeError(menoh_get_last_error_message());
-        return;
+    // footprint (bytes accounted in the registry)
+    key = Nan::New("footprint").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        _val = Nan::Get(config, key);
+        if (!_val.IsEmpty()) {
+            v8::Local<v8::Value> val = _val.ToLocalChecked();
+            if (!val->IsNumber() || val->NumberValue() < 0) {
+                Nan::ThrowTypeError("node-menoh footprint must be a non-negative number");
+                return;
+            }
+            model->_footprint = (size_t)val->NumberValue();
+        }
     }
-}
 
-////////////////////////////////////////////////////////////////////////////////
-// ModelBuilder::LoadWorker class
+    // alignment (of the input/output buffers)
+    key = Nan::New("alignment").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(config, key).ToLocalChecked();
+        if (!val->IsUint32() || !TensorArena::isValidAlignment(val->Uint32Value())) {
+            Nan::ThrowTypeError("node-menoh alignment must be a power of two between 8 and 2097152");
+            return;
+        }
+        model->_alignment = val->Uint32Value();
+    }
 
-ModelBuilder::LoadWorker::LoadWorker(
-    Nan::Callback *callback,
-    const std::string& onnxPath) :  Nan::AsyncWorker(callback), _onnxPath(onnxPath) {
-}
+    // hugePages
+    key = Nan::New("hugePages").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        model->_hugePages = Nan::Get(config, key).ToLocalChecked()->BooleanValue();
+    }
 
-ModelBuilder::LoadWorker::~LoadWorker() {
-}
+    // threads (intra-op threads of a run)
+    key = Nan::New("threads").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(config, key).ToLocalChecked();
+        if (val->IsString() && std::string(*Nan::Utf8String(val)) == "auto") {
+            model->_threads = ThreadBudget::kAuto;
+        } else if (val->IsUint32() && val->Uint32Value() > 0) {
+            model->_threads = (int)val->Uint32Value();
+        } else {
+            Nan::ThrowTypeError("node-menoh threads must be a positive integer or 'auto'");
+            return;
+        }
+    }
 
-void ModelBuilder::LoadWorker::Execute() {
-    // Load ONNX model data
-    menoh_error_code ec = menoh_make_model_data_from_onnx(_onnxPath.c_str(), &_data);
+    // warmup
+    uint32_t warmupIterations = 0;
+    key = Nan::New("warmup").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        if (!toIterations(Nan::Get(config, key).ToLocalChecked(), &warmupIterations)) {
+            Nan::ThrowTypeError("node-menoh warmup.iterations must be a positive integer");
+            return;
+        }
+    }
+
+    ec = model->setUp(mb);
     if (ec) {
-        SetErrorMessage(menoh_get_last_error_message());
+        Nan::ThrowTypeError(model->setUpErrorMessage());
         return;
     }
-}
 
-void ModelBuilder::LoadWorker::HandleOKCallback() {
-    Nan::HandleScope scope;
-    const int argc = 0;
-    v8::Local<v8::Function> cons = Nan::New<v8::Function>(constructor);
-    v8::Local<v8::Object> obj = Nan::NewInstance(cons, argc, NULL).ToLocalChecked();
-    Nan::AsyncResource resource("ModelBuilder.LoadWorker.OKCallback");
+    if (warmupIterations > 0) {
+        // Blocks like the build itself. (see also model.warmup())
+        ec = model->warmup(warmupIterations, &model->_warmupLatencies);
+        if (ec) {
+            Nan::ThrowTypeError(menoh_get_last_error_message());
+            return;
+        }
+    }
 
-    // Copy _data to ModelBuilder#_data.
-    ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(obj);
-    mb->_data = _data;
+    if (resultCache) {
+        model->_resultCache = resultCache;
+        model->_resultCacheObj.Reset(resultCacheObj);
+    }
 
-    // Create variable profile table builder.
-    menoh_error_code ec;
-    ec = menoh_make_variable_profile_table_builder(&mb->_vptBuilder);
-    if (ec) {
-        v8::Local<v8::Value> _argv[] = {
-            v8::Exception::Error(Nan::New(menoh_get_last_error_message()).ToLocalChecked())
-        };
-        callback->Call(1, _argv, &resource);
-        return;
+    if (registry) {
+        model->_registry = registry;
+        model->_registryObj.Reset(registryObj);
+        registry->add(model);
+    }
+}
+
+NAN_METHOD(ModelBuilder::PrependNormalization) {
+    if (info.Length() < 2) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsString()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a string");
+        return;
+    }
+    if (!info[1]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be an object");
+        return;
+    }
+
+    ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(info.Holder());
+
+    // info[0] - name of the input variable to normalize
+    v8::String::Utf8Value _name(info[0]);
+    std::string name(*_name, _name.length());
+    std::string rawName(name + "_raw");
+
+    // info[1] - options
+    v8::Local<v8::Object> opts = info[1]->ToObject();
+    v8::Local<v8::String> key;
+    std::vector<float> mean(1, 0.0f);
+    std::vector<float> stddev(1, 1.0f);
+    std::vector<float> scale(1, 1.0f);
+
+    key = Nan::New("mean").ToLocalChecked();
+    if (Nan::Has(opts, key).FromJust() &&
+        !toFloats(Nan::Get(opts, key).ToLocalChecked(), &mean)) {
+        Nan::ThrowTypeError("node-menoh mean must be a number or an array of numbers");
+        return;
+    }
+    key = Nan::New("std").ToLocalChecked();
+    if (Nan::Has(opts, key).FromJust() &&
+        !toFloats(Nan::Get(opts, key).ToLocalChecked(), &stddev)) {
+        Nan::ThrowTypeError("node-menoh std must be a number or an array of numbers");
+        return;
+    }
+    key = Nan::New("scale").ToLocalChecked();
+    if (Nan::Has(opts, key).FromJust() &&
+        (!toFloats(Nan::Get(opts, key).ToLocalChecked(), &scale) || scale.size() != 1)) {
+        Nan::ThrowTypeError("node-menoh scale must be a number");
+        return;
+    }
+    key = Nan::New("name").ToLocalChecked();
+    if (Nan::Has(opts, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(opts, key).ToLocalChecked();
+        if (!val->IsString()) {
+            Nan::ThrowTypeError("node-menoh name must be a string");
+            return;
+        }
+        v8::String::Utf8Value _rawName(val);
+        rawName.assign(*_rawName, _rawName.length());
+    }
+
+    // One value per channel. A single value applies to all channels.
+    size_t channels = std::max(mean.size(), stddev.size());
+    if ((mean.size() != 1 && mean.size() != channels) ||
+        (stddev.size() != 1 && stddev.size() != channels)) {
+        Nan::ThrowTypeError("node-menoh mean and std must have the same length");
+        return;
+    }
+    if (mean.size() == 1) {
+        mean.resize(channels, mean[0]);
+    }
+    if (stddev.size() == 1) {
+        stddev.resize(channels, stddev[0]);
+    }
+
+    // y = (x * scale - mean) / std is expressed as a BatchNormalization
+    // y = gamma * (x - mu) / sqrt(var + epsilon) + beta
+    // with gamma = scale / std, beta = -mean / std, mu = 0 and var + epsilon = 1.
+    const float epsilon = 1e-5f;
+    std::vector<float> gamma(channels), beta(channels);
+    std::vector<float> mu(channels, 0.0f), var(channels, 1.0f - epsilon);
+    for (size_t c = 0; c < channels; ++c) {
+        if (stddev[c] == 0.0f) {
+            Nan::ThrowTypeError("node-menoh std must not be zero");
+            return;
+        }
+        gamma[c] = scale[0] / stddev[c];
+        beta[c] = -mean[c] / stddev[c];
+    }
+
+    if (mb->_vpt) {
+        // The graph has already been optimized (trimmed).
+        Nan::ThrowTypeError("node-menoh the model has already been built");
+        return;
+    }
+
+    menoh_error_code ec;
+    ec = mb->prepareEdit();
+    if (ec) {
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+
+    std::vector<int32_t> dims(1, (int32_t)channels);
+    std::string prefix(name + "/normalization/");
+    const char *params[] = { "scale", "B", "mean", "var" };
+    std::vector<float> const* values[] = { &gamma, &beta, &mu, &var };
+    for (int i = 0; i < 4; ++i) {
+        ec = mb->addParameter(prefix + params[i], dims, *values[i]);
+        if (ec) {
+            Nan::ThrowTypeError(menoh_get_last_error_message());
+            return;
+        }
+    }
+
+    std::vector<std::string> inputs(1, rawName);
+    for (int i = 0; i < 4; ++i) {
+        inputs.push_back(prefix + params[i]);
+    }
+    ec = mb->addNode("BatchNormalization", inputs, std::vector<std::string>(1, name));
+    if (!ec) {
+        ec = menoh_model_data_add_attribute_float_to_current_node(mb->_data, "epsilon", epsilon);
+    }
+    if (!ec) {
+        ec = menoh_model_data_add_attribute_int_to_current_node(mb->_data, "is_test", 1);
+    }
+    if (!ec) {
+        ec = menoh_model_data_add_attribute_int_to_current_node(mb->_data, "spatial", 1);
+    }
+    if (ec) {
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+
+    // The caller feeds the raw data to the new input.
+    info.GetReturnValue().Set(Nan::New(rawName).ToLocalChecked());
+}
+
+// Reads an array of strings into `names`.
+static bool toNames(v8::Local<v8::Value> val, std::vector<std::string> *names) {
+    if (!val->IsArray()) {
+        return false;
+    }
+    v8::Local<v8::Array> arr = v8::Local<v8::Array>::Cast(val);
+    for (uint32_t i = 0; i < arr->Length(); ++i) {
+        v8::Local<v8::Value> _it = Nan::Get(arr, i).ToLocalChecked();
+        if (!_it->IsString()) {
+            return false;
+        }
+        v8::String::Utf8Value _name(_it);
+        names->push_back(std::string(*_name, _name.length()));
+    }
+    return true;
+}
+
+NAN_METHOD(ModelBuilder::AddParameter) {
+    if (info.Length() < 3) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsString()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a string");
+        return;
+    }
+    if (!info[1]->IsArray()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be an array");
+        return;
+    }
+    if (!info[2]->IsFloat32Array()) {
+        Nan::ThrowTypeError("node-menoh arg 3 must be a Float32Array");
+        return;
+    }
+
+    ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(info.Holder());
+
+    // info[0] - name
+    v8::String::Utf8Value _name(info[0]);
+    std::string name(*_name, _name.length());
+
+    // info[1] - dims
+    v8::Local<v8::Array> data = v8::Local<v8::Array>::Cast(info[1]);
+    std::vector<int32_t> dims;
+    size_t n = 1;
+    for (uint32_t i = 0; i < data->Length(); ++i) {
+        v8::Local<v8::Value> _it = Nan::Get(data, i).ToLocalChecked();
+        dims.push_back(_it->Int32Value());
+        n *= (size_t)dims.back();
+    }
+
+    // info[2] - values (referenced, not copied)
+    Nan::TypedArrayContents<float> values(info[2]);
+    if (dims.empty() || values.length() != n) {
+        Nan::ThrowTypeError("node-menoh parameter size does not match the dims");
+        return;
+    }
+
+    if (mb->_vpt) {
+        // The graph has already been optimized (trimmed).
+        Nan::ThrowTypeError("node-menoh the model has already been built");
+        return;
+    }
+
+    menoh_error_code ec;
+    ec = mb->prepareEdit();
+    if (!ec) {
+        ec = mb->addParameter(name, dims, *values);
+    }
+    if (ec) {
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+
+    // Keep the array alive as long as the builder.
+    mb->_paramRefs.push_back(new Nan::Persistent<v8::Object>(info[2]->ToObject()));
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(ModelBuilder::AddNode) {
+    if (info.Length() < 3) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsString()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a string");
+        return;
+    }
+
+    ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(info.Holder());
+
+    // info[0] - op type
+    v8::String::Utf8Value _opType(info[0]);
+    std::string opType(*_opType, _opType.length());
+
+    // info[1] - input names, info[2] - output names
+    std::vector<std::string> inputs, outputs;
+    if (!toNames(info[1], &inputs)) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be an array of strings");
+        return;
+    }
+    if (!toNames(info[2], &outputs)) {
+        Nan::ThrowTypeError("node-menoh arg 3 must be an array of strings");
+        return;
+    }
+
+    // info[3] - attributes (optional), all converted before the node is
+    // added, so that an invalid one leaves the graph unchanged
+    std::vector<Attribute> attrs;
+    if (info.Length() > 3 && !info[3]->IsUndefined()) {
+        if (!info[3]->IsObject()) {
+            Nan::ThrowTypeError("node-menoh arg 4 must be an object");
+            return;
+        }
+        v8::Local<v8::Object> obj = info[3]->ToObject();
+        v8::Local<v8::Array> attrNames = obj->GetOwnPropertyNames();
+        attrs.resize(attrNames->Length());
+        for (uint32_t i = 0; i < attrNames->Length(); ++i) {
+            v8::Local<v8::Value> key = Nan::Get(attrNames, i).ToLocalChecked();
+            v8::String::Utf8Value _attrName(key);
+            std::string attrName(*_attrName, _attrName.length());
+            if (!toAttribute(attrName, Nan::Get(obj, key).ToLocalChecked(), &attrs[i])) {
+                std::string msg("node-menoh invalid attribute value for " + attrName);
+                Nan::ThrowTypeError(msg.c_str());
+                return;
+            }
+        }
+    }
+
+    if (mb->_vpt) {
+        // The graph has already been optimized (trimmed).
+        Nan::ThrowTypeError("node-menoh the model has already been built");
+        return;
+    }
+
+    menoh_error_code ec;
+    ec = mb->prepareEdit();
+    if (!ec) {
+        ec = mb->addNode(opType, inputs, outputs);
+    }
+    for (size_t i = 0; !ec && i < attrs.size(); ++i) {
+        ec = mb->addAttribute(attrs[i]);
+    }
+    if (ec) {
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ModelBuilder::LoadWorker class
+
+ModelBuilder::LoadWorker::LoadWorker(
+    Nan::Callback *callback,
+    AddonData *addon,
+    const std::string& onnxPath) :  Nan::AsyncWorker(callback),
+                                    _addon(addon),
+                                    _onnxPath(onnxPath),
+                                    _entry(NULL) {
+}
+
+ModelBuilder::LoadWorker::~LoadWorker() {
+}
+
+void ModelBuilder::LoadWorker::Execute() {
+    // Load ONNX model data (or share the one already loaded)
+    std::string errMsg;
+    _entry = ModelDataCache::acquire(_onnxPath, &errMsg);
+    if (!_entry) {
+        SetErrorMessage(errMsg.c_str());
+        return;
+    }
+}
+
+void ModelBuilder::LoadWorker::HandleOKCallback() {
+    Nan::HandleScope scope;
+    const int argc = 0;
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(_addon->modelBuilderCons);
+    v8::Local<v8::Object> obj = Nan::NewInstance(cons, argc, NULL).ToLocalChecked();
+    Nan::AsyncResource resource("ModelBuilder.LoadWorker.OKCallback");
+
+    // Hand the shared data over to the ModelBuilder.
+    ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(obj);
+    mb->_shared = _entry;
+    mb->_data = _entry->data();
+    mb->_dataBytes = _entry->fileSize();
+
+    // Create variable profile table builder.
+    menoh_error_code ec;
+    ec = menoh_make_variable_profile_table_builder(&mb->_vptBuilder);
+    if (ec) {
+        v8::Local<v8::Value> _argv[] = {
+            v8::Exception::Error(Nan::New(menoh_get_last_error_message()).ToLocalChecked())
+        };
+        callback->Call(1, _argv, &resource);
+        return;
     }
 
     v8::Local<v8::Value> _argv[] = { Nan::Undefined(), obj };
@@ -316,69 +1162,130 @@ void ModelBuilder::LoadWorker::HandleOKCallback() {
 ////////////////////////////////////////////////////////////////////////////////
 // Model class
 
-Nan::Persistent<v8::Function> Model::constructor;
+std::atomic<uint64_t> Model::_weightsGeneration(0);
 
 Model::Model(ModelBuilder *mb): _backendName("mkldnn"),
                                 _backendConfig(""),
                                 _native(NULL),
                                 _ivNames(mb->_ivNames),
-                                _inProgress(false) {
+                                _ovNames(mb->_ovNames),
+                                _buffers(),
+                                _varIndex(),
+                                _arena(),
+                                _alignment(TensorArena::kDefaultAlignment),
+                                _hugePages(false),
+                                _inProgress(false),
+                                _runWorker(NULL),
+#ifdef NODEMENOH_PROMISE_RUN
+                                _promiseWorker(NULL),
+#endif
+                                _warmupLatencies(),
+                                _asyncRuns(0),
+                                _asyncRunMs(0),
+                                _asyncTotalMs(0),
+                                _syncRuns(0),
+                                _syncRunMs(0),
+                                _threads(0),
+                                _builder(mb),
+                                _registry(NULL),
+                                _footprint(mb->_dataBytes),
+                                _lruPos(),
+                                _resident(false),
+                                _resultCache(NULL),
+                                _cacheSeed(0),
+                                _data(NULL),
+                                _vpt(NULL),
+                                _weightsPath(),
+                                _swapping(false),
+                                _pooled(false),
+                                _pendingData(NULL),
+                                _pendingVpt(NULL),
+                                _pendingNative(NULL) {
 }
 
 Model::~Model() {
-    // free all input buffers
-    InputVarNames::const_iterator it;
-    for (it = _ivNames.begin(); it != _ivNames.end(); ++it) {
-        std::string const& name(*it);
-
-        void *buf;
-        menoh_error_code ec;
-        ec = menoh_model_get_variable_buffer_handle(_native, name.c_str(), &buf);
-        if (ec) {
-            continue;
-        }
+#ifdef NODEMENOH_PROMISE_RUN
+    // Idle, as the model is referenced while a run is in progress.
+    delete _promiseWorker;
+#endif
 
-        ::free(buf);
+    if (_registry) {
+        _registry->remove(this);
     }
+    _registryObj.Reset();
+    _builderObj.Reset();
+
+    // Detached before the (possibly shared) cache is released. The runs
+    // queued on the cache hold their model, so none is queued on this one.
+    _resultCache = NULL;
+    _resultCacheObj.Reset();
 
     if (_native) {
         menoh_delete_model(_native);
     }
+
+    if (_pendingNative) {
+        menoh_delete_model(_pendingNative);
+        menoh_delete_variable_profile_table(_pendingVpt);
+        menoh_delete_model_data(_pendingData);
+    }
+    if (_vpt) {
+        menoh_delete_variable_profile_table(_vpt);
+    }
+    if (_data) {
+        menoh_delete_model_data(_data);
+    }
+
+    // The input/output buffers are freed with _arena.
 }
 
-void Model::Init(v8::Local<v8::Object> exports) {
+void Model::Init(v8::Local<v8::Object> exports, AddonData *addon) {
     // Prepare constructor template
-    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
     tpl->SetClassName(Nan::New("Model").ToLocalChecked());
     tpl->InstanceTemplate()->SetInternalFieldCount(1);
 
     // Prototype
-    Nan::SetPrototypeMethod(tpl, "setInputData", SetInputData);
-    Nan::SetPrototypeMethod(tpl, "run", Run);
-    Nan::SetPrototypeMethod(tpl, "getOutput", GetOutput);
-    Nan::SetPrototypeMethod(tpl, "getProfile", GetProfile);
-
-    constructor.Reset(tpl->GetFunction());
+    Nan::SetPrototypeMethod(tpl, "setInputData", SetInputData, addon->external());
+    Nan::SetPrototypeMethod(tpl, "run", Run, addon->external());
+    Nan::SetPrototypeMethod(tpl, "runSync", RunSync, addon->external());
+#ifdef NODEMENOH_PROMISE_RUN
+    Nan::SetPrototypeMethod(tpl, "runPromise", RunPromise, addon->external());
+#endif
+    Nan::SetPrototypeMethod(tpl, "getRunStats", GetRunStats, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getOutput", GetOutput, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getProfile", GetProfile, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getProfiles", GetProfiles, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getOutputs", GetOutputs, addon->external());
+    Nan::SetPrototypeMethod(tpl, "swapWeights", SwapWeights, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getVarNames", GetVarNames, addon->external());
+    Nan::SetPrototypeMethod(tpl, "cancel", Cancel, addon->external());
+    Nan::SetPrototypeMethod(tpl, "warmup", Warmup, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getWarmupStats", GetWarmupStats, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getVariable", GetVariable, addon->external());
+    Nan::SetPrototypeMethod(tpl, "runTiled", TiledRun::RunTiled, addon->external());
+
+    addon->modelCons.Reset(tpl->GetFunction());
     exports->Set(Nan::New("Model").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
 }
 
 menoh_error_code Model::setUp(ModelBuilder const *mb) {
-    menoh_model_builder_handle modelBuilder;
     menoh_error_code ec;
-    ec = menoh_make_model_builder(mb->_vpt, &modelBuilder);
-    if (ec) {
-        return ec;
-    }
 
-    // create input buffer(s)
+    // create input and output buffer(s)
+    // The buffers are owned by the model so that they survive rebuilds
+    // of the native model. They are allocated in one aligned region.
+    InputVarNames names(_ivNames);
+    names.insert(names.end(), _ovNames.begin(), _ovNames.end());
+
     InputVarNames::const_iterator it;
-    for (it = _ivNames.begin(); it != _ivNames.end(); ++it) {
+    for (it = names.begin(); it != names.end(); ++it) {
         std::string const& name(*it);
 
         int32_t dimsSize;
         ec = menoh_variable_profile_table_get_dims_size(mb->_vpt, name.c_str(), &dimsSize);
         if (ec) {
-            goto exit;
+            return ec;
         }
 
         size_t n = 1;
@@ -386,63 +1293,571 @@ menoh_error_code Model::setUp(ModelBuilder const *mb) {
             int32_t d;
             ec = menoh_variable_profile_table_get_dims_at(mb->_vpt, name.c_str(), i, &d);
             if (ec) {
-                goto exit;
+                return ec;
             }
             n *= (size_t)d;
         }
 
-        void *buf = ::calloc(n, sizeof(float));
+        VarBuffer vb;
+        vb.name = name;
+        vb.dtype = kFloat32;
+        if (it - names.begin() < (ptrdiff_t)_ivNames.size()) {
+            std::map<std::string, Dtype>::const_iterator src = mb->_sourceDtypes.find(name);
+            if (src != mb->_sourceDtypes.end()) {
+                vb.dtype = src->second;
+            }
+        }
+        vb.ptr = NULL;
+        vb.size = n * dtypeSize(vb.dtype);
+        vb.attached = NULL;
+        for (int32_t i = 0; i < dimsSize; ++i) {
+            int32_t d;
+            menoh_variable_profile_table_get_dims_at(mb->_vpt, name.c_str(), i, &d);
+            vb.dims.push_back(d);
+        }
+        _buffers.push_back(vb);
+    }
+
+    // Widened inputs get a float32 buffer to attach after all the others.
+    std::vector<size_t> sizes;
+    for (size_t i = 0; i < _buffers.size(); ++i) {
+        sizes.push_back(_buffers[i].size);
+    }
+    for (size_t i = 0; i < _buffers.size(); ++i) {
+        if (_buffers[i].dtype != kFloat32) {
+            sizes.push_back(_buffers[i].size / dtypeSize(_buffers[i].dtype) * sizeof(float));
+        }
+    }
+    std::vector<void*> ptrs;
+    if (!_arena.allocate(sizes, _alignment, _hugePages, &ptrs)) {
+        // See setUpErrorMessage().
+        return menoh_error_code_std_error;
+    }
+    size_t widened = _buffers.size();
+    for (size_t i = 0; i < _buffers.size(); ++i) {
+        VarBuffer& vb = _buffers[i];
+        vb.ptr = ptrs[i];
+        vb.attached = static_cast<float*>(vb.dtype != kFloat32 ? ptrs[widened++] : vb.ptr);
+        _varIndex[vb.name] = i;
+    }
+
+    // build model
+    return buildNative();
+}
+
+char const* Model::setUpErrorMessage() const {
+    // All the buffers are listed before they are allocated.
+    if (_arena.bytes() == 0 && _buffers.size() == _ivNames.size() + _ovNames.size()) {
+        return "node-menoh failed to allocate the input/output buffers";
+    }
+    return menoh_get_last_error_message();
+}
+
+menoh_error_code Model::buildNative(  menoh_variable_profile_table_handle vpt,
+                                        menoh_model_data_handle data,
+                                        VarBuffers const& buffers,
+                                        std::string const& backendName,
+                                        std::string const& backendConfig,
+                                        menoh_model_handle *native) {
+    menoh_model_builder_handle modelBuilder;
+    menoh_error_code ec;
+    ec = menoh_make_model_builder(vpt, &modelBuilder);
+    if (ec) {
+        return ec;
+    }
+
+    VarBuffers::const_iterator it;
+    for (it = buffers.begin(); it != buffers.end(); ++it) {
         ec = menoh_model_builder_attach_external_buffer(
-            modelBuilder, name.c_str(), buf);
+            modelBuilder, it->name.c_str(), it->attached);
         if (ec) {
             goto exit;
         }
     }
 
-    // build model
     ec = menoh_build_model( modelBuilder,
-                            mb->_data,
-                            _backendName.c_str(),
-                            _backendConfig.c_str(),
-                            &_native);
+                            data,
+                            backendName.c_str(),
+                            backendConfig.c_str(),
+                            native);
 exit:
     menoh_delete_model_builder(modelBuilder);
     return ec;
 }
 
-menoh_error_code Model::getVarInfo(     std::string const& name,
-                                        v8::Local<v8::Array> *dims,
-                                        size_t *bufSize) {
-    menoh_error_code ec;
-    int32_t dimsSize;
-    ec = menoh_model_get_variable_dims_size(_native, name.c_str(), &dimsSize);
+menoh_error_code Model::buildNative() {
+    return buildNative( _vpt ? _vpt : _builder->_vpt,
+                        _data ? _data : _builder->_data,
+                        _buffers,
+                        _backendName,
+                        _backendConfig,
+                        &_native);
+}
+
+bool Model::loadWeights( std::string const& onnxPath,
+                         VarBuffers const& buffers,
+                         size_t numInputs,
+                         menoh_model_data_handle *data,
+                         menoh_variable_profile_table_handle *vpt,
+                         std::string *error) {
+    // The data is private to the model as it is optimized in place. On
+    // failure, the caller releases what has been made.
+    menoh_error_code ec = menoh_make_model_data_from_onnx(onnxPath.c_str(), data);
     if (ec) {
-        return ec;
+        *error = menoh_get_last_error_message();
+        return false;
     }
 
-    size_t n = 1;
-    for (int32_t i = 0; i < dimsSize; ++i) {
-        int32_t d;
-        ec = menoh_model_get_variable_dims_at(_native, name.c_str(), i, &d);
-        if (ec) {
-            return ec;
+    // Build the same variable profiles as the running model.
+    menoh_variable_profile_table_builder_handle vptBuilder;
+    ec = menoh_make_variable_profile_table_builder(&vptBuilder);
+    if (ec) {
+        *error = menoh_get_last_error_message();
+        return false;
+    }
+    for (size_t i = 0; i < buffers.size() && !ec; ++i) {
+        VarBuffer const& vb = buffers[i];
+        if (i < numInputs) {
+            ec = menoh_variable_profile_table_builder_add_input_profile(
+                vptBuilder, vb.name.c_str(), menoh_dtype_float,
+                (int32_t)vb.dims.size(), &vb.dims[0]);
+        } else {
+            ec = menoh_variable_profile_table_builder_add_output_name(
+                vptBuilder, vb.name.c_str());
+        }
+    }
+    if (!ec) {
+        ec = menoh_build_variable_profile_table(vptBuilder, *data, vpt);
+    }
+    menoh_delete_variable_profile_table_builder(vptBuilder);
+    if (ec) {
+        *error = menoh_get_last_error_message();
+        return false;
+    }
+
+    // The outputs must keep their shapes to reuse the buffers.
+    for (size_t i = numInputs; i < buffers.size(); ++i) {
+        VarBuffer const& vb = buffers[i];
+        int32_t dimsSize;
+        ec = menoh_variable_profile_table_get_dims_size(*vpt, vb.name.c_str(), &dimsSize);
+        bool same = !ec && dimsSize == (int32_t)vb.dims.size();
+        for (int32_t j = 0; same && j < dimsSize; ++j) {
+            int32_t d;
+            ec = menoh_variable_profile_table_get_dims_at(*vpt, vb.name.c_str(), j, &d);
+            same = !ec && d == vb.dims[j];
         }
-        if (dims) {
-            (*dims)->Set((uint32_t)i, Nan::New(d));
+        if (!same) {
+            *error = "node-menoh the new model has a different topology";
+            return false;
         }
-        n *= (size_t)d;
     }
 
-    if (bufSize) {
-        *bufSize = n;
+    ec = menoh_model_data_optimize(*data, *vpt);
+    if (ec) {
+        *error = menoh_get_last_error_message();
+        return false;
     }
-    return menoh_error_code_success;
+    return true;
 }
 
-NAN_METHOD(Model::New) {
-    if (info.Length() < 1) {
-        // Throw an Error that is passed back to JavaScript
-        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+void Model::installWeights( menoh_model_data_handle data,
+                            menoh_variable_profile_table_handle vpt,
+                            menoh_model_handle native) {
+    if (_native) {
+        menoh_delete_model(_native);
+    }
+    if (_vpt) {
+        menoh_delete_variable_profile_table(_vpt);
+    }
+    if (_data) {
+        menoh_delete_model_data(_data);
+    }
+
+    _native = native;
+    _vpt = vpt;
+    _data = data;
+
+    // Results cached for the previous weights must not be served.
+    _cacheSeed = ++_weightsGeneration;
+
+    if (_registry) {
+        _registry->touch(this);
+    }
+}
+
+void Model::applyPendingWeights() {
+    if (!_pendingNative) {
+        return;
+    }
+
+    installWeights(_pendingData, _pendingVpt, _pendingNative);
+    _pendingData = NULL;
+    _pendingVpt = NULL;
+    _pendingNative = NULL;
+}
+
+menoh_error_code Model::ensureNative() {
+    if (_native) {
+        return menoh_error_code_success;
+    }
+
+    menoh_error_code ec = buildNative();
+    if (ec) {
+        return ec;
+    }
+
+    if (_registry) {
+        _registry->touch(this);
+    }
+    return menoh_error_code_success;
+}
+
+
+void Model::evict() {
+    if (_native) {
+        menoh_delete_model(_native);
+        _native = NULL;
+    }
+}
+
+menoh_error_code Model::warmup(uint32_t iterations, std::vector<double> *latencies) {
+    typedef std::chrono::steady_clock Clock;
+
+    // Fault in the pages of the buffers (in case they have been swapped
+    // out). The values are kept, as the inputs may have been set already.
+    static const size_t kPageBytes = 4096;
+    VarBuffers::const_iterator it;
+    for (it = _buffers.begin(); it != _buffers.end(); ++it) {
+        volatile char *p = static_cast<volatile char*>(it->ptr);
+        for (size_t i = 0; i < it->size; i += kPageBytes) {
+            p[i] = p[i];
+        }
+        if (it->dtype != kFloat32) {
+            p = reinterpret_cast<volatile char*>(it->attached);
+            size_t bytes = it->size / dtypeSize(it->dtype) * sizeof(float);
+            for (size_t i = 0; i < bytes; i += kPageBytes) {
+                p[i] = p[i];
+            }
+        }
+    }
+
+    menoh_error_code ec = menoh_error_code_success;
+    if (!_native) {
+        ec = buildNative();
+        if (ec) {
+            return ec;
+        }
+    }
+
+    // The first runs create the primitives of the backend.
+    latencies->clear();
+    ThreadBudget::Scope threads(_threads);
+    for (uint32_t i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        widenInputs();
+        ec = menoh_model_run(_native);
+        if (ec) {
+            return ec;
+        }
+        std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+        latencies->push_back(elapsed.count());
+    }
+    return menoh_error_code_success;
+}
+
+v8::Local<v8::Object> Model::warmupStats(std::vector<double> const& latencies) {
+    Nan::EscapableHandleScope scope;
+
+    // The steady state is the median of the later half of the runs.
+    std::vector<double> later(latencies.begin() + latencies.size() / 2, latencies.end());
+    std::sort(later.begin(), later.end());
+    double steady = later.empty() ? 0 : later[later.size() / 2];
+
+    v8::Local<v8::Array> arr = Nan::New<v8::Array>();
+    for (size_t i = 0; i < latencies.size(); ++i) {
+        arr->Set((uint32_t)i, Nan::New(latencies[i]));
+    }
+
+    v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+    stats->Set(Nan::New("iterations").ToLocalChecked(), Nan::New((uint32_t)latencies.size()));
+    stats->Set(Nan::New("first").ToLocalChecked(), Nan::New(latencies.empty() ? 0 : latencies[0]));
+    stats->Set(Nan::New("steady").ToLocalChecked(), Nan::New(steady));
+    stats->Set(Nan::New("latencies").ToLocalChecked(), arr);
+    return scope.Escape(stats);
+}
+
+menoh_error_code Model::runCached(CachedRunWorker *worker) {
+    ResultCache *cache = _resultCache;
+    uint64_t key = 0;
+    ResultCache::Inputs inputs;
+    if (cache) {
+        key = hashInputs();
+        packInputs(&inputs);
+        ResultCache::Outputs outputs;
+        if (worker) {
+            worker->_queuedOn = this;
+        }
+        switch (cache->get(key, inputs, &outputs, worker)) {
+        case ResultCache::kHit:
+            // No need to run the model.
+            unpackOutputs(outputs);
+            return menoh_error_code_success;
+        case ResultCache::kQueued:
+            // The worker is resumed with the outputs of the other run.
+            worker->_cache = cache;
+            return menoh_error_code_success;
+        case ResultCache::kBypass:
+            cache = NULL;
+            break;
+        case ResultCache::kMiss:
+            break;
+        }
+    }
+
+    menoh_error_code ec = menoh_error_code_success;
+    if (!_native) {
+        ec = buildNative();
+    }
+    if (!ec) {
+        ThreadBudget::Scope threads(_threads);
+        widenInputs();
+        ec = menoh_model_run(_native);
+    }
+    if (ec) {
+        if (cache) {
+            cache->abandon(key, menoh_get_last_error_message());
+        }
+        return ec;
+    }
+
+    if (cache) {
+        ResultCache::Outputs outputs;
+        packOutputs(&outputs);
+        cache->put(key, inputs, outputs);
+    }
+    return menoh_error_code_success;
+}
+
+void Model::widenInputs() {
+    // The input buffers come first in _buffers.
+    for (size_t i = 0; i < _ivNames.size(); ++i) {
+        VarBuffer const& vb = _buffers[i];
+        if (vb.dtype != kFloat32) {
+            widen(vb.dtype, vb.ptr, vb.attached, vb.size / dtypeSize(vb.dtype));
+        }
+    }
+}
+
+uint64_t Model::hashInputs() const {
+    // The input buffers come first in _buffers.
+    uint64_t h = _cacheSeed;
+    for (size_t i = 0; i < _ivNames.size(); ++i) {
+        h = hash64(_buffers[i].ptr, _buffers[i].size, h);
+    }
+    return h;
+}
+
+void Model::packInputs(ResultCache::Inputs *inputs) const {
+    inputs->clear();
+    for (size_t i = 0; i < _ivNames.size(); ++i) {
+        const char *p = (const char *)_buffers[i].ptr;
+        inputs->insert(inputs->end(), p, p + _buffers[i].size);
+    }
+}
+
+void Model::packOutputs(ResultCache::Outputs *outputs) const {
+    outputs->clear();
+    for (size_t i = _ivNames.size(); i < _buffers.size(); ++i) {
+        const char *p = (const char *)_buffers[i].ptr;
+        outputs->insert(outputs->end(), p, p + _buffers[i].size);
+    }
+}
+
+void Model::unpackOutputs(ResultCache::Outputs const& outputs) {
+    size_t offset = 0;
+    for (size_t i = _ivNames.size(); i < _buffers.size(); ++i) {
+        ::memcpy(_buffers[i].ptr, &outputs[offset], _buffers[i].size);
+        offset += _buffers[i].size;
+    }
+}
+
+int Model::findVar(std::string const& name) const {
+    std::map<std::string, size_t>::const_iterator it = _varIndex.find(name);
+    return it == _varIndex.end() ? -1 : (int)it->second;
+}
+
+v8::Local<v8::Array> Model::dimsArray(VarBuffer const& vb) {
+    Nan::EscapableHandleScope scope;
+    v8::Local<v8::Array> dims = Nan::New<v8::Array>((int)vb.dims.size());
+    for (size_t i = 0; i < vb.dims.size(); ++i) {
+        dims->Set((uint32_t)i, Nan::New(vb.dims[i]));
+    }
+    return scope.Escape(dims);
+}
+
+bool Model::toOutputs(v8::Local<v8::Value> val, bool *deliver, std::vector<size_t> *outputs) const {
+    // true: all the outputs
+    *deliver = !val->IsUndefined() && !val->IsFalse();
+    if (!*deliver) {
+        return true;
+    }
+    std::string missing;
+    v8::Local<v8::Value> names = val->IsTrue() ? v8::Local<v8::Value>(Nan::Undefined()) : val;
+    if (!findVars(names, _ivNames.size(), outputs, &missing)) {
+        Nan::ThrowTypeError(missing.empty() ?
+            "node-menoh outputs must be true or an array of names" :
+            ("node-menoh variable not found: " + missing).c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Model::findVars(  v8::Local<v8::Value> names,
+                        size_t first,
+                        std::vector<size_t> *indices,
+                        std::string *missing) const {
+    indices->clear();
+    if (names->IsUndefined()) {
+        for (size_t i = first; i < _buffers.size(); ++i) {
+            indices->push_back(i);
+        }
+        return true;
+    }
+    if (!names->IsArray()) {
+        return false;
+    }
+
+    v8::Local<v8::Array> arr = names.As<v8::Array>();
+    for (uint32_t i = 0; i < arr->Length(); ++i) {
+        v8::Local<v8::Value> val = Nan::Get(arr, i).ToLocalChecked();
+        if (!val->IsString()) {
+            return false;
+        }
+        std::string name(*Nan::Utf8String(val));
+        int index = findVar(name);
+        if (index < 0) {
+            *missing = name;
+            return false;
+        }
+        indices->push_back((size_t)index);
+    }
+    return true;
+}
+
+v8::Local<v8::Object> Model::profileObject(VarBuffer const& vb) {
+    Nan::EscapableHandleScope scope;
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    results->Set(
+        Nan::New("buf").ToLocalChecked(),
+        Nan::NewBuffer((char *)vb.ptr, vb.size, bufferFreeCallback, 0).ToLocalChecked());
+    results->Set(Nan::New("dims").ToLocalChecked(), dimsArray(vb));
+    results->Set(Nan::New("dtype").ToLocalChecked(), Nan::New(dtypeName(vb.dtype)).ToLocalChecked());
+    return scope.Escape(results);
+}
+
+v8::Local<v8::Object> Model::outputObject(VarBuffer const& vb) {
+    Nan::EscapableHandleScope scope;
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    results->Set(Nan::New("data").ToLocalChecked(), copyOut(vb));
+    results->Set(Nan::New("dims").ToLocalChecked(), dimsArray(vb));
+    return scope.Escape(results);
+}
+
+char* Model::copyOutputs(std::vector<size_t> const& indices) const {
+    size_t bytes = 0;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        bytes += _buffers[indices[i]].size;
+    }
+    char *data = (char*)::malloc(bytes > 0 ? bytes : 1);
+    if (!data) {
+        return NULL;
+    }
+    char *p = data;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        VarBuffer const& vb = _buffers[indices[i]];
+        ::memcpy(p, vb.ptr, vb.size);
+        p += vb.size;
+    }
+    return data;
+}
+
+static void freeCallback(char *data, void *hint) {
+    (void)hint;
+    ::free(data);
+}
+
+v8::Local<v8::Object> Model::outputArrays(std::vector<size_t> const& indices, char *data) const {
+    Nan::EscapableHandleScope scope;
+
+    // All the outputs share one buffer.
+    size_t bytes = 0;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        bytes += _buffers[indices[i]].size;
+    }
+    v8::Local<v8::Object> buf = Nan::NewBuffer(data, bytes, freeCallback, 0).ToLocalChecked();
+    v8::Local<v8::ArrayBuffer> ab = buf.As<v8::ArrayBufferView>()->Buffer();
+    size_t offset = buf.As<v8::ArrayBufferView>()->ByteOffset();
+
+    v8::Local<v8::Object> outputs = Nan::New<v8::Object>();
+    for (size_t i = 0; i < indices.size(); ++i) {
+        VarBuffer const& vb = _buffers[indices[i]];
+        outputs->Set(Nan::New(vb.name).ToLocalChecked(),
+                     v8::Float32Array::New(ab, offset, vb.size / sizeof(float)));
+        offset += vb.size;
+    }
+    return scope.Escape(outputs);
+}
+
+char const* Model::copyIn(VarBuffer const& vb, v8::Local<v8::Object> dataObj) {
+    size_t n = vb.size / dtypeSize(vb.dtype);
+
+    Dtype dtype;
+    if (typedArrayDtype(dataObj, &dtype)) {
+        Nan::TypedArrayContents<char> contents(dataObj);
+        size_t length = contents.length() / dtypeSize(dtype);
+        if (length != n) {
+            return length < n ? "node-menoh input data is too short" :
+                                "node-menoh input data is too long";
+        }
+        // Copied as is if of the dtype of the buffer
+        convert(dtype, *contents, vb.dtype, vb.ptr, n);
+        return NULL;
+    }
+
+    v8::Local<v8::Array> data = v8::Local<v8::Array>::Cast(dataObj);
+
+    if (data->Length() < n) {
+        return "node-menoh input data is too short";
+    }
+
+    if (data->Length() > n) {
+        return "node-menoh input data is too long";
+    }
+
+    // copy data into buf
+    for (uint32_t i = 0; i < n; ++i) {
+        v8::Local<v8::Value> _it = Nan::Get(data, i).ToLocalChecked();
+        storeElement(vb.dtype, vb.ptr, i, _it->NumberValue());
+    }
+    return NULL;
+}
+
+v8::Local<v8::Array> Model::copyOut(VarBuffer const& vb) {
+    Nan::EscapableHandleScope scope;
+
+    // Copy whole data into a Javascript array.
+    size_t n = vb.size / dtypeSize(vb.dtype);
+    v8::Local<v8::Array> data = Nan::New<v8::Array>((int)n);
+    for (size_t i = 0; i < n; ++i) {
+        data->Set((uint32_t)i, Nan::New(loadElement(vb.dtype, vb.ptr, i)));
+    }
+    return scope.Escape(data);
+}
+
+NAN_METHOD(Model::New) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
         return;
     }
     if (!info[0]->IsObject()) {
@@ -456,95 +1871,351 @@ NAN_METHOD(Model::New) {
         // Invoked as constructor: `new Model(...)`
         ModelBuilder* mb = ObjectWrap::Unwrap<ModelBuilder>(modelData);
         Model* model = new Model(mb);
+        model->_builderObj.Reset(modelData);
         model->Wrap(info.This());
         info.GetReturnValue().Set(info.This());
 
-    } else {
-        // Invoked as plain function `Model(...)`, turn into construct call.
-        const int argc = 1;
-        v8::Local<v8::Value> argv[argc] = { modelData };
-        v8::Local<v8::Function> cons = Nan::New<v8::Function>(constructor);
-        info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+    } else {
+        // Invoked as plain function `Model(...)`, turn into construct call.
+        const int argc = 1;
+        v8::Local<v8::Value> argv[argc] = { modelData };
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(AddonData::from(info)->modelCons);
+        info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+    }
+}
+
+NAN_METHOD(Model::SetInputData) {
+    if (info.Length() < 2) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsString()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a string");
+        return;
+    }
+    if (!info[1]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be an array");
+        return;
+    }
+
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    // info[0] - name
+    v8::String::Utf8Value _name(info[0]);
+    std::string name(*_name, _name.length());
+
+    int index = model->findVar(name);
+    if (index < 0) {
+        Nan::ThrowTypeError(("node-menoh variable not found: " + name).c_str());
+        return;
+    }
+
+    // info[1] - data
+    char const *err = copyIn(model->_buffers[index], info[1]->ToObject());
+    if (err) {
+        Nan::ThrowTypeError(err);
+        return;
+    }
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(Model::Run) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a function");
+        return;
+    }
+
+    // info[1] - outputs to deliver to the callback
+    bool deliver;
+    std::vector<size_t> outputs;
+    if (!model->toOutputs(info[1], &deliver, &outputs)) {
+        return;
+    }
+
+    if (model->_inProgress) {
+        Nan::ThrowTypeError("node-menoh previous run is in progress");
+        return;
+    }
+
+    model->_inProgress = true;
+
+    if (model->_registry) {
+        // Account the model as resident. (It is rebuilt by the worker if
+        // it has been evicted.)
+        model->_registry->touch(model);
+    }
+
+    // Start run worker
+    Nan::Callback *cb = new Nan::Callback(info[0].As<v8::Function>());
+    RunWorker *w = new RunWorker(cb, model);
+    w->_deliver = deliver;
+    w->_queuedAt = std::chrono::steady_clock::now();
+    w->_outputs.swap(outputs);
+    model->_runWorker = w;
+    Nan::AsyncQueueWorker(w);
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(Model::RunSync) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    // info[0] - options
+    v8::Local<v8::Value> outputsVal = Nan::Undefined();
+    if (info.Length() > 0 && !info[0]->IsUndefined()) {
+        if (!info[0]->IsObject()) {
+            Nan::ThrowTypeError("node-menoh arg 1 must be an object");
+            return;
+        }
+        v8::Local<v8::String> key = Nan::New("outputs").ToLocalChecked();
+        if (Nan::Has(info[0]->ToObject(), key).FromJust()) {
+            outputsVal = Nan::Get(info[0]->ToObject(), key).ToLocalChecked();
+        }
+    }
+    bool deliver;
+    std::vector<size_t> outputs;
+    if (!model->toOutputs(outputsVal, &deliver, &outputs)) {
+        return;
+    }
+
+    if (model->_inProgress) {
+        Nan::ThrowTypeError("node-menoh previous run is in progress");
+        return;
+    }
+
+    if (model->_registry) {
+        model->_registry->touch(model);
+    }
+
+    // Runs on the calling thread, blocking its event loop.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    menoh_error_code ec = model->runCached();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    model->applyPendingWeights();
+    if (ec) {
+        if (!model->_native && model->_registry) {
+            // The rebuild has failed.
+            model->_registry->release(model);
+        }
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+    model->_syncRuns++;
+    model->_syncRunMs += elapsed.count();
+
+    if (!deliver) {
+        info.GetReturnValue().Set(Nan::Undefined());
+        return;
+    }
+    char *data = model->copyOutputs(outputs);
+    if (!data) {
+        Nan::ThrowError("node-menoh failed to allocate the outputs");
+        return;
+    }
+    info.GetReturnValue().Set(model->outputArrays(outputs, data));
+}
+
+#ifdef NODEMENOH_PROMISE_RUN
+NAN_METHOD(Model::RunPromise) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    // info[0] - outputs to resolve the promise to
+    bool deliver;
+    std::vector<size_t> outputs;
+    if (!model->toOutputs(info[0], &deliver, &outputs)) {
+        return;
+    }
+
+    if (model->_inProgress) {
+        Nan::ThrowTypeError("node-menoh previous run is in progress");
+        return;
+    }
+
+    if (model->_registry) {
+        // Account the model as resident. (It is rebuilt by the worker if
+        // it has been evicted.)
+        model->_registry->touch(model);
+    }
+
+    if (!model->_promiseWorker) {
+        model->_promiseWorker = new PromiseWorker(model);
+    }
+    info.GetReturnValue().Set(model->_promiseWorker->start(deliver, outputs));
+}
+#endif
+
+NAN_METHOD(Model::GetRunStats) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    double runs = model->_asyncRuns;
+    double meanRunMs = runs > 0 ? model->_asyncRunMs / runs : 0;
+    double meanTotalMs = runs > 0 ? model->_asyncTotalMs / runs : 0;
+    double syncRuns = model->_syncRuns;
+
+    v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+    stats->Set(Nan::New("runs").ToLocalChecked(), Nan::New(model->_asyncRuns));
+    stats->Set(Nan::New("meanRunMs").ToLocalChecked(), Nan::New(meanRunMs));
+    stats->Set(Nan::New("meanTotalMs").ToLocalChecked(), Nan::New(meanTotalMs));
+    stats->Set(Nan::New("meanOverheadMs").ToLocalChecked(), Nan::New(meanTotalMs - meanRunMs));
+    stats->Set(Nan::New("syncRuns").ToLocalChecked(), Nan::New(model->_syncRuns));
+    stats->Set(Nan::New("meanSyncMs").ToLocalChecked(),
+               Nan::New(syncRuns > 0 ? model->_syncRunMs / syncRuns : 0));
+
+    info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(Model::GetOutput) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsString()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a function");
+        return;
+    }
+
+    // Read output for the given name.
+    v8::String::Utf8Value _name(info[0]);
+    std::string name(*_name, _name.length());
+
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    int index = model->findVar(name);
+    if (index < 0) {
+        Nan::ThrowTypeError(("node-menoh variable not found: " + name).c_str());
+        return;
     }
+    info.GetReturnValue().Set(outputObject(model->_buffers[index]));
 }
 
-NAN_METHOD(Model::SetInputData) {
-    if (info.Length() < 2) {
+NAN_METHOD(Model::GetProfile) {
+    if (info.Length() < 1) {
         // Throw an Error that is passed back to JavaScript
         Nan::ThrowTypeError("node-menoh insufficient number of arguments");
         return;
     }
     if (!info[0]->IsString()) {
-        Nan::ThrowTypeError("node-menoh arg 1 must be a string");
-        return;
-    }
-    if (!info[1]->IsObject()) {
-        Nan::ThrowTypeError("node-menoh arg 2 must be an array");
+        Nan::ThrowTypeError("node-menoh arg 1 must be a function");
         return;
     }
 
-    v8::Local<v8::Object> _dataObj;
-    v8::Local<v8::Array> data;
-
-    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
-
-    // info[0] - name
+    // Read output for the given name.
     v8::String::Utf8Value _name(info[0]);
     std::string name(*_name, _name.length());
 
-    // retrieve buffer handle
-    float *buf;
-    menoh_error_code ec;
-    ec = menoh_model_get_variable_buffer_handle(
-        model->_native, name.c_str(), (void**)&buf);
-    if (ec) {
-        Nan::ThrowTypeError(menoh_get_last_error_message());
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    int index = model->findVar(name);
+    if (index < 0) {
+        Nan::ThrowTypeError(("node-menoh variable not found: " + name).c_str());
         return;
     }
+    info.GetReturnValue().Set(profileObject(model->_buffers[index]));
+}
 
-    // info[1] - data
-    _dataObj = info[1]->ToObject();
-    data = v8::Local<v8::Array>::Cast(_dataObj);
+NAN_METHOD(Model::GetProfiles) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
 
-    size_t n;
-    ec = model->getVarInfo(name, NULL, &n);
-    if (ec) {
-        Nan::ThrowTypeError(menoh_get_last_error_message());
+    // All the variables by default.
+    std::vector<size_t> indices;
+    std::string missing;
+    if (!model->findVars(info[0], 0, &indices, &missing)) {
+        Nan::ThrowTypeError(missing.empty() ?
+            "node-menoh arg 1 must be an array of names" :
+            ("node-menoh variable not found: " + missing).c_str());
         return;
     }
 
-    if (data->Length() < n) {
-        Nan::ThrowTypeError("node-menoh input data is too short");
-        return;
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    for (size_t i = 0; i < indices.size(); ++i) {
+        VarBuffer const& vb = model->_buffers[indices[i]];
+        results->Set(Nan::New(vb.name).ToLocalChecked(), profileObject(vb));
     }
+    info.GetReturnValue().Set(results);
+}
 
-    if (data->Length() > n) {
-        Nan::ThrowTypeError("node-menoh input data is too long");
+NAN_METHOD(Model::GetOutputs) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    // All the outputs by default.
+    std::vector<size_t> indices;
+    std::string missing;
+    if (!model->findVars(info[0], model->_ivNames.size(), &indices, &missing)) {
+        Nan::ThrowTypeError(missing.empty() ?
+            "node-menoh arg 1 must be an array of names" :
+            ("node-menoh variable not found: " + missing).c_str());
         return;
     }
 
-    // copy data into buf
-    for (uint32_t i = 0; i < n; ++i) {
-        v8::Local<v8::Value> _it = Nan::Get(data, i).ToLocalChecked();
-        buf[i] = (float)_it->NumberValue();
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    for (size_t i = 0; i < indices.size(); ++i) {
+        VarBuffer const& vb = model->_buffers[indices[i]];
+        results->Set(Nan::New(vb.name).ToLocalChecked(), outputObject(vb));
     }
+    info.GetReturnValue().Set(results);
+}
 
-    info.GetReturnValue().Set(Nan::Undefined());
+NAN_METHOD(Model::GetVarNames) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    v8::Local<v8::Array> inputs = Nan::New<v8::Array>();
+    for (size_t i = 0; i < model->_ivNames.size(); ++i) {
+        inputs->Set(i, Nan::New(model->_ivNames[i]).ToLocalChecked());
+    }
+    v8::Local<v8::Array> outputs = Nan::New<v8::Array>();
+    for (size_t i = 0; i < model->_ovNames.size(); ++i) {
+        outputs->Set(i, Nan::New(model->_ovNames[i]).ToLocalChecked());
+    }
+
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    results->Set(Nan::New("inputs").ToLocalChecked(), inputs);
+    results->Set(Nan::New("outputs").ToLocalChecked(), outputs);
+
+    info.GetReturnValue().Set(results);
 }
 
-NAN_METHOD(Model::Run) {
+NAN_METHOD(Model::Cancel) {
     Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
 
-    if (info.Length() < 1) {
+    // Only a run that has not been started by a worker thread can be
+    // cancelled. It completes with an error.
+    bool cancelled = model->_runWorker && model->_runWorker->_cancel.cancel();
+#ifdef NODEMENOH_PROMISE_RUN
+    PromiseWorker *pw = model->_promiseWorker;
+    cancelled = cancelled || (pw && pw->_running && pw->_cancel.cancel());
+#endif
+    info.GetReturnValue().Set(Nan::New(cancelled));
+}
+
+NAN_METHOD(Model::Warmup) {
+    if (info.Length() < 2) {
         // Throw an Error that is passed back to JavaScript
         Nan::ThrowTypeError("node-menoh insufficient number of arguments");
         return;
     }
-    if (!info[0]->IsFunction()) {
-        Nan::ThrowTypeError("node-menoh arg 1 must be a function");
+    if (!info[1]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be a function");
         return;
     }
 
+    uint32_t iterations;
+    if (!toIterations(info[0], &iterations)) {
+        Nan::ThrowTypeError("node-menoh warmup.iterations must be a positive integer");
+        return;
+    }
+
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
     if (model->_inProgress) {
         Nan::ThrowTypeError("node-menoh previous run is in progress");
         return;
@@ -552,105 +2223,174 @@ NAN_METHOD(Model::Run) {
 
     model->_inProgress = true;
 
-    // Start run worker
-    Nan::Callback *cb = new Nan::Callback(info[0].As<v8::Function>());
-    RunWorker *w = new RunWorker(cb, model);
-    Nan::AsyncQueueWorker(w);
+    if (model->_registry) {
+        model->_registry->touch(model);
+    }
+
+    Nan::Callback *cb = new Nan::Callback(info[1].As<v8::Function>());
+    Nan::AsyncQueueWorker(new WarmupWorker(cb, model, iterations));
 
     info.GetReturnValue().Set(Nan::Undefined());
 }
 
-NAN_METHOD(Model::GetOutput) {
+NAN_METHOD(Model::GetWarmupStats) {
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+
+    if (model->_warmupLatencies.empty()) {
+        info.GetReturnValue().Set(Nan::Null());
+        return;
+    }
+    info.GetReturnValue().Set(warmupStats(model->_warmupLatencies));
+}
+
+NAN_METHOD(Model::GetVariable) {
     if (info.Length() < 1) {
         // Throw an Error that is passed back to JavaScript
         Nan::ThrowTypeError("node-menoh insufficient number of arguments");
         return;
     }
     if (!info[0]->IsString()) {
-        Nan::ThrowTypeError("node-menoh arg 1 must be a function");
+        Nan::ThrowTypeError("node-menoh arg 1 must be a string");
         return;
     }
 
-    // Read output for the given name.
     v8::String::Utf8Value _name(info[0]);
     std::string name(*_name, _name.length());
 
     Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
 
-    float *buf;
-    menoh_error_code ec;
-    ec = menoh_model_get_variable_buffer_handle(
-        model->_native, name.c_str(), (void**)&buf);
-    if (ec) {
-        Nan::ThrowTypeError(menoh_get_last_error_message());
+    int index = model->findVar(name);
+    if (index < 0) {
+        Nan::ThrowTypeError(("node-menoh variable not found: " + name).c_str());
         return;
     }
+    info.GetReturnValue().Set(Variable::create(AddonData::from(info), info.Holder(), (size_t)index));
+}
 
-    v8::Local<v8::Array> dims = Nan::New<v8::Array>();
-    size_t n;
-    ec = model->getVarInfo(name, &dims, &n);
-    if (ec) {
-        Nan::ThrowTypeError(menoh_get_last_error_message());
+NAN_METHOD(Model::SwapWeights) {
+    if (info.Length() < 2) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
         return;
     }
-
-    // Copy whole data into a Javascript array.
-    v8::Local<v8::Array> data = Nan::New<v8::Array>();
-    for (size_t i = 0; i < n; ++i) {
-        data->Set((uint32_t)i, Nan::New(buf[i]));
+    if (!info[0]->IsString()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a string");
+        return;
+    }
+    if (!info[1]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be a function");
+        return;
     }
 
-    // Finally put them in an Javascript object.
-    v8::Local<v8::Object> results = Nan::New<v8::Object>();
-    results->Set(Nan::New("data").ToLocalChecked(), data);
-    results->Set(Nan::New("dims").ToLocalChecked(), dims);
+    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
 
-    info.GetReturnValue().Set(results);
-}
+    if (model->_swapping) {
+        Nan::ThrowTypeError("node-menoh previous swap is in progress");
+        return;
+    }
 
-NAN_METHOD(Model::GetProfile) {
-    if (info.Length() < 1) {
-        // Throw an Error that is passed back to JavaScript
-        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+    // The replicas of a pool would keep the old weights.
+    if (model->_pooled) {
+        Nan::ThrowTypeError("node-menoh cannot swap the weights of a model in a pool");
         return;
     }
-    if (!info[0]->IsString()) {
-        Nan::ThrowTypeError("node-menoh arg 1 must be a function");
+
+    // The new weights are loaded from the file alone, which lacks the
+    // nodes and parameters added to the builder.
+    if (model->_builder->_edited) {
+        Nan::ThrowTypeError("node-menoh cannot swap the weights of an edited graph");
         return;
     }
 
-    // Read output for the given name.
-    v8::String::Utf8Value _name(info[0]);
-    std::string name(*_name, _name.length());
+    v8::String::Utf8Value onnxPath(info[0]);
+    std::string path(*onnxPath, onnxPath.length());
 
-    Model* model = ObjectWrap::Unwrap<Model>(info.Holder());
+    model->_swapping = true;
 
-    float *buf;
-    menoh_error_code ec;
-    ec = menoh_model_get_variable_buffer_handle(
-        model->_native, name.c_str(), (void**)&buf);
-    if (ec) {
-        Nan::ThrowTypeError(menoh_get_last_error_message());
+    // Start swap worker
+    Nan::Callback *cb = new Nan::Callback(info[1].As<v8::Function>());
+    SwapWorker *w = new SwapWorker(cb, model, path);
+    w->SaveToPersistent("model", info.Holder());
+    Nan::AsyncQueueWorker(w);
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Model::SwapWorker (inner) class
+
+Model::SwapWorker::SwapWorker(
+    Nan::Callback *callback,
+    Model *model,
+    std::string const& onnxPath) :  Nan::AsyncWorker(callback),
+                                    _model(model),
+                                    _onnxPath(onnxPath),
+                                    _buffers(model->_buffers),
+                                    _numInputs(model->_ivNames.size()),
+                                    _backendName(model->_backendName),
+                                    _backendConfig(model->_backendConfig),
+                                    _data(NULL),
+                                    _vpt(NULL),
+                                    _native(NULL) {
+}
+
+Model::SwapWorker::~SwapWorker() {
+    // Release whatever has not been handed over to the model.
+    if (_native) {
+        menoh_delete_model(_native);
+    }
+    if (_vpt) {
+        menoh_delete_variable_profile_table(_vpt);
+    }
+    if (_data) {
+        menoh_delete_model_data(_data);
+    }
+}
+
+void Model::SwapWorker::Execute() {
+    std::string error;
+    if (!loadWeights(_onnxPath, _buffers, _numInputs, &_data, &_vpt, &error)) {
+        SetErrorMessage(error.c_str());
         return;
     }
 
-    v8::Local<v8::Array> dims = Nan::New<v8::Array>();
-    size_t n;
-    ec = model->getVarInfo(name, &dims, &n);
+    menoh_error_code ec = buildNative(_vpt, _data, _buffers, _backendName, _backendConfig, &_native);
     if (ec) {
-        Nan::ThrowTypeError(menoh_get_last_error_message());
+        SetErrorMessage(menoh_get_last_error_message());
         return;
     }
+}
 
-    // Finally put them in an Javascript object.
-    v8::Local<v8::Object> results = Nan::New<v8::Object>();
-    results->Set(
-        Nan::New("buf").ToLocalChecked(), 
-        Nan::NewBuffer((char *)buf, sizeof(float)*n, bufferFreeCallback, 0).ToLocalChecked());
-    results->Set(Nan::New("dims").ToLocalChecked(), dims);
-    results->Set(Nan::New("dtype").ToLocalChecked(), Nan::New("float32").ToLocalChecked());
+// Called by the main thread.
+void Model::SwapWorker::HandleOKCallback() {
+    Nan::AsyncResource resource("Model.SwapWorker.OKCallback");
+    _model->_swapping = false;
+
+    if (_model->_inProgress) {
+        // Let the current run finish on the old weights.
+        if (_model->_pendingNative) {
+            menoh_delete_model(_model->_pendingNative);
+            menoh_delete_variable_profile_table(_model->_pendingVpt);
+            menoh_delete_model_data(_model->_pendingData);
+        }
+        _model->_pendingData = _data;
+        _model->_pendingVpt = _vpt;
+        _model->_pendingNative = _native;
+    } else {
+        _model->installWeights(_data, _vpt, _native);
+    }
+    _model->_weightsPath = _onnxPath;
+    _data = NULL;
+    _vpt = NULL;
+    _native = NULL;
 
-    info.GetReturnValue().Set(results);
+    callback->Call(0, NULL, &resource);
+}
+
+// Called by the main thread.
+void Model::SwapWorker::HandleErrorCallback() {
+    _model->_swapping = false;
+    Nan::AsyncWorker::HandleErrorCallback();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -658,31 +2398,284 @@ NAN_METHOD(Model::GetProfile) {
 
 Model::RunWorker::RunWorker(
     Nan::Callback *callback,
-    Model *model) : Nan::AsyncWorker(callback), _model(model) {
+    Model *model) : CachedRunWorker(callback, "Model.RunWorker"),
+                    _model(model),
+                    _deliver(false),
+                    _outputs(),
+                    _data(NULL),
+                    _queuedAt(),
+                    _runMs(0) {
 }
 
 Model::RunWorker::~RunWorker() {
+    ::free(_data);
 }
 
 void Model::RunWorker::Execute() {
-    menoh_error_code ec = menoh_model_run(_model->_native);
-    if (ec) {
+    if (!_cancel.start()) {
+        SetErrorMessage("node-menoh cancelled");
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (_model->runCached(this)) {
         SetErrorMessage(menoh_get_last_error_message());
+        return;
+    }
+    if (queued()) {
+        return;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    _runMs = elapsed.count();
+
+    // Copy the requested outputs, as the buffers are reused by the next run.
+    if (_deliver) {
+        _data = _model->copyOutputs(_outputs);
+        if (!_data) {
+            SetErrorMessage("node-menoh failed to allocate the outputs");
+        }
+    }
+}
+
+// Called by the main thread.
+void Model::RunWorker::resumed(Model *model, std::string const *error) {
+    if (error) {
+        SetErrorMessage(error->c_str());
+        return;
+    }
+    if (_deliver) {
+        _data = model->copyOutputs(_outputs);
+        if (!_data) {
+            SetErrorMessage("node-menoh failed to allocate the outputs");
+        }
     }
 }
 
 // Called by the main thread.
 void Model::RunWorker::HandleOKCallback() {
+    Nan::HandleScope scope;
     Nan::AsyncResource resource("Model.RunWorker.OKCallback");
     _model->_inProgress = false;
-    callback->Call(0, NULL, &resource); // emit closed event
+    _model->_runWorker = NULL;
+    _model->applyPendingWeights();
+
+    std::chrono::duration<double, std::milli> total = std::chrono::steady_clock::now() - _queuedAt;
+    _model->_asyncRuns++;
+    _model->_asyncRunMs += _runMs;
+    _model->_asyncTotalMs += total.count();
+
+    if (!_deliver) {
+        callback->Call(0, NULL, &resource); // emit closed event
+        return;
+    }
+
+    v8::Local<v8::Object> outputs = _model->outputArrays(_outputs, _data);
+    _data = NULL;
+
+    v8::Local<v8::Value> argv[] = { Nan::Undefined(), outputs };
+    callback->Call(2, argv, &resource);
 }
 
 // Called by the main thread.
 void Model::RunWorker::HandleErrorCallback() {
     _model->_inProgress = false;
+    _model->_runWorker = NULL;
+    _model->applyPendingWeights();
+    if (!_model->_native && _model->_registry) {
+        // The rebuild has failed.
+        _model->_registry->release(_model);
+    }
+    if (_cancel.cancelled()) {
+        Nan::HandleScope scope;
+        Nan::AsyncResource resource("Model.RunWorker.ErrorCallback");
+        v8::Local<v8::Value> argv[] = { makeError(ErrorMessage(), "MENOH_CANCELLED") };
+        callback->Call(1, argv, &resource);
+        return;
+    }
+    Nan::AsyncWorker::HandleErrorCallback();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Model::WarmupWorker (inner) class
+
+Model::WarmupWorker::WarmupWorker(
+    Nan::Callback *callback,
+    Model *model,
+    uint32_t iterations) :  Nan::AsyncWorker(callback),
+                            _model(model),
+                            _iterations(iterations),
+                            _latencies() {
+}
+
+Model::WarmupWorker::~WarmupWorker() {
+}
+
+void Model::WarmupWorker::Execute() {
+    if (_model->warmup(_iterations, &_latencies)) {
+        SetErrorMessage(menoh_get_last_error_message());
+    }
+}
+
+// Called by the main thread.
+void Model::WarmupWorker::HandleOKCallback() {
+    Nan::HandleScope scope;
+    Nan::AsyncResource resource("Model.WarmupWorker.OKCallback");
+    _model->_inProgress = false;
+    _model->applyPendingWeights();
+    _model->_warmupLatencies = _latencies;
+
+    v8::Local<v8::Value> argv[] = { Nan::Undefined(), warmupStats(_latencies) };
+    callback->Call(2, argv, &resource);
+}
+
+// Called by the main thread.
+void Model::WarmupWorker::HandleErrorCallback() {
+    _model->_inProgress = false;
+    _model->applyPendingWeights();
+    if (!_model->_native && _model->_registry) {
+        // The rebuild has failed.
+        _model->_registry->release(_model);
+    }
     Nan::AsyncWorker::HandleErrorCallback();
 }
+#ifdef NODEMENOH_PROMISE_RUN
+////////////////////////////////////////////////////////////////////////////////
+// Model::PromiseWorker (inner) class
+
+Model::PromiseWorker::PromiseWorker(Model *model) : CachedRunWorker(NULL, "Model.PromiseWorker"),
+                                                    _model(model),
+                                                    _cancel(),
+                                                    _running(false),
+                                                    _resolver(),
+                                                    _ec(menoh_error_code_success),
+                                                    _error(),
+                                                    _deliver(false),
+                                                    _outputs(),
+                                                    _data(NULL),
+                                                    _queuedAt(),
+                                                    _runMs(0) {
+    _context = node::EmitAsyncInit(v8::Isolate::GetCurrent(),
+                                   Nan::New(persistentHandle),
+                                   "Model.PromiseWorker");
+}
+
+Model::PromiseWorker::~PromiseWorker() {
+    node::EmitAsyncDestroy(v8::Isolate::GetCurrent(), _context);
+    _resolver.Reset();
+    ::free(_data);
+}
+
+v8::Local<v8::Promise> Model::PromiseWorker::start(bool deliver, std::vector<size_t>& outputs) {
+    Nan::EscapableHandleScope scope;
+    v8::Local<v8::Promise::Resolver> resolver =
+        v8::Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked();
+    _resolver.Reset(resolver);
+    _ec = menoh_error_code_success;
+    _cancel.reset();
+    _running = true;
+    _deliver = deliver;
+    _outputs.swap(outputs);
+    _queuedAt = std::chrono::steady_clock::now();
+
+    // Keep the model (and this) alive until the run completes.
+    _model->_inProgress = true;
+    _model->Ref();
+    Nan::AsyncQueueWorker(this);
+    return scope.Escape(resolver->GetPromise());
+}
+
+void Model::PromiseWorker::Execute() {
+    if (!_cancel.start()) {
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    _ec = _model->runCached(this);
+    if (_ec) {
+        _error = menoh_get_last_error_message();
+        return;
+    }
+    if (queued()) {
+        return;
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    _runMs = elapsed.count();
+
+    // Copy the requested outputs, as the buffers are reused by the next run.
+    if (_deliver) {
+        _data = _model->copyOutputs(_outputs);
+        if (!_data) {
+            _ec = menoh_error_code_std_error;
+            _error = "node-menoh failed to allocate the outputs";
+        }
+    }
+}
+
+// Called by the main thread.
+void Model::PromiseWorker::resumed(Model *model, std::string const *error) {
+    if (error) {
+        _ec = menoh_error_code_unknown_error;
+        _error = *error;
+        return;
+    }
+    if (_deliver) {
+        _data = model->copyOutputs(_outputs);
+        if (!_data) {
+            _ec = menoh_error_code_std_error;
+            _error = "node-menoh failed to allocate the outputs";
+        }
+    }
+}
+
+// Called by the main thread.
+void Model::PromiseWorker::WorkComplete() {
+    if (park()) {
+        return;
+    }
+    Nan::HandleScope scope;
+    v8::Isolate *isolate = v8::Isolate::GetCurrent();
+    v8::Local<v8::Context> context = Nan::GetCurrentContext();
+
+    // The local handle keeps the model alive after Unref().
+    v8::Local<v8::Object> modelObj = _model->handle();
+    _running = false;
+    _model->_inProgress = false;
+    _model->applyPendingWeights();
+    _model->Unref();
+
+    v8::Local<v8::Promise::Resolver> resolver = Nan::New(_resolver);
+    _resolver.Reset();
+
+    // Microtasks (e.g. the continuations of the promise) run when the
+    // scope closes.
+    node::CallbackScope callbackScope(isolate, Nan::New(persistentHandle), _context);
+    if (_cancel.cancelled()) {
+        resolver->Reject(context, makeError("node-menoh cancelled", "MENOH_CANCELLED")).FromJust();
+        return;
+    }
+    if (_ec) {
+        if (!_model->_native && _model->_registry) {
+            // The rebuild has failed.
+            _model->_registry->release(_model);
+        }
+        resolver->Reject(context, Nan::Error(_error.c_str())).FromJust();
+        return;
+    }
+
+    std::chrono::duration<double, std::milli> total = std::chrono::steady_clock::now() - _queuedAt;
+    _model->_asyncRuns++;
+    _model->_asyncRunMs += _runMs;
+    _model->_asyncTotalMs += total.count();
+
+    v8::Local<v8::Value> result = Nan::Undefined();
+    if (_deliver) {
+        result = _model->outputArrays(_outputs, _data);
+        _data = NULL;
+    }
+    (void)modelObj;
+    resolver->Resolve(context, result).FromJust();
+}
 
+void Model::PromiseWorker::Destroy() {
+}
+#endif
 
 }  // namespace nodeMenoh
@@ -1,12 +1,93 @@
 #ifndef NODEMENOH_MODEL_H
 #define NODEMENOH_MODEL_H
 
+#include <list>
+#include <map>
+#include <atomic>
+#include <chrono>
 #include <nan.h>
 #include <menoh/menoh.h>
+#include "model_data_cache.h"
+#include "result_cache.h"
+#include "addon_data.h"
+#include "tensor_arena.h"
+#include "convert.h"
 
 namespace nodeMenoh {
 
 typedef std::vector<std::string> InputVarNames;
+typedef std::vector<std::string> OutputVarNames;
+
+class ModelRegistry;
+class Model;
+
+// Settling a native promise from a work completion needs node::CallbackScope
+// (to run the microtasks), which older versions lack.
+#if NODE_MAJOR_VERSION >= 10
+#define NODEMENOH_PROMISE_RUN 1
+#endif
+
+// Returns an Error with `code` set. (e.g. MENOH_CANCELLED)
+v8::Local<v8::Value> makeError(const char *msg, const char *code);
+
+// Lets a queued work be cancelled before its worker thread starts it.
+class CancelState {
+    public:
+        CancelState();
+
+        // Returns false if cancelled. (worker thread)
+        bool start();
+
+        // Returns false if already started. (main thread)
+        bool cancel();
+
+        bool cancelled() const;
+
+        // Makes the state queued again for a reused worker. (main thread)
+        void reset();
+
+    private:
+        enum { kQueued, kStarted, kCancelled };
+        std::atomic<int> _state;
+};
+
+// Base of the workers of asynchronous runs. A run whose inputs are being
+// run by another model sharing the result cache is queued behind it
+// (see ResultCache::Waiter) instead of blocking a thread of the pool. Its
+// completion is then held back until the outputs arrive.
+class CachedRunWorker : public Nan::AsyncWorker, public ResultCache::Waiter {
+    friend class Model;
+
+    public:
+        explicit CachedRunWorker(Nan::Callback *callback, const char *resourceName);
+
+    protected:
+        // True if the run has been queued behind another one. (worker
+        // thread, after Model::runCached)
+        bool queued() const { return _cache != NULL; }
+
+        // Called by the main thread when the outputs of a queued run have
+        // been written to the buffers of `model`, or with the error of the
+        // other run.
+        virtual void resumed(Model *model, std::string const *error) = 0;
+
+        // Returns true if the completion must wait for resume(), and
+        // holds it back. (main thread)
+        bool park();
+
+        // Called by the main therad.
+        virtual void WorkComplete();
+        virtual void Destroy();
+
+    private:
+        // Called by the main therad.
+        void resume(ResultCache::Outputs const *outputs, std::string const& error);
+
+        Model *_queuedOn;       // while queued
+        ResultCache *_cache;    // non-NULL if queued
+        bool _resumed;
+        bool _parked;
+};
 
 
 class ModelBuilder : public Nan::ObjectWrap {
@@ -17,7 +98,9 @@ class ModelBuilder : public Nan::ObjectWrap {
                 friend class ModelBuilder;
 
             private:
-                explicit LoadWorker(Nan::Callback* callback, const std::string& onnxPath);
+                explicit LoadWorker(  Nan::Callback* callback,
+                                        AddonData *addon,
+                                        const std::string& onnxPath);
                 virtual ~LoadWorker();
 
                 // Called by the worker thread.
@@ -26,38 +109,104 @@ class ModelBuilder : public Nan::ObjectWrap {
                 // Called by the main therad.
                 virtual void HandleOKCallback();
 
+                AddonData *_addon;
                 std::string _onnxPath;
-                menoh_model_data_handle _data;
+                ModelDataCache::Entry *_entry;
         };
 
         explicit ModelBuilder();
         ~ModelBuilder();
 
-        static void Init(v8::Local<v8::Object> exports);
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
 
     private:
+        // Builds the variable profile table and optimizes the model data.
+        menoh_error_code buildProfileTable();
+
+        // Replaces the shared (cached) model data with a private copy.
+        menoh_error_code detachData();
+
+        std::string profileSignature() const;
+
+        // Makes the model data private so that it can be edited, and
+        // marks the graph as edited.
+        menoh_error_code prepareEdit();
+
+        // Adds a float parameter. The values are copied into a buffer
+        // owned by the builder.
+        menoh_error_code addParameter(  std::string const& name,
+                                        std::vector<int32_t> const& dims,
+                                        std::vector<float> const& values);
+
+        // Adds a float parameter referring to `buf`, which must outlive
+        // the builder and the models built from it.
+        menoh_error_code addParameter(  std::string const& name,
+                                        std::vector<int32_t> const& dims,
+                                        float *buf);
+
+        // An attribute of a node, converted before the node is added
+        struct Attribute {
+            enum Type { kInt, kFloat, kInts, kFloats };
+
+            std::string name;
+            Type type;
+            std::vector<int32_t> ints;  // kInt, kInts
+            std::vector<float> floats;  // kFloat, kFloats
+        };
+
+        // Adds a node. Attributes are added to it afterwards.
+        menoh_error_code addNode(   std::string const& opType,
+                                    std::vector<std::string> const& inputs,
+                                    std::vector<std::string> const& outputs);
+
+        // Converts an attribute given as a number, an array of numbers, a
+        // typed array or { type, value }. Returns false if invalid.
+        static bool toAttribute(std::string const& name,
+                                v8::Local<v8::Value> value,
+                                Attribute *attr);
+
+        // Adds an attribute to the node added last.
+        menoh_error_code addAttribute(Attribute const& attr);
+
         menoh_model_data_handle _data;
+        ModelDataCache::Entry *_shared; // non-NULL while _data is shared
         menoh_variable_profile_table_builder_handle _vptBuilder;
         menoh_variable_profile_table_handle _vpt;
         InputVarNames _ivNames;
+        OutputVarNames _ovNames;
+        size_t _dataBytes;  // size of the ONNX file and added parameters
+        std::list<std::vector<float> > _params; // added parameter buffers
+        std::vector<Nan::Persistent<v8::Object>*> _paramRefs; // referenced Float32Arrays
+        std::map<std::string, Dtype> _sourceDtypes; // of the inputs other than float32
+        bool _edited;   // nodes or parameters added (not in the ONNX file)
 
-        static Nan::Persistent<v8::Function> constructor;
         static NAN_METHOD(New);
         static NAN_METHOD(Create);
+        static NAN_METHOD(CreateEmpty);
         static NAN_METHOD(GetNativeVersion);
 
         // NodeJS property methods
         static NAN_METHOD(AddInput);
         static NAN_METHOD(AddOutput);
         static NAN_METHOD(BuildModel);
+        static NAN_METHOD(PrependNormalization);
+        static NAN_METHOD(AddParameter);
+        static NAN_METHOD(AddNode);
 };
 
 
 class Model : public Nan::ObjectWrap {
     public:
         friend class ModelBuilder;
-
-        class RunWorker : public Nan::AsyncWorker {
+        friend class ModelRegistry;
+        friend class SharedRing;
+        friend class ModelPool;
+        friend class Variable;
+        friend class TiledRun;
+        friend class VectorIndex;
+        friend class CachedRunWorker;
+
+        class RunWorker : public CachedRunWorker {
             friend class Model;
 
             public:
@@ -73,36 +222,312 @@ class Model : public Nan::ObjectWrap {
                 virtual void HandleOKCallback();
                 virtual void HandleErrorCallback();
 
+                virtual void resumed(Model *model, std::string const *error);
+
+                Model *_model;
+                CancelState _cancel;
+                bool _deliver;                  // deliver outputs to the callback
+                std::vector<size_t> _outputs;   // indices of _buffers
+                char *_data;                    // copy of the outputs
+                std::chrono::steady_clock::time_point _queuedAt;
+                double _runMs;                  // in Execute()
+        };
+
+        // Pre-faults the buffers and runs the model a few times.
+        // (see Model::warmup)
+        class WarmupWorker : public Nan::AsyncWorker {
+            friend class Model;
+
+            public:
+                explicit WarmupWorker(Nan::Callback *callback, Model *model, uint32_t iterations);
+
+            private:
+                virtual ~WarmupWorker();
+
+                // Called by the worker thread.
+                void Execute();
+
+                // Called by the main therad.
+                virtual void HandleOKCallback();
+                virtual void HandleErrorCallback();
+
+                Model *_model;
+                uint32_t _iterations;
+                std::vector<double> _latencies;
+        };
+
+#ifdef NODEMENOH_PROMISE_RUN
+        // Runs the model and settles a native promise. One instance per
+        // model is reused by all the runs, so that a run allocates neither
+        // a worker, a callback nor an async resource. (The async context is
+        // shared by the runs.)
+        class PromiseWorker : public CachedRunWorker {
+            friend class Model;
+
+            public:
+                explicit PromiseWorker(Model *model);
+                virtual ~PromiseWorker();
+
+                // Queues a run. Returns its promise. (main thread)
+                v8::Local<v8::Promise> start(bool deliver, std::vector<size_t>& outputs);
+
+            private:
+                // Called by the worker thread.
+                void Execute();
+
+                // Called by the main therad. Settles the promise.
+                virtual void WorkComplete();
+
+                // Keeps the instance for the next run. (Deleted by ~Model)
+                virtual void Destroy();
+
+                virtual void resumed(Model *model, std::string const *error);
+
+                Model *_model;
+                CancelState _cancel;
+                bool _running;  // between start() and WorkComplete()
+                Nan::Persistent<v8::Promise::Resolver> _resolver;
+                node::async_context _context;
+                menoh_error_code _ec;
+                std::string _error;
+                bool _deliver;
+                std::vector<size_t> _outputs;
+                char *_data;
+                std::chrono::steady_clock::time_point _queuedAt;
+                double _runMs;
+        };
+#endif
+
+        // Input/output buffer owned by the model, which also describes the
+        // variable so that it is accessed without the C API.
+        //
+        // An input with a source dtype other than float32 is written in
+        // that dtype to `ptr`, and widened to `attached` before a run.
+        struct VarBuffer {
+            std::string name;
+            Dtype dtype;    // of the data in `ptr`
+            void *ptr;
+            size_t size;    // in bytes
+            float *attached;    // attached to the native model
+            std::vector<int32_t> dims;
+        };
+        typedef std::vector<VarBuffer> VarBuffers;
+
+        // Loads new weights from an ONNX file with the same topology and
+        // builds a native model on them. Until the old weights are released,
+        // both copies of the model data and both native models are held, so
+        // the peak memory of the model is about twice its usual footprint.
+        class SwapWorker : public Nan::AsyncWorker {
+            friend class Model;
+
+            public:
+                explicit SwapWorker(Nan::Callback *callback, Model *model, std::string const& onnxPath);
+
+            private:
+                virtual ~SwapWorker();
+
+                // Called by the worker thread.
+                void Execute();
+
+                // Called by the main therad.
+                virtual void HandleOKCallback();
+                virtual void HandleErrorCallback();
+
                 Model *_model;
+                std::string _onnxPath;
+                VarBuffers _buffers;
+                size_t _numInputs;
+                std::string _backendName;
+                std::string _backendConfig;
+                menoh_model_data_handle _data;
+                menoh_variable_profile_table_handle _vpt;
+                menoh_model_handle _native;
         };
 
-        static void Init(v8::Local<v8::Object> exports);
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
 
+        // Allocates the buffers and builds the native model.
         menoh_error_code setUp(ModelBuilder const *mb);
 
+        // Returns the message of an error returned by setUp().
+        char const* setUpErrorMessage() const;
+
     private:
+
         explicit Model(ModelBuilder *mb);
         ~Model();
 
-        menoh_error_code getVarInfo(    std::string const& name,
-                                        v8::Local<v8::Array>* dims,
-                                        size_t *bufSize);
+        // Builds a native model attaching the given buffers.
+        static menoh_error_code buildNative(menoh_variable_profile_table_handle vpt,
+                                            menoh_model_data_handle data,
+                                            VarBuffers const& buffers,
+                                            std::string const& backendName,
+                                            std::string const& backendConfig,
+                                            menoh_model_handle *native);
+
+        // Builds the native model attaching the buffers in _buffers.
+        menoh_error_code buildNative();
+
+        // Loads the weights of an ONNX file with the topology of `buffers`
+        // and builds their profiles and optimized data. Returns false with
+        // the error message on failure. (worker thread)
+        static bool loadWeights(std::string const& onnxPath,
+                                VarBuffers const& buffers,
+                                size_t numInputs,
+                                menoh_model_data_handle *data,
+                                menoh_variable_profile_table_handle *vpt,
+                                std::string *error);
+
+        // Replaces the native model and its data (after a swap). (main thread)
+        void installWeights(menoh_model_data_handle data,
+                            menoh_variable_profile_table_handle vpt,
+                            menoh_model_handle native);
+
+        // Installs the weights swapped during the last run. (main thread)
+        void applyPendingWeights();
+
+        // Rebuilds the native model if it has been evicted. (main thread)
+        menoh_error_code ensureNative();
+
+        // Releases the native model. Buffers are kept. (main thread)
+        void evict();
+
+        // Runs the native model, or takes the outputs from the result
+        // cache. If `worker` is given and an identical run is in progress,
+        // the worker is queued behind it (see CachedRunWorker::queued).
+        // (worker thread)
+        menoh_error_code runCached(CachedRunWorker *worker = NULL);
+
+        // Widens the inputs of source dtypes other than float32 into the
+        // attached buffers. (worker thread)
+        void widenInputs();
+
+        // Touches every page of the buffers and runs the native model
+        // `iterations` times, bypassing the result cache. The latency of
+        // each run in milliseconds is stored in `latencies`.
+        menoh_error_code warmup(uint32_t iterations, std::vector<double> *latencies);
+
+        // Returns the summary of a warm-up. (main thread)
+        static v8::Local<v8::Object> warmupStats(std::vector<double> const& latencies);
+
+        // Result cache helpers (worker thread)
+        uint64_t hashInputs() const;
+        void packInputs(ResultCache::Inputs *inputs) const;
+        void packOutputs(ResultCache::Outputs *outputs) const;
+        void unpackOutputs(ResultCache::Outputs const& outputs);
+
+        // Returns the index of the variable in _buffers, or -1.
+        int findVar(std::string const& name) const;
+
+        // Reads the `outputs` option of a run. Throws and returns false if
+        // invalid. (main thread)
+        bool toOutputs(v8::Local<v8::Value> val, bool *deliver, std::vector<size_t> *outputs) const;
+
+        // Reads an array of variable names into indices of _buffers. If
+        // `names` is undefined, all the variables from `first` are taken.
+        // Returns false if a name is not a string or is not found. (set to
+        // `missing`)
+        bool findVars(  v8::Local<v8::Value> names,
+                        size_t first,
+                        std::vector<size_t> *indices,
+                        std::string *missing) const;
+
+        // Variable helpers (main thread)
+        static v8::Local<v8::Object> profileObject(VarBuffer const& vb);    // see getProfile()
+        static v8::Local<v8::Object> outputObject(VarBuffer const& vb);     // see getOutput()
+        static v8::Local<v8::Array> dimsArray(VarBuffer const& vb);
+
+        // Copies an array or a typed array into the buffer, converting the
+        // elements to the dtype of the buffer unless the typed array holds
+        // it already. (see typedArrayDtype) Returns an error message on
+        // failure.
+        static char const* copyIn(VarBuffer const& vb, v8::Local<v8::Object> data);
+
+        // Copies the buffer into a new array.
+        static v8::Local<v8::Array> copyOut(VarBuffer const& vb);
+
+        // Copies the outputs at `indices` into one malloc'ed block.
+        // Returns NULL if out of memory. (any thread)
+        char* copyOutputs(std::vector<size_t> const& indices) const;
+
+        // Returns Float32Arrays by name on the block of copyOutputs(),
+        // which is then owned by the returned arrays.
+        v8::Local<v8::Object> outputArrays(std::vector<size_t> const& indices, char *data) const;
 
         std::string _backendName;
         std::string _backendConfig;
         menoh_model_handle _native;
         InputVarNames _ivNames;
+        OutputVarNames _ovNames;
+        VarBuffers _buffers;    // in _arena
+        std::map<std::string, size_t> _varIndex;    // by name
+        TensorArena _arena;
+        size_t _alignment;      // of the buffers
+        bool _hugePages;        // use huge pages for the buffers if large
         bool _inProgress;
+        RunWorker *_runWorker;  // non-NULL while run() is in progress
+#ifdef NODEMENOH_PROMISE_RUN
+        PromiseWorker *_promiseWorker;  // created by the first runPromise()
+#endif
+        std::vector<double> _warmupLatencies;   // of the last warm-up
+
+        // Run statistics (see getRunStats())
+        uint32_t _asyncRuns;
+        double _asyncRunMs;     // total time in menoh_model_run
+        double _asyncTotalMs;   // total time from run() to the callback
+        uint32_t _syncRuns;
+        double _syncRunMs;
+        int _threads;           // see ThreadBudget
+
+        // The builder is kept alive to rebuild the native model.
+        ModelBuilder *_builder;
+        Nan::Persistent<v8::Object> _builderObj;
+
+        // Residency management (see ModelRegistry)
+        ModelRegistry *_registry;
+        Nan::Persistent<v8::Object> _registryObj;
+        size_t _footprint;
+        std::list<Model*>::iterator _lruPos;
+        bool _resident;
+
+        ResultCache *_resultCache;
+        Nan::Persistent<v8::Object> _resultCacheObj;
+        uint64_t _cacheSeed;    // changes when the weights are swapped
+
+        // Data and profiles of swapped weights. (NULL: the builder's)
+        menoh_model_data_handle _data;
+        menoh_variable_profile_table_handle _vpt;
+        std::string _weightsPath;   // of the swapped weights (empty: the builder's)
+        bool _swapping;
+        bool _pooled;               // member of a ModelPool
+
+        // Swapped weights waiting for the current run to finish.
+        menoh_model_data_handle _pendingData;
+        menoh_variable_profile_table_handle _pendingVpt;
+        menoh_model_handle _pendingNative;
+
+        static std::atomic<uint64_t> _weightsGeneration;
 
         static NAN_METHOD(New);
 
         // NodeJS property methods
         static NAN_METHOD(SetInputData);
         static NAN_METHOD(Run);
+        static NAN_METHOD(RunSync);
+#ifdef NODEMENOH_PROMISE_RUN
+        static NAN_METHOD(RunPromise);
+#endif
+        static NAN_METHOD(GetRunStats);
         static NAN_METHOD(GetOutput);
         static NAN_METHOD(GetProfile);
-
-        static Nan::Persistent<v8::Function> constructor;
+        static NAN_METHOD(GetProfiles);
+        static NAN_METHOD(GetOutputs);
+        static NAN_METHOD(SwapWeights);
+        static NAN_METHOD(GetVarNames);
+        static NAN_METHOD(Cancel);
+        static NAN_METHOD(Warmup);
+        static NAN_METHOD(GetWarmupStats);
+        static NAN_METHOD(GetVariable);
 };
 
 }  // namespace nodeMenoh
@@ -0,0 +1,149 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sstream>
+#include "model_data_cache.h"
+
+namespace nodeMenoh {
+
+
+// Returns a key identifying the current content of the file, or an empty
+// string if the file cannot be stat'ed. (In which case the load is not
+// cached and menoh reports the error.) The mtime is taken in nanoseconds,
+// so that a file rewritten within a second is not mistaken for the old
+// one where the file system records it.
+static std::string makeFileKey(std::string const& path, size_t *fileSize) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return std::string();
+    }
+
+#if defined(__APPLE__)
+    long nsec = st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    long nsec = 0;  // seconds only
+#else
+    long nsec = st.st_mtim.tv_nsec;
+#endif
+
+    std::ostringstream oss;
+    oss << path << ':' << st.st_dev << ':' << st.st_ino << ':'
+        << st.st_size << ':' << st.st_mtime << '.' << nsec;
+    *fileSize = (size_t)st.st_size;
+    return oss.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ModelDataCache::Entry class
+
+ModelDataCache::Entry::Entry(   std::string const& key,
+                                std::string const& path,
+                                size_t fileSize) :  optimizedFor(),
+                                                    _key(key),
+                                                    _path(path),
+                                                    _fileSize(fileSize),
+                                                    _data(NULL),
+                                                    _error(),
+                                                    _refs(1),
+                                                    _loading(true) {
+}
+
+ModelDataCache::Entry::~Entry() {
+    if (_data) {
+        menoh_delete_model_data(_data);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ModelDataCache class
+
+std::mutex ModelDataCache::_mutex;
+std::condition_variable ModelDataCache::_loaded;
+ModelDataCache::EntryMap ModelDataCache::_entries;
+uint32_t ModelDataCache::_hits = 0;
+uint32_t ModelDataCache::_misses = 0;
+
+void ModelDataCache::Init(v8::Local<v8::Object> exports) {
+    exports->Set(Nan::New("getModelDataCacheStats").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(GetStats)->GetFunction());
+}
+
+ModelDataCache::Entry* ModelDataCache::acquire(std::string const& path, std::string *errMsg) {
+    size_t fileSize = 0;
+    std::string key = makeFileKey(path, &fileSize);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    Entry *entry;
+    EntryMap::iterator it = key.empty() ? _entries.end() : _entries.find(key);
+    if (it != _entries.end()) {
+        // Somebody else has loaded (or is loading) the same file.
+        entry = it->second;
+        entry->_refs++;
+        _hits++;
+        while (entry->_loading) {
+            _loaded.wait(lock);
+        }
+    } else {
+        entry = new Entry(key, path, fileSize);
+        _misses++;
+        if (!key.empty()) {
+            _entries[key] = entry;
+        }
+
+        // Parse without holding the lock.
+        lock.unlock();
+        menoh_model_data_handle data = NULL;
+        menoh_error_code ec = menoh_make_model_data_from_onnx(path.c_str(), &data);
+        std::string err(ec ? menoh_get_last_error_message() : "");
+        lock.lock();
+
+        entry->_loading = false;
+        entry->_data = data;
+        entry->_error = err;
+        if (!data && !key.empty()) {
+            // Do not cache failures. The next load will try again.
+            _entries.erase(key);
+        }
+        _loaded.notify_all();
+    }
+
+    if (!entry->_data) {
+        *errMsg = entry->_error;
+        releaseLocked(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+void ModelDataCache::release(Entry *entry) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    releaseLocked(entry);
+}
+
+void ModelDataCache::releaseLocked(Entry *entry) {
+    if (--entry->_refs > 0) {
+        return;
+    }
+
+    EntryMap::iterator it = _entries.find(entry->_key);
+    if (it != _entries.end() && it->second == entry) {
+        _entries.erase(it);
+    }
+    delete entry;
+}
+
+NAN_METHOD(ModelDataCache::GetStats) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+    stats->Set(Nan::New("entries").ToLocalChecked(), Nan::New((uint32_t)_entries.size()));
+    stats->Set(Nan::New("hits").ToLocalChecked(), Nan::New(_hits));
+    stats->Set(Nan::New("misses").ToLocalChecked(), Nan::New(_misses));
+
+    info.GetReturnValue().Set(stats);
+}
+
+
+}  // namespace nodeMenoh
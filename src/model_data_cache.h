@@ -0,0 +1,76 @@
+#ifndef NODEMENOH_MODEL_DATA_CACHE_H
+#define NODEMENOH_MODEL_DATA_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <condition_variable>
+#include <nan.h>
+#include <menoh/menoh.h>
+
+namespace nodeMenoh {
+
+// Process-wide cache of parsed ONNX model data.
+//
+// Entries are keyed by the file identity (path, device, inode, size and
+// mtime in nanoseconds) and shared by every ModelBuilder created from the same file.
+// Concurrent loads of the same key are coalesced into a single parse.
+// An entry lives as long as at least one builder holds a reference to it.
+class ModelDataCache {
+    public:
+        static void Init(v8::Local<v8::Object> exports);
+
+        class Entry {
+            public:
+                friend class ModelDataCache;
+
+                menoh_model_data_handle data() const { return _data; }
+                std::string const& path() const { return _path; }
+                size_t fileSize() const { return _fileSize; }
+
+                // Guards _optimizedFor and the in-place optimization of
+                // the shared data.
+                std::mutex mutex;
+
+                // Signature of the variable profiles the shared data has
+                // been optimized for. Empty while the data is pristine.
+                std::string optimizedFor;
+
+            private:
+                explicit Entry(std::string const& key, std::string const& path, size_t fileSize);
+                ~Entry();
+
+                std::string _key;
+                std::string _path;
+                size_t _fileSize;
+                menoh_model_data_handle _data;
+                std::string _error;
+                int _refs;
+                bool _loading;
+        };
+
+        // Called by a worker thread. Returns a referenced entry for the
+        // given ONNX file, or NULL with errMsg set on failure.
+        static Entry* acquire(std::string const& path, std::string *errMsg);
+
+        // Drops a reference obtained by acquire().
+        static void release(Entry *entry);
+
+    private:
+        static void releaseLocked(Entry *entry);
+
+        // menoh.getModelDataCacheStats()
+        static NAN_METHOD(GetStats);
+
+        typedef std::map<std::string, Entry*> EntryMap;
+
+        static std::mutex _mutex;
+        static std::condition_variable _loaded;
+        static EntryMap _entries;
+        static uint32_t _hits;      // acquired an existing entry
+        static uint32_t _misses;    // parsed the file
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_MODEL_DATA_CACHE_H
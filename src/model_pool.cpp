@@ -0,0 +1,1211 @@
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "model_pool.h"
+#include "model_registry.h"
+
+namespace nodeMenoh {
+
+
+// Reads a size limit. (absent: unlimited)
+static bool toLimit(v8::Local<v8::Object> config, char const *name, size_t *limit) {
+    v8::Local<v8::String> key = Nan::New(name).ToLocalChecked();
+    *limit = std::numeric_limits<size_t>::max();
+    if (!Nan::Has(config, key).FromJust()) {
+        return true;
+    }
+    v8::Local<v8::Value> val = Nan::Get(config, key).ToLocalChecked();
+    if (!val->IsNumber() || val->NumberValue() < 0) {
+        return false;
+    }
+    if (val->NumberValue() < (double)std::numeric_limits<size_t>::max()) {
+        *limit = (size_t)val->NumberValue();
+    }
+    return true;
+}
+
+static void bufferFreeCallback(char *data, void *hint) {
+    ::free(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ModelPool class
+
+ModelPool::ModelPool(   size_t maxQueue,
+                        size_t maxQueueBytes,
+                        std::vector<uint32_t> const& weights) : _members(),
+                                                                _levels(),
+                                                                _numQueued(0),
+                                                                _weights(weights),
+                                                                _maxQueue(maxQueue),
+                                                                _maxQueueBytes(maxQueueBytes),
+                                                                _queuedBytes(0),
+                                                                _nextId(0),
+                                                                _pending(0),
+                                                                _completed(0),
+                                                                _rejected(0),
+                                                                _expired(0),
+                                                                _cancelled(0),
+                                                                _dropped(),
+                                                                _dropAsync(NULL),
+                                                                _autoscale(false),
+                                                                _scaling(),
+                                                                _addon(NULL),
+                                                                _template(NULL),
+                                                                _timer(NULL),
+                                                                _dispatching(false),
+                                                                _growing(0),
+                                                                _scaleUps(0),
+                                                                _scaleDowns(0),
+                                                                _buildErrors(0),
+                                                                _lastBuildError(),
+                                                                _lastBuildErrorAt() {
+    // Referenced only while dropped requests are to be called back.
+    _dropAsync = new uv_async_t;
+    uv_async_init(Nan::GetCurrentEventLoop(), _dropAsync, onDropped);
+    _dropAsync->data = this;
+    uv_unref(reinterpret_cast<uv_handle_t*>(_dropAsync));
+}
+
+static void onTimerClosed(uv_handle_t *handle) {
+    delete reinterpret_cast<uv_timer_t*>(handle);
+}
+
+static void onAsyncClosed(uv_handle_t *handle) {
+    delete reinterpret_cast<uv_async_t*>(handle);
+}
+
+ModelPool::~ModelPool() {
+    // The pool is referenced while requests are pending, so the queue is
+    // empty here.
+    std::vector<Member>::iterator it;
+    for (it = _members.begin(); it != _members.end(); ++it) {
+        it->model->_pooled = false;
+        it->handle->Reset();
+        delete it->handle;
+    }
+    _templateObj.Reset();
+
+    if (_timer) {
+        uv_timer_stop(_timer);
+        uv_close(reinterpret_cast<uv_handle_t*>(_timer), onTimerClosed);
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(_dropAsync), onAsyncClosed);
+}
+
+void ModelPool::addMember(Model *model, v8::Local<v8::Object> obj, bool grown) {
+    Member member;
+    member.model = model;
+    member.handle = new Nan::Persistent<v8::Object>(obj);
+    member.worker = NULL;
+    member.lastUsed = Clock::now();
+    member.grown = grown;
+    _members.push_back(member);
+    model->_pooled = true;
+
+    if (!_template) {
+        _template = model;
+        _templateObj.Reset(obj);
+    }
+}
+
+void ModelPool::startAutoscale(AddonData *addon, Autoscale const& config) {
+    _autoscale = true;
+    _scaling = config;
+    _addon = addon;
+
+    // Check periodically, so that idle replicas are retired without
+    // requests. The timer does not keep the event loop alive.
+    Clock::duration interval = std::min(_scaling.scaleUpWait, _scaling.cooldown) / 2;
+    uint64_t ms = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+    ms = std::max(ms, (uint64_t)10);
+
+    _timer = new uv_timer_t;
+    uv_timer_init(Nan::GetCurrentEventLoop(), _timer);
+    _timer->data = this;
+    uv_timer_start(_timer, onTimer, ms, ms);
+    uv_unref(reinterpret_cast<uv_handle_t*>(_timer));
+}
+
+void ModelPool::onTimer(uv_timer_t *timer) {
+    ModelPool *pool = static_cast<ModelPool*>(timer->data);
+    Nan::HandleScope scope;
+    v8::Local<v8::Context> context = pool->handle()->CreationContext();
+    v8::Context::Scope contextScope(context);
+    pool->scale();
+}
+
+void ModelPool::scale() {
+    if (!_autoscale) {
+        return;
+    }
+    Clock::time_point now = Clock::now();
+
+    // Scale up when the oldest request has waited too long.
+    size_t size = _members.size() + _growing;
+    size_t footprint = 0;
+    std::vector<Member>::const_iterator it;
+    for (it = _members.begin(); it != _members.end(); ++it) {
+        footprint += it->model->_footprint;
+    }
+    footprint += _growing * _template->_footprint;
+
+    bool waiting = false;
+    Levels::const_iterator l;
+    for (l = _levels.begin(); l != _levels.end(); ++l) {
+        waiting = waiting || now - l->second.requests.front()->queuedAt >= _scaling.scaleUpWait;
+    }
+    // After a failed build, wait for the cooldown before retrying.
+    bool backoff = _buildErrors > 0 && now - _lastBuildErrorAt < _scaling.cooldown;
+    if (_growing == 0 && !backoff && size < _scaling.max && (size < _scaling.min || waiting) &&
+        footprint + _template->_footprint <= _scaling.memoryCap) {
+        grow();
+        return;
+    }
+
+    // Retire a replica idle for the cooldown, the most recent one first.
+    // The models given to the pool are never retired. Not while dispatching,
+    // as erasing a member would invalidate the iterator of dispatch().
+    if (_members.size() > _scaling.min && _numQueued == 0 && !_dispatching) {
+        for (size_t i = _members.size(); i-- > 0; ) {
+            Member& m = _members[i];
+            if (!m.grown || m.model->_inProgress || now - m.lastUsed < _scaling.cooldown) {
+                continue;
+            }
+
+            // Release the native model now rather than when collected.
+            Model *model = m.model;
+            if (model->_registry) {
+                model->_registry->remove(model);
+                model->_registry = NULL;
+                model->_registryObj.Reset();
+            }
+            model->evict();
+            model->_pooled = false;
+            m.handle->Reset();
+            delete m.handle;
+            _members.erase(_members.begin() + i);
+            _scaleDowns++;
+            break;
+        }
+    }
+}
+
+void ModelPool::grow() {
+    const int argc = 1;
+    v8::Local<v8::Value> argv[argc] = { Nan::New(_template->_builderObj) };
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(_addon->modelCons);
+    v8::Local<v8::Object> obj = Nan::NewInstance(cons, argc, argv).ToLocalChecked();
+
+    // The replica is built with the settings of the first model.
+    Model *model = ObjectWrap::Unwrap<Model>(obj);
+    model->_backendName = _template->_backendName;
+    model->_backendConfig = _template->_backendConfig;
+    model->_threads = _template->_threads;
+    model->_alignment = _template->_alignment;
+    model->_hugePages = _template->_hugePages;
+    model->_footprint = _template->_footprint;
+    if (_template->_resultCache) {
+        model->_resultCache = _template->_resultCache;
+        model->_resultCacheObj.Reset(Nan::New(_template->_resultCacheObj));
+    }
+
+    // With the weights swapped into the first model, if any, rather than
+    // those of the builder.
+    model->_weightsPath = _template->_weightsPath;
+    model->_cacheSeed = _template->_cacheSeed;
+
+    _growing++;
+    GrowWorker *w = new GrowWorker(this, model, _template->_buffers);
+    w->SaveToPersistent("pool", handle());
+    w->SaveToPersistent("model", obj);
+    Nan::AsyncQueueWorker(w);
+}
+
+void ModelPool::Init(v8::Local<v8::Object> exports, AddonData *addon) {
+    // Prepare constructor template
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
+    tpl->SetClassName(Nan::New("ModelPool").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    // Prototype
+    Nan::SetPrototypeMethod(tpl, "run", Run, addon->external());
+    Nan::SetPrototypeMethod(tpl, "runLarge", RunLarge, addon->external());
+    Nan::SetPrototypeMethod(tpl, "cancel", Cancel, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getStats", GetStats, addon->external());
+
+    addon->modelPoolCons.Reset(tpl->GetFunction());
+    exports->Set(Nan::New("ModelPool").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+size_t ModelPool::numFree() const {
+    size_t n = 0;
+    std::vector<Member>::const_iterator it;
+    for (it = _members.begin(); it != _members.end(); ++it) {
+        n += it->model->_inProgress ? 0 : 1;
+    }
+    return n;
+}
+
+size_t ModelPool::inputBytes() const {
+    Model const *model = _members[0].model;
+    size_t bytes = 0;
+    for (size_t i = 0; i < model->_ivNames.size(); ++i) {
+        bytes += model->_buffers[i].size;
+    }
+    return bytes;
+}
+
+size_t ModelPool::outputBytes() const {
+    Model const *model = _members[0].model;
+    size_t bytes = 0;
+    for (size_t i = model->_ivNames.size(); i < model->_buffers.size(); ++i) {
+        bytes += model->_buffers[i].size;
+    }
+    return bytes;
+}
+
+bool ModelPool::batched() const {
+    Model const *model = _members[0].model;
+    int32_t n = model->_buffers[0].dims.empty() ? 0 : model->_buffers[0].dims[0];
+    for (size_t i = 0; i < model->_buffers.size(); ++i) {
+        std::vector<int32_t> const& dims = model->_buffers[i].dims;
+        if (dims.empty() || dims[0] != n || n <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ModelPool::enqueue(Request *req) {
+    Level& level = _levels[req->priority];
+    if (level.requests.empty()) {
+        level.credit = 0;
+    }
+    req->queuedAt = Clock::now();
+    level.requests.push_back(req);
+    _numQueued++;
+    _queuedBytes += req->inputs.size();
+}
+
+ModelPool::Request* ModelPool::dequeue() {
+    Levels::reverse_iterator it;
+    Levels::reverse_iterator chosen = _levels.rbegin();
+
+    if (!_weights.empty()) {
+        // Smooth weighted round-robin. Each waiting priority earns its weight,
+        // and the chosen one pays the total. Ties go to the higher priority.
+        int64_t total = 0;
+        for (it = _levels.rbegin(); it != _levels.rend(); ++it) {
+            int64_t w = _weights[it->first];
+            it->second.credit += w;
+            total += w;
+            if (it->second.credit > chosen->second.credit) {
+                chosen = it;
+            }
+        }
+        chosen->second.credit -= total;
+    }
+
+    Request *req = chosen->second.requests.front();
+    chosen->second.requests.pop_front();
+    if (chosen->second.requests.empty()) {
+        _levels.erase(chosen->first);
+    }
+    _numQueued--;
+    _queuedBytes -= req->inputs.size();
+    return req;
+}
+
+ModelPool::Request* ModelPool::remove(uint32_t id) {
+    Levels::iterator it;
+    for (it = _levels.begin(); it != _levels.end(); ++it) {
+        std::deque<Request*>& requests = it->second.requests;
+        std::deque<Request*>::iterator r;
+        for (r = requests.begin(); r != requests.end(); ++r) {
+            if ((*r)->id != id) {
+                continue;
+            }
+            Request *req = *r;
+            requests.erase(r);
+            if (requests.empty()) {
+                _levels.erase(it);
+            }
+            _numQueued--;
+            _queuedBytes -= req->inputs.size();
+            return req;
+        }
+    }
+    return NULL;
+}
+
+void ModelPool::dispatch() {
+    if (_dispatching) {
+        return;
+    }
+    _dispatching = true;
+    dispatchQueued();
+    _dispatching = false;
+}
+
+void ModelPool::dispatchQueued() {
+    std::vector<Member>::iterator it;
+    for (it = _members.begin(); it != _members.end() && _numQueued > 0; ++it) {
+        Model *model = it->model;
+        if (model->_inProgress) {
+            continue;
+        }
+
+        // Drop the requests whose deadline has passed while queued.
+        Request *req = NULL;
+        while (_numQueued > 0) {
+            req = dequeue();
+            if (!req->hasDeadline || Clock::now() < req->deadline) {
+                break;
+            }
+            _expired++;
+            drop(req, makeError("node-menoh deadline exceeded", "MENOH_DEADLINE_EXCEEDED"));
+            req = NULL;
+        }
+        if (!req) {
+            break;
+        }
+
+        model->_inProgress = true;
+        if (model->_registry) {
+            // Account the model as resident. (It is rebuilt by the worker if
+            // it has been evicted.)
+            model->_registry->touch(model);
+        }
+
+        PoolWorker *w = new PoolWorker(this, model, req);
+        it->worker = w;
+        it->lastUsed = Clock::now();
+        w->SaveToPersistent("pool", handle());
+        w->SaveToPersistent("model", Nan::New(*it->handle));
+        Nan::AsyncQueueWorker(w);
+    }
+}
+
+void ModelPool::drop(Request *req, v8::Local<v8::Value> err) {
+    // The request stays pending until called back.
+    req->error.Reset(err);
+    _dropped.push_back(req);
+    if (_dropped.size() == 1) {
+        uv_ref(reinterpret_cast<uv_handle_t*>(_dropAsync));
+        uv_async_send(_dropAsync);
+    }
+}
+
+void ModelPool::onDropped(uv_async_t *async) {
+    ModelPool *pool = static_cast<ModelPool*>(async->data);
+    Nan::HandleScope scope;
+    v8::Local<v8::Context> context = pool->handle()->CreationContext();
+    v8::Context::Scope contextScope(context);
+
+    // The local handle keeps the pool alive after done() has unreferenced
+    // it.
+    v8::Local<v8::Object> poolObj = pool->handle();
+    (void)poolObj;
+
+    std::deque<Request*> dropped;
+    dropped.swap(pool->_dropped);
+    uv_unref(reinterpret_cast<uv_handle_t*>(async));
+
+    std::deque<Request*>::iterator it;
+    for (it = dropped.begin(); it != dropped.end(); ++it) {
+        Request *req = *it;
+        v8::Local<v8::Value> err = Nan::New(req->error);
+        if (req->gather) {
+            Gather *g = req->gather;
+            delete req;
+            pool->done();
+            pool->gathered(g, err);
+            continue;
+        }
+
+        Nan::AsyncResource resource("ModelPool.drop");
+        v8::Local<v8::Value> argv[] = { err };
+        Nan::Callback *cb = req->callback;
+        delete req;
+        pool->done();
+        cb->Call(1, argv, &resource);
+        delete cb;
+    }
+}
+
+void ModelPool::gathered(Gather *g, v8::Local<v8::Value> err) {
+    Nan::HandleScope scope;
+    g->remaining--;
+
+    if (!err.IsEmpty() && g->error.IsEmpty()) {
+        g->error.Reset(err);
+
+        // The other chunks are of no use anymore.
+        std::vector<uint32_t>::const_iterator id;
+        for (id = g->ids.begin(); id != g->ids.end(); ++id) {
+            Request *req = remove(*id);
+            if (req) {
+                _cancelled++;
+                delete req;
+                done();
+                g->remaining--;
+            }
+        }
+        std::vector<Member>::iterator it;
+        for (it = _members.begin(); it != _members.end(); ++it) {
+            if (it->worker && it->worker->_req->gather == g) {
+                it->worker->_cancel.cancel();
+            }
+        }
+    }
+    if (g->remaining > 0) {
+        return;
+    }
+
+    Nan::AsyncResource resource("ModelPool.gathered");
+    Nan::Callback *cb = g->callback;
+    if (!g->error.IsEmpty()) {
+        v8::Local<v8::Value> argv[] = { Nan::New(g->error) };
+        ::free(g->outputs);
+        g->pinned.Reset();
+        g->error.Reset();
+        delete g;
+        cb->Call(1, argv, &resource);
+        delete cb;
+        return;
+    }
+
+    // All the outputs share one buffer.
+    Model const *model = _members[0].model;
+    size_t numInputs = model->_ivNames.size();
+    size_t batch = model->_buffers[0].dims[0];
+    v8::Local<v8::Object> buf = Nan::NewBuffer(
+        g->outputs, outputBytes() / batch * g->samples, bufferFreeCallback, 0).ToLocalChecked();
+    v8::Local<v8::ArrayBuffer> ab = buf.As<v8::ArrayBufferView>()->Buffer();
+    size_t offset = buf.As<v8::ArrayBufferView>()->ByteOffset();
+
+    v8::Local<v8::Object> outputs = Nan::New<v8::Object>();
+    for (size_t i = numInputs; i < model->_buffers.size(); ++i) {
+        Model::VarBuffer const& vb = model->_buffers[i];
+        size_t bytes = vb.size / batch * g->samples;
+        outputs->Set(Nan::New(vb.name).ToLocalChecked(),
+                     v8::Float32Array::New(ab, offset, bytes / sizeof(float)));
+        offset += bytes;
+    }
+    g->pinned.Reset();
+    delete g;
+
+    v8::Local<v8::Value> argv[] = { Nan::Undefined(), outputs };
+    cb->Call(2, argv, &resource);
+    delete cb;
+}
+
+void ModelPool::release(PoolWorker *w) {
+    std::vector<Member>::iterator it;
+    for (it = _members.begin(); it != _members.end(); ++it) {
+        if (it->worker == w) {
+            it->worker = NULL;
+            it->lastUsed = Clock::now();
+        }
+    }
+    w->_model->_inProgress = false;
+    w->_model->applyPendingWeights();
+}
+
+void ModelPool::done() {
+    if (--_pending == 0) {
+        Unref();
+    }
+}
+
+NAN_METHOD(ModelPool::New) {
+    AddonData *addon = AddonData::from(info);
+
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be an object");
+        return;
+    }
+
+    if (!info.IsConstructCall()) {
+        // Invoked as plain function `ModelPool(...)`, turn into construct call.
+        const int argc = 1;
+        v8::Local<v8::Value> argv[argc] = { info[0] };
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->modelPoolCons);
+        info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+        return;
+    }
+
+    v8::Local<v8::Object> config = info[0]->ToObject();
+
+    // models
+    v8::Local<v8::String> key = Nan::New("models").ToLocalChecked();
+    v8::Local<v8::Value> val;
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+    }
+    if (val.IsEmpty() || !val->IsArray() || val.As<v8::Array>()->Length() == 0) {
+        Nan::ThrowTypeError("node-menoh models must be a non-empty array of Models");
+        return;
+    }
+    v8::Local<v8::Array> models = val.As<v8::Array>();
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->modelCons);
+    std::vector<Model*> members;
+    for (uint32_t i = 0; i < models->Length(); ++i) {
+        v8::Local<v8::Value> m = Nan::Get(models, i).ToLocalChecked();
+        if (!m->IsObject() || !m->InstanceOf(Nan::GetCurrentContext(), cons).FromMaybe(false)) {
+            Nan::ThrowTypeError("node-menoh models must be a non-empty array of Models");
+            return;
+        }
+        Model *model = ObjectWrap::Unwrap<Model>(m->ToObject());
+
+        // All the models must take the same variables.
+        Model const *first = members.empty() ? model : members[0];
+        bool same = model->_ivNames == first->_ivNames &&
+                    model->_ovNames == first->_ovNames;
+        for (size_t k = 0; same && k < model->_buffers.size(); ++k) {
+            same = model->_buffers[k].dims == first->_buffers[k].dims &&
+                   model->_buffers[k].dtype == first->_buffers[k].dtype;
+        }
+        if (!same) {
+            Nan::ThrowTypeError("node-menoh models must have the same inputs and outputs");
+            return;
+        }
+        if (model->_swapping) {
+            Nan::ThrowTypeError("node-menoh a swap of the model is in progress");
+            return;
+        }
+
+        // A member owns its buffers, so a model belongs to one pool once.
+        if (model->_pooled || std::find(members.begin(), members.end(), model) != members.end()) {
+            Nan::ThrowTypeError("node-menoh the model is already in a pool");
+            return;
+        }
+        members.push_back(model);
+    }
+
+    // maxQueue, maxQueueBytes
+    size_t maxQueue, maxQueueBytes;
+    if (!toLimit(config, "maxQueue", &maxQueue)) {
+        Nan::ThrowTypeError("node-menoh maxQueue must be a non-negative number");
+        return;
+    }
+    if (!toLimit(config, "maxQueueBytes", &maxQueueBytes)) {
+        Nan::ThrowTypeError("node-menoh maxQueueBytes must be a non-negative number");
+        return;
+    }
+
+    // weights
+    std::vector<uint32_t> weights;
+    key = Nan::New("weights").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+        bool valid = val->IsArray() && val.As<v8::Array>()->Length() > 0;
+        for (uint32_t i = 0; valid && i < val.As<v8::Array>()->Length(); ++i) {
+            v8::Local<v8::Value> w = Nan::Get(val.As<v8::Array>(), i).ToLocalChecked();
+            valid = w->IsUint32() && w->Uint32Value() > 0;
+            weights.push_back(valid ? w->Uint32Value() : 0);
+        }
+        if (!valid) {
+            Nan::ThrowTypeError("node-menoh weights must be an array of positive integers");
+            return;
+        }
+    }
+
+    // autoscale
+    bool autoscale = false;
+    Autoscale scaling;
+    key = Nan::New("autoscale").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+        if (!val->IsObject()) {
+            Nan::ThrowTypeError("node-menoh autoscale must be an object");
+            return;
+        }
+        v8::Local<v8::Object> as = val->ToObject();
+        size_t scaleUpWait, cooldown;
+        if (!toLimit(as, "min", &scaling.min) ||
+            !toLimit(as, "max", &scaling.max) ||
+            !toLimit(as, "scaleUpWait", &scaleUpWait) ||
+            !toLimit(as, "cooldown", &cooldown) ||
+            !toLimit(as, "memoryCap", &scaling.memoryCap)) {
+            Nan::ThrowTypeError("node-menoh autoscale options must be non-negative numbers");
+            return;
+        }
+        if (!Nan::Has(as, Nan::New("min").ToLocalChecked()).FromJust()) {
+            scaling.min = 1;
+        }
+        if (!Nan::Has(as, Nan::New("scaleUpWait").ToLocalChecked()).FromJust()) {
+            scaleUpWait = 50;
+        }
+        if (!Nan::Has(as, Nan::New("cooldown").ToLocalChecked()).FromJust()) {
+            cooldown = 30000;
+        }
+        if (scaling.min < 1 || scaling.min > scaling.max) {
+            Nan::ThrowTypeError("node-menoh autoscale must satisfy 1 <= min <= max");
+            return;
+        }
+        scaling.scaleUpWait = std::chrono::milliseconds(scaleUpWait);
+        scaling.cooldown = std::chrono::milliseconds(cooldown);
+        autoscale = true;
+    }
+
+    // Invoked as constructor: `new ModelPool(...)`
+    ModelPool* pool = new ModelPool(maxQueue, maxQueueBytes, weights);
+    for (uint32_t i = 0; i < models->Length(); ++i) {
+        pool->addMember(members[i], Nan::Get(models, i).ToLocalChecked()->ToObject(), false);
+    }
+    pool->Wrap(info.This());
+    if (autoscale) {
+        pool->startAutoscale(addon, scaling);
+        pool->scale();
+    }
+    info.GetReturnValue().Set(info.This());
+}
+
+bool ModelPool::toRequestOptions(v8::Local<v8::Object> options, Request *req) const {
+    // priority
+    req->priority = 0;
+    v8::Local<v8::String> key = Nan::New("priority").ToLocalChecked();
+    if (Nan::Has(options, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+        if (!val->IsUint32() ||
+            (!_weights.empty() && val->Uint32Value() >= _weights.size())) {
+            Nan::ThrowTypeError("node-menoh priority must be a non-negative integer less than the number of weights");
+            return false;
+        }
+        req->priority = val->Uint32Value();
+    }
+
+    // timeout (ms)
+    req->hasDeadline = false;
+    key = Nan::New("timeout").ToLocalChecked();
+    if (Nan::Has(options, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+        if (!val->IsNumber() || val->NumberValue() < 0) {
+            Nan::ThrowTypeError("node-menoh timeout must be a non-negative number");
+            return false;
+        }
+        req->hasDeadline = true;
+        req->deadline = Clock::now() + std::chrono::microseconds((int64_t)(val->NumberValue() * 1000));
+    }
+    return true;
+}
+
+NAN_METHOD(ModelPool::Run) {
+    ModelPool* pool = ObjectWrap::Unwrap<ModelPool>(info.Holder());
+
+    if (info.Length() < 3) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a typed array or an object");
+        return;
+    }
+    if (!info[1]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be an object");
+        return;
+    }
+    if (!info[2]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 3 must be a function");
+        return;
+    }
+
+    Model const *model = pool->_members[0].model;
+    v8::Local<v8::Object> options = info[1]->ToObject();
+
+    // Capture the inputs, so that the caller may reuse its arrays.
+    Request *req = new Request();
+    req->gather = NULL;
+    req->inputs.resize(pool->inputBytes());
+    size_t offset = 0;
+    for (size_t i = 0; i < model->_ivNames.size(); ++i) {
+        std::string const& name = model->_ivNames[i];
+        v8::Local<v8::Value> val = info[0];
+        if (!val->IsArrayBufferView()) {
+            val = Nan::Get(info[0]->ToObject(), Nan::New(name).ToLocalChecked()).ToLocalChecked();
+        } else if (model->_ivNames.size() > 1) {
+            val = Nan::Undefined();
+        }
+        if (!val->IsArrayBufferView()) {
+            delete req;
+            Nan::ThrowTypeError(("node-menoh input " + name + " must be a typed array").c_str());
+            return;
+        }
+        Nan::TypedArrayContents<char> data(val);
+        if (data.length() != model->_buffers[i].size) {
+            delete req;
+            Nan::ThrowRangeError(("node-menoh input " + name + " has a wrong size").c_str());
+            return;
+        }
+        ::memcpy(&req->inputs[offset], *data, data.length());
+        offset += data.length();
+    }
+
+    if (!pool->toRequestOptions(options, req)) {
+        delete req;
+        return;
+    }
+
+    // Admission control: fail fast if the request would have to wait in a
+    // full queue, instead of queueing without bound.
+    size_t numFree = pool->numFree();
+    size_t waiting = pool->_numQueued + 1 > numFree ? pool->_numQueued + 1 - numFree : 0;
+    if (waiting > pool->_maxQueue ||
+        (waiting > 0 && pool->_queuedBytes + req->inputs.size() > pool->_maxQueueBytes)) {
+        delete req;
+        pool->_rejected++;
+        Nan::ThrowError(makeError("node-menoh the queue is full", "MENOH_QUEUE_FULL"));
+        return;
+    }
+
+    req->id = pool->_nextId++;
+    req->callback = new Nan::Callback(info[2].As<v8::Function>());
+    pool->enqueue(req);
+    if (pool->_pending++ == 0) {
+        // Keep the pool alive until all the requests are done.
+        pool->Ref();
+    }
+
+    uint32_t id = req->id;
+    pool->dispatch();
+    pool->scale();
+
+    // The id is used to cancel the request.
+    info.GetReturnValue().Set(Nan::New(id));
+}
+
+NAN_METHOD(ModelPool::RunLarge) {
+    ModelPool* pool = ObjectWrap::Unwrap<ModelPool>(info.Holder());
+
+    if (info.Length() < 3) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a typed array or an object");
+        return;
+    }
+    if (!info[1]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be an object");
+        return;
+    }
+    if (!info[2]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 3 must be a function");
+        return;
+    }
+    if (!pool->batched()) {
+        Nan::ThrowTypeError("node-menoh runLarge() needs inputs and outputs batched along the first dimension");
+        return;
+    }
+
+    Model const *model = pool->_members[0].model;
+    size_t batch = model->_buffers[0].dims[0];
+    v8::Local<v8::Object> options = info[1]->ToObject();
+
+    // The inputs are read in place by the chunks, so they are pinned.
+    Gather *g = new Gather();
+    g->outputs = NULL;
+    g->samples = 0;
+    g->remaining = 0;
+    g->callback = NULL;
+    v8::Local<v8::Array> pinned = Nan::New<v8::Array>();
+    for (size_t i = 0; i < model->_ivNames.size(); ++i) {
+        std::string const& name = model->_ivNames[i];
+        v8::Local<v8::Value> val = info[0];
+        if (!val->IsArrayBufferView()) {
+            val = Nan::Get(info[0]->ToObject(), Nan::New(name).ToLocalChecked()).ToLocalChecked();
+        } else if (model->_ivNames.size() > 1) {
+            val = Nan::Undefined();
+        }
+        if (!val->IsArrayBufferView()) {
+            delete g;
+            Nan::ThrowTypeError(("node-menoh input " + name + " must be a typed array").c_str());
+            return;
+        }
+        Nan::TypedArrayContents<char> data(val);
+        size_t bytes = model->_buffers[i].size / batch;
+        size_t samples = data.length() / bytes;
+        if (data.length() % bytes || samples == 0 || (i > 0 && samples != g->samples)) {
+            delete g;
+            Nan::ThrowRangeError(("node-menoh input " + name + " must hold the same whole number of samples as the others").c_str());
+            return;
+        }
+        g->samples = samples;
+        g->inputs.push_back(*data);
+        pinned->Set((uint32_t)i, val);
+    }
+
+    Request opts;
+    if (!pool->toRequestOptions(options, &opts)) {
+        delete g;
+        return;
+    }
+
+    // Admission control as for run(), for all the chunks at once. The
+    // chunks hold no copy of the inputs.
+    size_t chunks = (g->samples + batch - 1) / batch;
+    size_t numFree = pool->numFree();
+    size_t queued = pool->_numQueued + chunks;
+    size_t waiting = queued > numFree ? queued - numFree : 0;
+    if (waiting > pool->_maxQueue) {
+        delete g;
+        pool->_rejected++;
+        Nan::ThrowError(makeError("node-menoh the queue is full", "MENOH_QUEUE_FULL"));
+        return;
+    }
+
+    g->outputs = (char*)::malloc(std::max<size_t>(pool->outputBytes() / batch * g->samples, 1));
+    if (!g->outputs) {
+        delete g;
+        Nan::ThrowError("node-menoh failed to allocate the outputs");
+        return;
+    }
+    g->pinned.Reset(pinned);
+    g->callback = new Nan::Callback(info[2].As<v8::Function>());
+    g->remaining = (uint32_t)chunks;
+
+    v8::Local<v8::Array> ids = Nan::New<v8::Array>((int)chunks);
+    for (size_t c = 0; c < chunks; ++c) {
+        Request *req = new Request();
+        req->id = pool->_nextId++;
+        req->callback = NULL;
+        req->priority = opts.priority;
+        req->hasDeadline = opts.hasDeadline;
+        req->deadline = opts.deadline;
+        req->gather = g;
+        req->first = c * batch;
+        req->count = std::min(batch, g->samples - req->first);
+        g->ids.push_back(req->id);
+        ids->Set((uint32_t)c, Nan::New(req->id));
+        pool->enqueue(req);
+        if (pool->_pending++ == 0) {
+            // Keep the pool alive until all the requests are done.
+            pool->Ref();
+        }
+    }
+
+    pool->dispatch();
+    pool->scale();
+
+    // The ids are used to cancel the chunks.
+    info.GetReturnValue().Set(ids);
+}
+
+NAN_METHOD(ModelPool::Cancel) {
+    ModelPool* pool = ObjectWrap::Unwrap<ModelPool>(info.Holder());
+
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsUint32()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a request id");
+        return;
+    }
+    uint32_t id = info[0]->Uint32Value();
+
+    // A queued request is removed and fails right away.
+    Request *req = pool->remove(id);
+    if (req) {
+        pool->_cancelled++;
+        pool->drop(req, makeError("node-menoh cancelled", "MENOH_CANCELLED"));
+        info.GetReturnValue().Set(Nan::True());
+        return;
+    }
+
+    // A dispatched request can be cancelled until a worker thread starts it.
+    bool cancelled = false;
+    std::vector<Member>::iterator it;
+    for (it = pool->_members.begin(); it != pool->_members.end(); ++it) {
+        if (it->worker && it->worker->_req->id == id) {
+            cancelled = it->worker->_cancel.cancel();
+            break;
+        }
+    }
+    info.GetReturnValue().Set(Nan::New(cancelled));
+}
+
+NAN_METHOD(ModelPool::GetStats) {
+    ModelPool* pool = ObjectWrap::Unwrap<ModelPool>(info.Holder());
+
+    uint32_t busy = 0;
+    std::vector<Member>::const_iterator it;
+    for (it = pool->_members.begin(); it != pool->_members.end(); ++it) {
+        busy += it->model->_inProgress ? 1 : 0;
+    }
+
+    v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+    stats->Set(Nan::New("models").ToLocalChecked(), Nan::New((uint32_t)pool->_members.size()));
+    stats->Set(Nan::New("busy").ToLocalChecked(), Nan::New(busy));
+    stats->Set(Nan::New("queued").ToLocalChecked(), Nan::New((uint32_t)pool->_numQueued));
+    stats->Set(Nan::New("queuedBytes").ToLocalChecked(), Nan::New((double)pool->_queuedBytes));
+    stats->Set(Nan::New("completed").ToLocalChecked(), Nan::New(pool->_completed));
+    stats->Set(Nan::New("rejected").ToLocalChecked(), Nan::New(pool->_rejected));
+    stats->Set(Nan::New("expired").ToLocalChecked(), Nan::New(pool->_expired));
+    stats->Set(Nan::New("cancelled").ToLocalChecked(), Nan::New(pool->_cancelled));
+    if (pool->_autoscale) {
+        stats->Set(Nan::New("min").ToLocalChecked(), Nan::New((uint32_t)pool->_scaling.min));
+        stats->Set(Nan::New("max").ToLocalChecked(), Nan::New((double)pool->_scaling.max));
+        stats->Set(Nan::New("growing").ToLocalChecked(), Nan::New(pool->_growing));
+        stats->Set(Nan::New("scaleUps").ToLocalChecked(), Nan::New(pool->_scaleUps));
+        stats->Set(Nan::New("scaleDowns").ToLocalChecked(), Nan::New(pool->_scaleDowns));
+        stats->Set(Nan::New("buildErrors").ToLocalChecked(), Nan::New(pool->_buildErrors));
+        if (pool->_buildErrors > 0) {
+            stats->Set(Nan::New("lastBuildError").ToLocalChecked(),
+                       Nan::New(pool->_lastBuildError).ToLocalChecked());
+        }
+    }
+
+    info.GetReturnValue().Set(stats);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ModelPool::PoolWorker (inner) class
+
+ModelPool::PoolWorker::PoolWorker(
+    ModelPool *pool,
+    Model *model,
+    Request *req) : CachedRunWorker(req->callback, "ModelPool.PoolWorker"),
+                    _pool(pool),
+                    _model(model),
+                    _req(req),
+                    _expired(false),
+                    _outputs(NULL) {
+    // The callback is now owned by the worker.
+    req->callback = NULL;
+}
+
+ModelPool::PoolWorker::~PoolWorker() {
+    delete _req;
+    ::free(_outputs);
+}
+
+void ModelPool::PoolWorker::Execute() {
+    if (!_cancel.start()) {
+        SetErrorMessage("node-menoh cancelled");
+        return;
+    }
+
+    // The request may have waited for a thread of the pool.
+    if (_req->hasDeadline && Clock::now() >= _req->deadline) {
+        _expired = true;
+        SetErrorMessage("node-menoh deadline exceeded");
+        return;
+    }
+
+    Model::VarBuffers& buffers = _model->_buffers;
+    size_t numInputs = _model->_ivNames.size();
+    Gather *g = _req->gather;
+    if (g) {
+        // Samples of the chunk, straight from the arrays of the caller.
+        // The rest of a partial batch is zeroed.
+        size_t batch = buffers[0].dims[0];
+        for (size_t i = 0; i < numInputs; ++i) {
+            size_t bytes = buffers[i].size / batch;
+            char *dst = static_cast<char*>(buffers[i].ptr);
+            ::memcpy(dst, g->inputs[i] + _req->first * bytes, _req->count * bytes);
+            ::memset(dst + _req->count * bytes, 0, (batch - _req->count) * bytes);
+        }
+    } else {
+        char const *p = _req->inputs.data();
+        for (size_t i = 0; i < numInputs; ++i) {
+            ::memcpy(buffers[i].ptr, p, buffers[i].size);
+            p += buffers[i].size;
+        }
+    }
+
+    if (_model->runCached(this)) {
+        SetErrorMessage(menoh_get_last_error_message());
+        return;
+    }
+    if (!queued()) {
+        collect();
+    }
+}
+
+// Called by the main thread.
+void ModelPool::PoolWorker::resumed(Model *model, std::string const *error) {
+    (void)model;
+    if (error) {
+        SetErrorMessage(error->c_str());
+        return;
+    }
+    collect();
+}
+
+void ModelPool::PoolWorker::collect() {
+    Model::VarBuffers& buffers = _model->_buffers;
+    size_t numInputs = _model->_ivNames.size();
+    Gather *g = _req->gather;
+    if (g) {
+        // Into the samples of the chunk in the gathered outputs. Chunks
+        // write disjoint ranges.
+        size_t batch = buffers[0].dims[0];
+        char *q = g->outputs;
+        for (size_t i = numInputs; i < buffers.size(); ++i) {
+            size_t bytes = buffers[i].size / batch;
+            ::memcpy(q + _req->first * bytes, buffers[i].ptr, _req->count * bytes);
+            q += g->samples * bytes;
+        }
+        return;
+    }
+
+    size_t bytes = 0;
+    for (size_t i = numInputs; i < buffers.size(); ++i) {
+        bytes += buffers[i].size;
+    }
+    _outputs = (char*)::malloc(bytes > 0 ? bytes : 1);
+    if (!_outputs) {
+        SetErrorMessage("node-menoh failed to allocate the outputs");
+        return;
+    }
+    char *q = _outputs;
+    for (size_t i = numInputs; i < buffers.size(); ++i) {
+        ::memcpy(q, buffers[i].ptr, buffers[i].size);
+        q += buffers[i].size;
+    }
+}
+
+// Called by the main thread.
+void ModelPool::PoolWorker::HandleOKCallback() {
+    Nan::HandleScope scope;
+    Nan::AsyncResource resource("ModelPool.PoolWorker.OKCallback");
+    _pool->release(this);
+
+    if (_req->gather) {
+        _pool->_completed++;
+        _pool->done();
+        _pool->dispatch();
+        _pool->scale();
+        _pool->gathered(_req->gather, v8::Local<v8::Value>());
+        return;
+    }
+
+    // All the outputs share one buffer.
+    v8::Local<v8::Object> buf = Nan::NewBuffer(
+        _outputs, _pool->outputBytes(), bufferFreeCallback, 0).ToLocalChecked();
+    _outputs = NULL;
+    v8::Local<v8::ArrayBuffer> ab = buf.As<v8::ArrayBufferView>()->Buffer();
+    size_t offset = buf.As<v8::ArrayBufferView>()->ByteOffset();
+
+    v8::Local<v8::Object> outputs = Nan::New<v8::Object>();
+    size_t numInputs = _model->_ivNames.size();
+    for (size_t i = numInputs; i < _model->_buffers.size(); ++i) {
+        Model::VarBuffer const& vb = _model->_buffers[i];
+        outputs->Set(Nan::New(vb.name).ToLocalChecked(),
+                     v8::Float32Array::New(ab, offset, vb.size / sizeof(float)));
+        offset += vb.size;
+    }
+
+    _pool->_completed++;
+    _pool->done();
+    _pool->dispatch();
+    _pool->scale();
+
+    v8::Local<v8::Value> argv[] = { Nan::Undefined(), outputs };
+    callback->Call(2, argv, &resource);
+}
+
+// Called by the main thread.
+void ModelPool::PoolWorker::HandleErrorCallback() {
+    Nan::HandleScope scope;
+    Nan::AsyncResource resource("ModelPool.PoolWorker.ErrorCallback");
+    _pool->release(this);
+    if (!_model->_native && _model->_registry) {
+        // The rebuild has failed.
+        _model->_registry->release(_model);
+    }
+
+    v8::Local<v8::Value> err;
+    if (_expired) {
+        _pool->_expired++;
+        err = makeError(ErrorMessage(), "MENOH_DEADLINE_EXCEEDED");
+    } else if (_cancel.cancelled()) {
+        _pool->_cancelled++;
+        err = makeError(ErrorMessage(), "MENOH_CANCELLED");
+    } else {
+        err = Nan::Error(ErrorMessage());
+    }
+
+    _pool->done();
+    _pool->dispatch();
+    _pool->scale();
+
+    if (_req->gather) {
+        _pool->gathered(_req->gather, err);
+        return;
+    }
+
+    v8::Local<v8::Value> argv[] = { err };
+    callback->Call(1, argv, &resource);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ModelPool::GrowWorker (inner) class
+
+ModelPool::GrowWorker::GrowWorker(
+    ModelPool *pool,
+    Model *model,
+    Model::VarBuffers const& buffers) : Nan::AsyncWorker(NULL),
+                                        _pool(pool),
+                                        _model(model),
+                                        _buffers(buffers) {
+}
+
+ModelPool::GrowWorker::~GrowWorker() {
+}
+
+void ModelPool::GrowWorker::Execute() {
+    if (!_model->_weightsPath.empty()) {
+        // Owned by the model once loaded, like swapped weights.
+        std::string error;
+        bool ok = Model::loadWeights(_model->_weightsPath, _buffers, _model->_ivNames.size(),
+                                     &_model->_data, &_model->_vpt, &error);
+        if (!ok) {
+            SetErrorMessage(error.c_str());
+            return;
+        }
+    }
+    if (_model->setUp(_model->_builder)) {
+        SetErrorMessage(_model->setUpErrorMessage());
+    }
+}
+
+// Called by the main thread.
+void ModelPool::GrowWorker::HandleOKCallback() {
+    Nan::HandleScope scope;
+    _pool->_growing--;
+
+    Model *tmpl = _pool->_template;
+    if (tmpl->_registry) {
+        _model->_registry = tmpl->_registry;
+        _model->_registryObj.Reset(Nan::New(tmpl->_registryObj));
+        _model->_registry->add(_model);
+    }
+    _pool->addMember(_model, GetFromPersistent("model")->ToObject(), true);
+    _pool->_scaleUps++;
+    _pool->dispatch();
+    _pool->scale();
+}
+
+// Called by the main thread.
+void ModelPool::GrowWorker::HandleErrorCallback() {
+    Nan::HandleScope scope;
+    _pool->_growing--;
+    _pool->_buildErrors++;
+    _pool->_lastBuildError = ErrorMessage();
+    _pool->_lastBuildErrorAt = Clock::now();
+}
+
+}  // namespace nodeMenoh
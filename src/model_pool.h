@@ -0,0 +1,240 @@
+#ifndef NODEMENOH_MODEL_POOL_H
+#define NODEMENOH_MODEL_POOL_H
+
+#include <map>
+#include <deque>
+#include <chrono>
+#include <string>
+#include <nan.h>
+#include "addon_data.h"
+#include "model.h"
+
+namespace nodeMenoh {
+
+// Runs requests on a set of equivalent models (replicas). Requests are
+// queued natively and dispatched to the next free model. The queue is
+// bounded in length and bytes, and requests may carry a deadline after
+// which they are dropped without running the model.
+//
+// Requests are dispatched by priority: strictly highest first, or by
+// smooth weighted round-robin among the waiting priorities if weights are
+// given, so that low priorities are never starved.
+//
+// With autoscaling, replicas are built from the builder of the first
+// model on a worker thread when requests wait too long, and idle ones are
+// retired after a cooldown, within bounds and a memory cap.
+//
+// All methods are called by the main thread, except PoolWorker::Execute().
+class ModelPool : public Nan::ObjectWrap {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        // A batch split into chunks by runLarge(). Each chunk is a request
+        // of its own, which reads its samples from the pinned input arrays
+        // and writes its outputs into one block, by output then sample.
+        struct Gather {
+            std::vector<char const*> inputs;
+            char *outputs;
+            size_t samples;
+            std::vector<uint32_t> ids;  // of the chunks
+            uint32_t remaining;         // chunks not completed
+            Nan::Persistent<v8::Array> pinned;  // the input arrays
+            Nan::Persistent<v8::Value> error;   // of the first failed chunk
+            Nan::Callback *callback;
+        };
+
+        struct Request {
+            uint32_t id;
+            std::vector<char> inputs;   // input tensors, concatenated
+            Nan::Callback *callback;
+            Nan::Persistent<v8::Value> error;   // of a dropped request
+            uint32_t priority;          // higher is dispatched first
+            bool hasDeadline;
+            Clock::time_point deadline;
+            Clock::time_point queuedAt;
+            Gather *gather;             // non-NULL for a chunk of runLarge()
+            size_t first;               // samples of the chunk
+            size_t count;
+        };
+
+        class PoolWorker : public CachedRunWorker {
+            friend class ModelPool;
+
+            public:
+                explicit PoolWorker(ModelPool *pool, Model *model, Request *req);
+
+            private:
+                virtual ~PoolWorker();
+
+                // Called by the worker thread.
+                void Execute();
+
+                // Copies the outputs out of the buffers of the model.
+                void collect();
+
+                virtual void resumed(Model *model, std::string const *error);
+
+                // Called by the main therad.
+                virtual void HandleOKCallback();
+                virtual void HandleErrorCallback();
+
+                ModelPool *_pool;
+                Model *_model;
+                Request *_req;
+                CancelState _cancel;
+                bool _expired;
+                char *_outputs;
+        };
+
+        // Builds a replica. (see ModelPool::grow)
+        class GrowWorker : public Nan::AsyncWorker {
+            friend class ModelPool;
+
+            public:
+                explicit GrowWorker(ModelPool *pool, Model *model, Model::VarBuffers const& buffers);
+
+            private:
+                virtual ~GrowWorker();
+
+                // Called by the worker thread.
+                void Execute();
+
+                // Called by the main therad.
+                virtual void HandleOKCallback();
+                virtual void HandleErrorCallback();
+
+                ModelPool *_pool;
+                Model *_model;
+                Model::VarBuffers _buffers;     // of the first model
+        };
+
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
+
+    private:
+        struct Member {
+            Model *model;
+            Nan::Persistent<v8::Object> *handle;
+            PoolWorker *worker; // non-NULL while running a request
+            Clock::time_point lastUsed;
+            bool grown;         // built by the pool (may be retired)
+        };
+
+        struct Autoscale {
+            size_t min;
+            size_t max;
+            Clock::duration scaleUpWait;
+            Clock::duration cooldown;
+            size_t memoryCap;   // total footprint of the models
+        };
+
+        // Requests of a priority
+        struct Level {
+            std::deque<Request*> requests;
+            int64_t credit;     // for weighted round-robin
+        };
+        typedef std::map<uint32_t, Level> Levels;
+
+        ModelPool(size_t maxQueue, size_t maxQueueBytes, std::vector<uint32_t> const& weights);
+
+        void addMember(Model *model, v8::Local<v8::Object> obj, bool grown);
+
+        // Starts autoscaling with a periodic check.
+        void startAutoscale(AddonData *addon, Autoscale const& config);
+
+        // Builds or retires a replica if needed.
+        void scale();
+
+        // Starts building a replica like the first model.
+        void grow();
+
+        static void onTimer(uv_timer_t *timer);
+        ~ModelPool();
+
+        // Starts queued requests on free models.
+        void dispatch();
+        void dispatchQueued();
+
+        void enqueue(Request *req);
+
+        // Removes the request to dispatch next from the queue.
+        Request* dequeue();
+
+        // Removes the request from the queue. Returns NULL if not queued.
+        Request* remove(uint32_t id);
+
+        // Fails a request that has not been started. The callback is
+        // called from the event loop, never from within the call which has
+        // dropped the request (e.g. run() with a deadline already passed).
+        void drop(Request *req, v8::Local<v8::Value> err);
+
+        // Calls back the dropped requests.
+        static void onDropped(uv_async_t *async);
+
+        // Called when a request is completed or dropped.
+        void done();
+
+        // Called when a chunk of `g` is completed (`err` empty) or has
+        // failed. Fails the other chunks on the first error, and calls back
+        // after the last one. (see runLarge())
+        void gathered(Gather *g, v8::Local<v8::Value> err);
+
+        // Marks the model of the worker as free.
+        void release(PoolWorker *w);
+
+        // Reads the priority and timeout options of a request. Throws and
+        // returns false if invalid.
+        bool toRequestOptions(v8::Local<v8::Object> options, Request *req) const;
+
+        // Returns the number of models not running a request.
+        size_t numFree() const;
+
+        size_t inputBytes() const;
+        size_t outputBytes() const;
+
+        // Returns false unless all the inputs and outputs are batched along
+        // their first dimension. (see runLarge())
+        bool batched() const;
+
+        std::vector<Member> _members;
+        Levels _levels;         // non-empty levels only
+        size_t _numQueued;
+        std::vector<uint32_t> _weights; // by priority (empty: strict priority)
+        size_t _maxQueue;
+        size_t _maxQueueBytes;
+        size_t _queuedBytes;
+        uint32_t _nextId;
+        uint32_t _pending;      // queued and running requests
+        uint32_t _completed;
+        uint32_t _rejected;
+        uint32_t _expired;
+        uint32_t _cancelled;
+        std::deque<Request*> _dropped;  // to call back
+        uv_async_t *_dropAsync;
+
+        // Autoscaling
+        bool _autoscale;
+        Autoscale _scaling;
+        AddonData *_addon;
+        Model *_template;   // the first model
+        Nan::Persistent<v8::Object> _templateObj;
+        uv_timer_t *_timer;
+        bool _dispatching;  // in dispatch() (see scale())
+        uint32_t _growing;  // replicas being built
+        uint32_t _scaleUps;
+        uint32_t _scaleDowns;
+        uint32_t _buildErrors;
+        std::string _lastBuildError;
+        Clock::time_point _lastBuildErrorAt;
+
+        static NAN_METHOD(New);
+
+        // NodeJS property methods
+        static NAN_METHOD(Run);
+        static NAN_METHOD(RunLarge);
+        static NAN_METHOD(Cancel);
+        static NAN_METHOD(GetStats);
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_MODEL_POOL_H
@@ -0,0 +1,139 @@
+
+#include "model_registry.h"
+
+namespace nodeMenoh {
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ModelRegistry class
+
+ModelRegistry::ModelRegistry(size_t budget) :   _budget(budget),
+                                                _used(0),
+                                                _numModels(0),
+                                                _evictions(0),
+                                                _rebuilds(0),
+                                                _lru() {
+}
+
+ModelRegistry::~ModelRegistry() {
+}
+
+void ModelRegistry::Init(v8::Local<v8::Object> exports, AddonData *addon) {
+    // Prepare constructor template
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
+    tpl->SetClassName(Nan::New("ModelRegistry").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    // Prototype
+    Nan::SetPrototypeMethod(tpl, "getStats", GetStats, addon->external());
+
+    addon->modelRegistryCons.Reset(tpl->GetFunction());
+    exports->Set(Nan::New("ModelRegistry").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+void ModelRegistry::add(Model *model) {
+    _numModels++;
+    _used += model->_footprint;
+    _lru.push_front(model);
+    model->_lruPos = _lru.begin();
+    model->_resident = true;
+    makeRoom(model);
+}
+
+void ModelRegistry::remove(Model *model) {
+    _numModels--;
+    release(model);
+}
+
+void ModelRegistry::release(Model *model) {
+    if (model->_resident) {
+        _used -= model->_footprint;
+        _lru.erase(model->_lruPos);
+        model->_resident = false;
+    }
+}
+
+void ModelRegistry::touch(Model *model) {
+    if (model->_resident) {
+        _lru.splice(_lru.begin(), _lru, model->_lruPos);
+        return;
+    }
+
+    _rebuilds++;
+    _used += model->_footprint;
+    _lru.push_front(model);
+    model->_lruPos = _lru.begin();
+    model->_resident = true;
+    makeRoom(model);
+}
+
+void ModelRegistry::makeRoom(Model const *keep) {
+    std::list<Model*>::iterator it = _lru.end();
+    while (_used > _budget && it != _lru.begin()) {
+        --it;
+        Model *model = *it;
+        if (model == keep || model->_inProgress) {
+            continue;
+        }
+
+        model->evict();
+        model->_resident = false;
+        _used -= model->_footprint;
+        _evictions++;
+        it = _lru.erase(it);
+    }
+}
+
+NAN_METHOD(ModelRegistry::New) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be an object");
+        return;
+    }
+
+    if (!info.IsConstructCall()) {
+        // Invoked as plain function `ModelRegistry(...)`, turn into construct call.
+        const int argc = 1;
+        v8::Local<v8::Value> argv[argc] = { info[0] };
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(AddonData::from(info)->modelRegistryCons);
+        info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+        return;
+    }
+
+    v8::Local<v8::Object> config = info[0]->ToObject();
+    v8::Local<v8::String> key = Nan::New("budget").ToLocalChecked();
+    v8::Local<v8::Value> val;
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+    }
+    if (val.IsEmpty() || !val->IsNumber() || val->NumberValue() < 0) {
+        Nan::ThrowTypeError("node-menoh budget must be a non-negative number");
+        return;
+    }
+
+    // Invoked as constructor: `new ModelRegistry(...)`
+    ModelRegistry* registry = new ModelRegistry((size_t)val->NumberValue());
+    registry->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(ModelRegistry::GetStats) {
+    ModelRegistry* registry = ObjectWrap::Unwrap<ModelRegistry>(info.Holder());
+
+    v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+    stats->Set(Nan::New("budget").ToLocalChecked(), Nan::New((double)registry->_budget));
+    stats->Set(Nan::New("used").ToLocalChecked(), Nan::New((double)registry->_used));
+    stats->Set(Nan::New("models").ToLocalChecked(), Nan::New(registry->_numModels));
+    stats->Set(Nan::New("resident").ToLocalChecked(), Nan::New((uint32_t)registry->_lru.size()));
+    stats->Set(Nan::New("evictions").ToLocalChecked(), Nan::New(registry->_evictions));
+    stats->Set(Nan::New("rebuilds").ToLocalChecked(), Nan::New(registry->_rebuilds));
+
+    info.GetReturnValue().Set(stats);
+}
+
+
+}  // namespace nodeMenoh
@@ -0,0 +1,58 @@
+#ifndef NODEMENOH_MODEL_REGISTRY_H
+#define NODEMENOH_MODEL_REGISTRY_H
+
+#include <list>
+#include <nan.h>
+#include "model.h"
+
+namespace nodeMenoh {
+
+// Keeps the native footprint of the registered models within a memory
+// budget. When the budget is exceeded, the least recently run models
+// release their native model (menoh_model_handle), which is rebuilt from
+// the builder data on the next request.
+//
+// All methods are called by the main thread.
+class ModelRegistry : public Nan::ObjectWrap {
+    public:
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
+
+        // Registers a model whose native model has just been built.
+        void add(Model *model);
+
+        // Unregisters a model. (Called when the model goes away.)
+        void remove(Model *model);
+
+        // Marks the model as the most recently used one. If the model has
+        // been evicted, it is accounted as resident again and the caller
+        // is responsible for rebuilding the native model.
+        void touch(Model *model);
+
+        // Accounts the model as no longer resident. (e.g. its native model
+        // could not be rebuilt.)
+        void release(Model *model);
+
+    private:
+        explicit ModelRegistry(size_t budget);
+        ~ModelRegistry();
+
+        // Evicts least recently used models, except `keep`, until the
+        // footprint fits in the budget.
+        void makeRoom(Model const *keep);
+
+        size_t _budget;
+        size_t _used;
+        uint32_t _numModels;
+        uint32_t _evictions;
+        uint32_t _rebuilds;
+        std::list<Model*> _lru; // resident models, most recent first
+
+        static NAN_METHOD(New);
+
+        // NodeJS property methods
+        static NAN_METHOD(GetStats);
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_MODEL_REGISTRY_H
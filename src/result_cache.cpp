@@ -0,0 +1,267 @@
+
+#include "result_cache.h"
+
+namespace nodeMenoh {
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ResultCache class
+
+ResultCache::ResultCache(size_t maxBytes) : _owner(NULL),
+                                            _maxBytes(maxBytes),
+                                            _bytes(0),
+                                            _lru(),
+                                            _entries(),
+                                            _inFlight(),
+                                            _ready(),
+                                            _async(NULL),
+                                            _holds(0),
+                                            _hits(0),
+                                            _misses(0),
+                                            _coalesced(0),
+                                            _collisions(0),
+                                            _evictions(0) {
+    // Does not keep the event loop alive unless a waiter is held.
+    _async = new uv_async_t;
+    uv_async_init(Nan::GetCurrentEventLoop(), _async, onReady);
+    _async->data = this;
+    uv_unref(reinterpret_cast<uv_handle_t*>(_async));
+}
+
+static void onAsyncClosed(uv_handle_t *handle) {
+    delete reinterpret_cast<uv_async_t*>(handle);
+}
+
+ResultCache::~ResultCache() {
+    // The cache is referenced by the models, so no run is in progress.
+    _async->data = NULL;
+    uv_close(reinterpret_cast<uv_handle_t*>(_async), onAsyncClosed);
+}
+
+void ResultCache::Init(v8::Local<v8::Object> exports, AddonData *addon) {
+    // Prepare constructor template
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
+    tpl->SetClassName(Nan::New("ResultCache").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    // Prototype
+    Nan::SetPrototypeMethod(tpl, "getStats", GetStats, addon->external());
+    Nan::SetPrototypeMethod(tpl, "clear", Clear, addon->external());
+
+    addon->resultCacheCons.Reset(tpl->GetFunction());
+    exports->Set(Nan::New("ResultCache").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+size_t ResultCache::entryBytes(Entry const& e) {
+    return sizeof(Entry) + e.inputs.size() + e.outputs.size();
+}
+
+void ResultCache::erase(EntryMap::iterator it) {
+    _bytes -= entryBytes(*it->second);
+    _lru.erase(it->second);
+    _entries.erase(it);
+}
+
+ResultCache::Lookup ResultCache::get(   uint64_t key,
+                                        Inputs const& inputs,
+                                        Outputs *outputs,
+                                        Waiter *waiter) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    EntryMap::iterator it = _entries.find(key);
+    if (it != _entries.end()) {
+        if (it->second->inputs == inputs) {
+            _hits++;
+            _lru.splice(_lru.begin(), _lru, it->second);
+            *outputs = it->second->outputs;
+            return kHit;
+        }
+        _collisions++;
+    }
+
+    std::map<uint64_t, InFlight>::iterator f = _inFlight.find(key);
+    if (f != _inFlight.end()) {
+        if (f->second.inputs != inputs) {
+            // Another input with the same hash is running.
+            _collisions++;
+            _misses++;
+            return kBypass;
+        }
+        if (!waiter) {
+            _misses++;
+            return kBypass;
+        }
+        _coalesced++;
+        f->second.waiters.push_back(waiter);
+        return kQueued;
+    }
+
+    _misses++;
+    _inFlight[key].inputs = inputs;
+    return kMiss;
+}
+
+void ResultCache::put(uint64_t key, Inputs const& inputs, Outputs const& outputs) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    wake(key, &outputs, std::string());
+
+    Entry e;
+    e.key = key;
+    e.inputs = inputs;
+    e.outputs = outputs;
+    size_t bytes = entryBytes(e);
+    if (bytes > _maxBytes) {
+        return;
+    }
+
+    // Replaces the entry of other inputs with the same hash, if any.
+    EntryMap::iterator it = _entries.find(key);
+    if (it != _entries.end()) {
+        erase(it);
+    }
+
+    _lru.push_front(e);
+    _entries[key] = _lru.begin();
+    _bytes += bytes;
+
+    while (_bytes > _maxBytes) {
+        erase(_entries.find(_lru.back().key));
+        _evictions++;
+    }
+}
+
+void ResultCache::abandon(uint64_t key, std::string const& error) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    wake(key, NULL, error);
+}
+
+void ResultCache::wake(uint64_t key, Outputs const *outputs, std::string const& error) {
+    std::map<uint64_t, InFlight>::iterator f = _inFlight.find(key);
+    if (f == _inFlight.end()) {
+        return;
+    }
+    std::vector<Waiter*>::iterator it;
+    for (it = f->second.waiters.begin(); it != f->second.waiters.end(); ++it) {
+        Ready r;
+        r.waiter = *it;
+        r.ok = outputs != NULL;
+        if (outputs) {
+            r.outputs = *outputs;
+        }
+        r.error = error;
+        _ready.push_back(r);
+    }
+    if (!f->second.waiters.empty()) {
+        uv_async_send(_async);
+    }
+    _inFlight.erase(f);
+}
+
+void ResultCache::onReady(uv_async_t *async) {
+    ResultCache *cache = static_cast<ResultCache*>(async->data);
+    if (!cache) {
+        return;
+    }
+
+    std::vector<Ready> ready;
+    {
+        std::lock_guard<std::mutex> lock(cache->_mutex);
+        ready.swap(cache->_ready);
+    }
+
+    Nan::HandleScope scope;
+    v8::Local<v8::Context> context = cache->handle()->CreationContext();
+    v8::Context::Scope contextScope(context);
+    std::vector<Ready>::iterator it;
+    for (it = ready.begin(); it != ready.end(); ++it) {
+        it->waiter->resume(it->ok ? &it->outputs : NULL, it->error);
+    }
+}
+
+void ResultCache::hold() {
+    if (_holds++ == 0) {
+        uv_ref(reinterpret_cast<uv_handle_t*>(_async));
+    }
+}
+
+void ResultCache::unhold() {
+    if (--_holds == 0) {
+        uv_unref(reinterpret_cast<uv_handle_t*>(_async));
+    }
+}
+
+bool ResultCache::bind(ModelBuilder const *mb) {
+    if (_owner && _owner != mb) {
+        return false;
+    }
+    _owner = mb;
+    return true;
+}
+
+NAN_METHOD(ResultCache::New) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be an object");
+        return;
+    }
+
+    if (!info.IsConstructCall()) {
+        // Invoked as plain function `ResultCache(...)`, turn into construct call.
+        const int argc = 1;
+        v8::Local<v8::Value> argv[argc] = { info[0] };
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(AddonData::from(info)->resultCacheCons);
+        info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+        return;
+    }
+
+    v8::Local<v8::Object> config = info[0]->ToObject();
+    v8::Local<v8::String> key = Nan::New("maxBytes").ToLocalChecked();
+    v8::Local<v8::Value> val;
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+    }
+    if (val.IsEmpty() || !val->IsNumber() || val->NumberValue() < 0) {
+        Nan::ThrowTypeError("node-menoh maxBytes must be a non-negative number");
+        return;
+    }
+
+    // Invoked as constructor: `new ResultCache(...)`
+    ResultCache* cache = new ResultCache((size_t)val->NumberValue());
+    cache->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(ResultCache::GetStats) {
+    ResultCache* cache = ObjectWrap::Unwrap<ResultCache>(info.Holder());
+    std::lock_guard<std::mutex> lock(cache->_mutex);
+
+    v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+    stats->Set(Nan::New("maxBytes").ToLocalChecked(), Nan::New((double)cache->_maxBytes));
+    stats->Set(Nan::New("bytes").ToLocalChecked(), Nan::New((double)cache->_bytes));
+    stats->Set(Nan::New("entries").ToLocalChecked(), Nan::New((uint32_t)cache->_entries.size()));
+    stats->Set(Nan::New("hits").ToLocalChecked(), Nan::New(cache->_hits));
+    stats->Set(Nan::New("misses").ToLocalChecked(), Nan::New(cache->_misses));
+    stats->Set(Nan::New("coalesced").ToLocalChecked(), Nan::New(cache->_coalesced));
+    stats->Set(Nan::New("collisions").ToLocalChecked(), Nan::New(cache->_collisions));
+    stats->Set(Nan::New("evictions").ToLocalChecked(), Nan::New(cache->_evictions));
+
+    info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(ResultCache::Clear) {
+    ResultCache* cache = ObjectWrap::Unwrap<ResultCache>(info.Holder());
+    std::lock_guard<std::mutex> lock(cache->_mutex);
+
+    cache->_entries.clear();
+    cache->_lru.clear();
+    cache->_bytes = 0;
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+
+}  // namespace nodeMenoh
@@ -0,0 +1,133 @@
+#ifndef NODEMENOH_RESULT_CACHE_H
+#define NODEMENOH_RESULT_CACHE_H
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <nan.h>
+#include "addon_data.h"
+
+namespace nodeMenoh {
+
+class ModelBuilder;
+
+// LRU cache of inference results keyed by the hash of the input tensors.
+// The inputs are stored with the outputs and compared on lookup, so that a
+// hash collision is a miss and never returns the result of other inputs.
+// The cache can be shared by the models built from the same builder.
+// Identical requests running concurrently on those models are coalesced
+// onto a single run.
+//
+// get(), put() and abandon() are called by worker threads.
+class ResultCache : public Nan::ObjectWrap {
+    public:
+        typedef std::vector<char> Inputs;   // input tensors, concatenated
+        typedef std::vector<char> Outputs;  // output tensors, concatenated
+
+        // A run waiting for an identical run in progress. It does not
+        // block a thread: it is resumed on the main thread when the other
+        // run completes.
+        class Waiter {
+            public:
+                virtual ~Waiter() {}
+
+                // Called by the main thread with the outputs, or with NULL
+                // and the error message if the other run has failed.
+                virtual void resume(Outputs const *outputs, std::string const& error) = 0;
+        };
+
+        enum Lookup {
+            kHit,       // `outputs` filled
+            kMiss,      // the caller must run, then call put() or abandon()
+            kQueued,    // the waiter will be resumed
+            kBypass     // the caller must run without caching the result
+        };
+
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
+
+        // Looks up the result for `key` and `inputs`. If an identical run
+        // is in progress, `waiter` is queued behind it, or the lookup is
+        // bypassed if `waiter` is NULL (e.g. a synchronous run).
+        Lookup get(uint64_t key, Inputs const& inputs, Outputs *outputs, Waiter *waiter);
+
+        // Stores the result of a kMiss and resumes the queued waiters.
+        void put(uint64_t key, Inputs const& inputs, Outputs const& outputs);
+
+        // Gives up the result of a kMiss (e.g. the run failed). The queued
+        // waiters fail with `error`.
+        void abandon(uint64_t key, std::string const& error);
+
+        // Keeps the event loop alive while a waiter has nothing else
+        // pending. (main thread)
+        void hold();
+        void unhold();
+
+        // Binds the cache to the given builder. Returns false if it has
+        // already been bound to another one. (Called by the main thread.)
+        bool bind(ModelBuilder const *mb);
+
+    private:
+        struct Entry {
+            uint64_t key;
+            Inputs inputs;
+            Outputs outputs;
+        };
+        typedef std::list<Entry> EntryList;
+        typedef std::map<uint64_t, EntryList::iterator> EntryMap;
+
+        // A run in progress and the identical runs waiting for it
+        struct InFlight {
+            Inputs inputs;
+            std::vector<Waiter*> waiters;
+        };
+
+        // A waiter to resume on the main thread
+        struct Ready {
+            Waiter *waiter;
+            bool ok;
+            Outputs outputs;
+            std::string error;
+        };
+
+        explicit ResultCache(size_t maxBytes);
+        ~ResultCache();
+
+        static size_t entryBytes(Entry const& e);
+
+        // Removes the entry from the LRU list and the map. (locked)
+        void erase(EntryMap::iterator it);
+
+        // Hands the waiters of `key` over to the main thread. (locked)
+        void wake(uint64_t key, Outputs const *outputs, std::string const& error);
+
+        // Resumes the waiters handed over by wake(). (main thread)
+        static void onReady(uv_async_t *async);
+
+        ModelBuilder const *_owner;
+        size_t _maxBytes;
+        size_t _bytes;
+        EntryList _lru;     // most recent first
+        EntryMap _entries;
+        std::map<uint64_t, InFlight> _inFlight;
+        std::vector<Ready> _ready;
+        uv_async_t *_async; // signals _ready to the main thread
+        uint32_t _holds;
+        uint32_t _hits;
+        uint32_t _misses;
+        uint32_t _coalesced;
+        uint32_t _collisions;
+        uint32_t _evictions;
+        std::mutex _mutex;
+
+        static NAN_METHOD(New);
+
+        // NodeJS property methods
+        static NAN_METHOD(GetStats);
+        static NAN_METHOD(Clear);
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_RESULT_CACHE_H
@@ -0,0 +1,915 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <chrono>
+#include <system_error>
+#include <thread>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "shared_ring.h"
+
+namespace nodeMenoh {
+
+
+// Returns the number of bytes of the model inputs (first) or outputs.
+static size_t totalBytes(Model::VarBuffers const& buffers, size_t begin, size_t end) {
+    size_t bytes = 0;
+    for (size_t i = begin; i < end; ++i) {
+        bytes += buffers[i].size;
+    }
+    return bytes;
+}
+
+static size_t roundUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+static uint32_t selfPid() {
+#ifdef _WIN32
+    return 0;
+#else
+    return (uint32_t)::getpid();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SharedRing class
+
+// Defined for the uses binding them by reference (e.g. the constructor of
+// std::chrono::milliseconds), which otherwise leave undefined symbols in
+// unoptimized builds.
+const uint32_t SharedRing::kMagic;
+const size_t SharedRing::kHeaderBytes;
+const size_t SharedRing::kSlotHeaderBytes;
+const int SharedRing::kServeRoundMs;
+const int SharedRing::kPollMs;
+const uint32_t SharedRing::kDefaultTimeoutMs;
+
+SharedRing::SharedRing( std::string const& name,
+                        bool owner,
+                        void *base,
+                        size_t mapBytes,
+                        uint32_t timeoutMs) :   _name(name),
+                                                _owner(owner),
+                                                _base(base),
+                                                _mapBytes(mapBytes),
+                                                _closing(false),
+                                                _timeoutMs(timeoutMs),
+                                                _client(NULL) {
+    static_assert(sizeof(Header) <= kHeaderBytes, "header too large");
+    static_assert(sizeof(SlotHeader) <= kSlotHeaderBytes, "slot header too large");
+}
+
+SharedRing::~SharedRing() {
+    // The ring is referenced while requests are pending.
+    if (_client) {
+        _client->stop();
+    }
+#ifndef _WIN32
+    if (_owner) {
+        header()->closed = 1;
+        wake(&header()->requestSeq);
+        notifyClients();
+        ::shm_unlink(_name.c_str());
+    }
+    ::munmap(_base, _mapBytes);
+#endif
+}
+
+void SharedRing::Init(v8::Local<v8::Object> exports, AddonData *addon) {
+    // Prepare constructor template
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
+    tpl->SetClassName(Nan::New("SharedRing").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    // Prototype
+    Nan::SetPrototypeMethod(tpl, "run", Run, addon->external());
+    Nan::SetPrototypeMethod(tpl, "serve", Serve, addon->external());
+    Nan::SetPrototypeMethod(tpl, "close", Close, addon->external());
+
+    addon->sharedRingCons.Reset(tpl->GetFunction());
+    exports->Set(Nan::New("SharedRing").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+SharedRing::Header* SharedRing::header() const {
+    return static_cast<Header*>(_base);
+}
+
+SharedRing::SlotHeader* SharedRing::slot(uint32_t i) const {
+    size_t stride = kSlotHeaderBytes + header()->slotBytes;
+    return reinterpret_cast<SlotHeader*>((char*)_base + kHeaderBytes + stride * i);
+}
+
+char* SharedRing::slotData(uint32_t i) const {
+    return (char*)slot(i) + kSlotHeaderBytes;
+}
+
+bool SharedRing::closed() const {
+    return _closing || header()->closed;
+}
+
+void SharedRing::release(uint32_t i) {
+    // A slot is free with no pids, so that a slot just claimed is not
+    // taken for the slot of an exited client.
+    SlotHeader *s = slot(i);
+    s->client = 0;
+    s->server = 0;
+    s->state = kFree;
+    notifyClients();
+}
+
+void SharedRing::notifyClients() {
+    header()->clientSeq++;
+    wake(&header()->clientSeq);
+}
+
+bool SharedRing::reclaim() {
+    bool freed = false;
+    for (uint32_t i = 0; i < header()->numSlots; ++i) {
+        SlotHeader *s = slot(i);
+        uint32_t state = s->state.load();
+        if (state == kFree || state == kReclaiming) {
+            continue;
+        }
+        bool serving = state == kServing || state == kAbandoned;
+        if (serving && alive(s->server)) {
+            if (state == kServing && !alive(s->client)) {
+                // The server frees it when done.
+                s->state.compare_exchange_strong(state, (uint32_t)kAbandoned);
+            }
+            continue;
+        }
+        if (state == kServing && alive(s->client)) {
+            // The client fails the request. (see Client::step)
+            continue;
+        }
+        if (serving || !alive(s->client)) {
+            if (s->state.compare_exchange_strong(state, (uint32_t)kReclaiming)) {
+                release(i);
+                freed = true;
+            }
+        }
+    }
+    return freed;
+}
+
+bool SharedRing::alive(uint32_t pid) {
+#ifdef _WIN32
+    (void)pid;
+    return true;
+#else
+    return pid == 0 || ::kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+#endif
+}
+
+void SharedRing::wait(std::atomic<uint32_t> *word, uint32_t expected, int timeoutMs) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    // Not FUTEX_PRIVATE_FLAG: the word is shared with other processes.
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, NULL, 0);
+#else
+    // No futex. Poll the word.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (word->load() == expected && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+#endif
+}
+
+void SharedRing::wake(std::atomic<uint32_t> *word) {
+#ifdef __linux__
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
+
+NAN_METHOD(SharedRing::New) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be an object");
+        return;
+    }
+
+    if (!info.IsConstructCall()) {
+        // Invoked as plain function `SharedRing(...)`, turn into construct call.
+        const int argc = 1;
+        v8::Local<v8::Value> argv[argc] = { info[0] };
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(AddonData::from(info)->sharedRingCons);
+        info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+        return;
+    }
+
+#ifdef _WIN32
+    Nan::ThrowTypeError("node-menoh SharedRing is not supported on this platform");
+#else
+    v8::Local<v8::Object> config = info[0]->ToObject();
+    v8::Local<v8::String> key;
+
+    // name
+    std::string name;
+    key = Nan::New("name").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(config, key).ToLocalChecked();
+        if (val->IsString()) {
+            name = *Nan::Utf8String(val);
+        }
+    }
+    if (name.empty() || name[0] != '/') {
+        Nan::ThrowTypeError("node-menoh name must be a string starting with '/'");
+        return;
+    }
+
+    // create
+    bool create = false;
+    key = Nan::New("create").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        create = Nan::Get(config, key).ToLocalChecked()->BooleanValue();
+    }
+
+    // slots, slotBytes (required when creating)
+    uint32_t numSlots = 0;
+    uint32_t slotBytes = 0;
+    if (create) {
+        key = Nan::New("slots").ToLocalChecked();
+        v8::Local<v8::Value> val;
+        if (Nan::Has(config, key).FromJust()) {
+            val = Nan::Get(config, key).ToLocalChecked();
+        }
+        if (val.IsEmpty() || !val->IsUint32() || val->Uint32Value() == 0) {
+            Nan::ThrowTypeError("node-menoh slots must be a positive integer");
+            return;
+        }
+        numSlots = val->Uint32Value();
+
+        key = Nan::New("slotBytes").ToLocalChecked();
+        val = v8::Local<v8::Value>();
+        if (Nan::Has(config, key).FromJust()) {
+            val = Nan::Get(config, key).ToLocalChecked();
+        }
+        if (val.IsEmpty() || !val->IsUint32() || val->Uint32Value() == 0) {
+            Nan::ThrowTypeError("node-menoh slotBytes must be a positive integer");
+            return;
+        }
+        slotBytes = (uint32_t)roundUp(val->Uint32Value(), 64);
+    }
+
+    // timeout
+    uint32_t timeoutMs = kDefaultTimeoutMs;
+    key = Nan::New("timeout").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        v8::Local<v8::Value> val = Nan::Get(config, key).ToLocalChecked();
+        if (!val->IsUint32() || val->Uint32Value() == 0) {
+            Nan::ThrowTypeError("node-menoh timeout must be a positive integer");
+            return;
+        }
+        timeoutMs = val->Uint32Value();
+    }
+
+    int fd = ::shm_open(name.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+    if (fd < 0) {
+        Nan::ThrowError((std::string("node-menoh failed to open shared memory ") + name + ": " + ::strerror(errno)).c_str());
+        return;
+    }
+
+    size_t mapBytes;
+    if (create) {
+        mapBytes = kHeaderBytes + (kSlotHeaderBytes + slotBytes) * (size_t)numSlots;
+        if (::ftruncate(fd, (off_t)mapBytes) != 0) {
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            Nan::ThrowError((std::string("node-menoh failed to size shared memory: ") + ::strerror(errno)).c_str());
+            return;
+        }
+    } else {
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || (size_t)st.st_size < kHeaderBytes) {
+            ::close(fd);
+            Nan::ThrowError("node-menoh the shared memory is not a ring (not initialized yet?)");
+            return;
+        }
+        mapBytes = (size_t)st.st_size;
+    }
+
+    void *base = ::mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        if (create) {
+            ::shm_unlink(name.c_str());
+        }
+        Nan::ThrowError((std::string("node-menoh failed to map shared memory: ") + ::strerror(errno)).c_str());
+        return;
+    }
+
+    Header *h = static_cast<Header*>(base);
+    if (create) {
+        // The memory is zero-filled, i.e. all slots are free.
+        h->numSlots = numSlots;
+        h->slotBytes = slotBytes;
+        std::atomic_thread_fence(std::memory_order_release);
+        h->magic = kMagic;
+    } else {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (h->magic != kMagic ||
+            mapBytes < kHeaderBytes + (kSlotHeaderBytes + h->slotBytes) * (size_t)h->numSlots) {
+            ::munmap(base, mapBytes);
+            Nan::ThrowError("node-menoh the shared memory is not a ring (not initialized yet?)");
+            return;
+        }
+    }
+
+    // Invoked as constructor: `new SharedRing(...)`
+    SharedRing* ring = new SharedRing(name, create, base, mapBytes, timeoutMs);
+    ring->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+#endif
+}
+
+NAN_METHOD(SharedRing::Run) {
+    SharedRing* ring = ObjectWrap::Unwrap<SharedRing>(info.Holder());
+
+    if (info.Length() < 2) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsArrayBufferView()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a typed array or a Buffer");
+        return;
+    }
+    if (!info[1]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be a function");
+        return;
+    }
+
+    Nan::TypedArrayContents<char> input(info[0]);
+    if (input.length() > ring->header()->slotBytes) {
+        Nan::ThrowRangeError("node-menoh the input does not fit in a slot");
+        return;
+    }
+    if (ring->closed()) {
+        Nan::ThrowError("node-menoh the ring is closed");
+        return;
+    }
+
+    // The input array is pinned until the request completes.
+    Request *req = new Request();
+    req->callback = new Nan::Callback(info[1].As<v8::Function>());
+    req->input.Reset(info[0].As<v8::Object>());
+    req->data = *input;
+    req->inBytes = input.length();
+    req->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ring->_timeoutMs);
+    req->posted = false;
+    req->slot = 0;
+    req->output = NULL;
+    req->outBytes = 0;
+
+    if (!ring->_client) {
+        ring->_client = new Client(ring);
+    }
+    if (!ring->_client->post(req)) {
+        req->input.Reset();
+        delete req->callback;
+        delete req;
+        return;
+    }
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(SharedRing::Serve) {
+    SharedRing* ring = ObjectWrap::Unwrap<SharedRing>(info.Holder());
+    AddonData *addon = AddonData::from(info);
+
+    if (info.Length() < 2) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->modelCons);
+    if (!info[0]->IsObject() || !info[0]->InstanceOf(Nan::GetCurrentContext(), cons).FromMaybe(false)) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a Model");
+        return;
+    }
+    if (!info[1]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be a function");
+        return;
+    }
+
+    v8::Local<v8::Object> modelObj = info[0]->ToObject();
+    Model* model = ObjectWrap::Unwrap<Model>(modelObj);
+    if (model->_inProgress) {
+        Nan::ThrowTypeError("node-menoh previous run is in progress");
+        return;
+    }
+    if (ring->closed()) {
+        Nan::ThrowError("node-menoh the ring is closed");
+        return;
+    }
+
+    size_t numInputs = model->_ivNames.size();
+    size_t inBytes = totalBytes(model->_buffers, 0, numInputs);
+    size_t outBytes = totalBytes(model->_buffers, numInputs, model->_buffers.size());
+    if (inBytes > ring->header()->slotBytes || outBytes > ring->header()->slotBytes) {
+        Nan::ThrowRangeError("node-menoh the model inputs or outputs do not fit in a slot");
+        return;
+    }
+
+    menoh_error_code ec = model->ensureNative();
+    if (ec) {
+        Nan::ThrowTypeError(menoh_get_last_error_message());
+        return;
+    }
+
+    // The model is busy until the ring is closed.
+    Nan::Callback *cb = new Nan::Callback(info[1].As<v8::Function>());
+    Server *server = new Server(ring, model, info.Holder(), modelObj, cb);
+    if (!server->start()) {
+        return;
+    }
+    model->_inProgress = true;
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(SharedRing::Close) {
+    SharedRing* ring = ObjectWrap::Unwrap<SharedRing>(info.Holder());
+
+    // Stops the servers of this process. The owner also fails the clients.
+    ring->_closing = true;
+    if (ring->_owner) {
+        ring->header()->closed = 1;
+    }
+    wake(&ring->header()->requestSeq);
+    ring->notifyClients();
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SharedRing::Server (inner) class
+
+SharedRing::Server::Server(
+    SharedRing *ring,
+    Model *model,
+    v8::Local<v8::Object> ringObj,
+    v8::Local<v8::Object> modelObj,
+    Nan::Callback *callback) :  _ring(ring),
+                                _model(model),
+                                _ringObj(ringObj),
+                                _modelObj(modelObj),
+                                _callback(callback),
+                                _async(NULL),
+                                _thread(),
+                                _mutex(),
+                                _stopped(false),
+                                _served(0) {
+}
+
+SharedRing::Server::~Server() {
+    _ringObj.Reset();
+    _modelObj.Reset();
+    delete _callback;
+}
+
+bool SharedRing::Server::start() {
+    // Keeps the event loop alive while serving.
+    _async = new uv_async_t;
+    uv_async_init(Nan::GetCurrentEventLoop(), _async, onAsync);
+    _async->data = this;
+
+    try {
+        _thread = std::thread(&Server::loop, this);
+    } catch (std::system_error const& e) {
+        uv_close(reinterpret_cast<uv_handle_t*>(_async), onClosed);
+        Nan::ThrowError((std::string("node-menoh failed to start a server thread: ") + e.what()).c_str());
+        return false;
+    }
+    return true;
+}
+
+void SharedRing::Server::loop() {
+    Header *h = _ring->header();
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(kServeRoundMs);
+
+    while (!_ring->closed()) {
+        uint32_t seq = h->requestSeq.load();
+
+        bool found = false;
+        for (uint32_t i = 0; i < h->numSlots; ++i) {
+            uint32_t expected = kRequested;
+            if (_ring->slot(i)->state.compare_exchange_strong(expected, (uint32_t)kServing)) {
+                serveSlot(i);
+                found = true;
+            }
+        }
+
+        int remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) {
+            // End of the round. The main thread gets a chance to install
+            // swapped weights, and the slots of exited clients are freed.
+            uv_async_send(_async);
+            _ring->reclaim();
+            deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kServeRoundMs);
+            continue;
+        }
+        if (!found) {
+            wait(&h->requestSeq, seq, remaining);
+        }
+    }
+
+    _stopped = true;
+    uv_async_send(_async);
+}
+
+void SharedRing::Server::serveSlot(uint32_t i) {
+    SlotHeader *s = _ring->slot(i);
+    s->server = selfPid();
+    if (!alive(s->client)) {
+        _ring->release(i);
+        return;
+    }
+
+    char *data = _ring->slotData(i);
+    Model::VarBuffers& buffers = _model->_buffers;
+    size_t numInputs = _model->_ivNames.size();
+    uint32_t state = kDone;
+
+    if (s->inBytes != totalBytes(buffers, 0, numInputs)) {
+        ::strncpy(s->message, "node-menoh the input size does not match the model", sizeof(s->message) - 1);
+        state = kFailed;
+    } else {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // Inputs are concatenated in the order they were added to the builder.
+        char *p = data;
+        for (size_t k = 0; k < numInputs; ++k) {
+            ::memcpy(buffers[k].ptr, p, buffers[k].size);
+            p += buffers[k].size;
+        }
+
+        if (_model->runCached()) {
+            ::strncpy(s->message, menoh_get_last_error_message(), sizeof(s->message) - 1);
+            state = kFailed;
+        } else {
+            p = data;
+            for (size_t k = numInputs; k < buffers.size(); ++k) {
+                ::memcpy(p, buffers[k].ptr, buffers[k].size);
+                p += buffers[k].size;
+            }
+            s->outBytes = (uint32_t)(p - data);
+            _served++;
+        }
+    }
+
+    uint32_t expected = kServing;
+    if (!s->state.compare_exchange_strong(expected, state)) {
+        // Abandoned by the client (timed out or exited).
+        _ring->release(i);
+        return;
+    }
+    _ring->notifyClients();
+}
+
+// Called by the main thread.
+void SharedRing::Server::onAsync(uv_async_t *async) {
+    Server *server = static_cast<Server*>(async->data);
+    Model *model = server->_model;
+
+    if (!server->_stopped) {
+        if (model->_pendingNative) {
+            // Between two requests
+            std::lock_guard<std::mutex> lock(server->_mutex);
+            model->applyPendingWeights();
+        }
+        return;
+    }
+
+    server->_thread.join();
+    model->_inProgress = false;
+    model->applyPendingWeights();
+
+    Nan::HandleScope scope;
+    v8::Local<v8::Context> context = Nan::New(server->_ringObj)->CreationContext();
+    v8::Context::Scope contextScope(context);
+    Nan::AsyncResource resource("SharedRing.Server.Callback");
+    v8::Local<v8::Value> argv[] = { Nan::Undefined(), Nan::New(server->_served.load()) };
+    server->_callback->Call(2, argv, &resource);
+
+    uv_close(reinterpret_cast<uv_handle_t*>(async), onClosed);
+}
+
+// Called by the main thread.
+void SharedRing::Server::onClosed(uv_handle_t *handle) {
+    delete static_cast<Server*>(handle->data);
+    delete reinterpret_cast<uv_async_t*>(handle);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SharedRing::Client (inner) class
+
+SharedRing::Client::Client(SharedRing *ring) :  _ring(ring),
+                                                _async(NULL),
+                                                _thread(),
+                                                _mutex(),
+                                                _posted(),
+                                                _queue(),
+                                                _done(),
+                                                _stopping(false),
+                                                _pending(0) {
+    // Referenced only while requests are pending.
+    _async = new uv_async_t;
+    uv_async_init(Nan::GetCurrentEventLoop(), _async, onAsync);
+    _async->data = this;
+    uv_unref(reinterpret_cast<uv_handle_t*>(_async));
+}
+
+SharedRing::Client::~Client() {
+}
+
+bool SharedRing::Client::post(Request *req) {
+    if (!_thread.joinable()) {
+        try {
+            _thread = std::thread(&Client::loop, this);
+        } catch (std::system_error const& e) {
+            Nan::ThrowError((std::string("node-menoh failed to start a client thread: ") + e.what()).c_str());
+            return false;
+        }
+    }
+
+    // Keep the ring alive until the request is called back.
+    if (_pending++ == 0) {
+        _ring->Ref();
+        uv_ref(reinterpret_cast<uv_handle_t*>(_async));
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(req);
+    }
+    _posted.notify_one();
+
+    // The thread may be waiting for the other requests. This also wakes
+    // the client threads of the other processes, which find nothing to do.
+    _ring->notifyClients();
+    return true;
+}
+
+void SharedRing::Client::stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _posted.notify_one();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(_async), onClosed);
+}
+
+// Returns the milliseconds left until `deadline`, up to `maxMs`.
+static int pollMs(std::chrono::steady_clock::time_point deadline, int maxMs) {
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+    return (int)std::max((int64_t)0, std::min(ms, (int64_t)maxMs));
+}
+
+void SharedRing::Client::loop() {
+    Header *h = _ring->header();
+    std::vector<Request*> active;   // in the order they were posted
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (active.empty() && _queue.empty() && !_stopping) {
+                _posted.wait(lock);
+            }
+            if (_stopping) {
+                // No request is pending.
+                return;
+            }
+            active.insert(active.end(), _queue.begin(), _queue.end());
+            _queue.clear();
+        }
+
+        // Read before the requests are checked, so that an event
+        // meanwhile ends the wait at once.
+        uint32_t seq = h->clientSeq.load();
+
+        std::vector<Request*> done;
+        int ms = kPollMs;
+        for (size_t k = 0; k < active.size(); ) {
+            if (step(active[k])) {
+                done.push_back(active[k]);
+                active.erase(active.begin() + k);
+                continue;
+            }
+            ms = std::min(ms, pollMs(active[k]->deadline, kPollMs));
+            k++;
+        }
+
+        if (!done.empty()) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done.insert(_done.end(), done.begin(), done.end());
+            uv_async_send(_async);
+        }
+        if (!active.empty()) {
+            wait(&h->clientSeq, seq, std::max(ms, 1));
+        }
+    }
+}
+
+bool SharedRing::Client::step(Request *req) {
+    Header *h = _ring->header();
+
+    if (!req->posted) {
+        // Claim a free slot.
+        if (_ring->closed()) {
+            req->error = "node-menoh the ring is closed";
+            return true;
+        }
+        bool claimed = false;
+        for (int attempt = 0; !claimed && attempt < 2; ++attempt) {
+            for (uint32_t i = 0; i < h->numSlots; ++i) {
+                uint32_t expected = kFree;
+                if (_ring->slot(i)->state.compare_exchange_strong(expected, (uint32_t)kClaimed)) {
+                    req->slot = i;
+                    claimed = true;
+                    break;
+                }
+            }
+            if (!claimed && !_ring->reclaim()) {
+                break;
+            }
+        }
+        if (!claimed) {
+            if (pollMs(req->deadline, kPollMs) == 0) {
+                req->error = "node-menoh timed out waiting for a free slot";
+                return true;
+            }
+            return false;
+        }
+
+        // Post the request.
+        SlotHeader *s = _ring->slot(req->slot);
+        s->client = selfPid();
+        ::memcpy(_ring->slotData(req->slot), req->data, req->inBytes);
+        s->inBytes = (uint32_t)req->inBytes;
+        s->outBytes = 0;
+        s->message[0] = '\0';
+        s->state = kRequested;
+        req->posted = true;
+        h->requestSeq++;
+        wake(&h->requestSeq);
+        return false;
+    }
+
+    // Wait for a server.
+    SlotHeader *s = _ring->slot(req->slot);
+    uint32_t state = s->state.load();
+    if (state == kDone) {
+        req->outBytes = s->outBytes;
+        req->output = (char*)::malloc(req->outBytes > 0 ? req->outBytes : 1);
+        if (!req->output) {
+            req->error = "node-menoh failed to allocate the outputs";
+        } else {
+            ::memcpy(req->output, _ring->slotData(req->slot), req->outBytes);
+        }
+        _ring->release(req->slot);
+        return true;
+    }
+    if (state == kFailed) {
+        req->error = s->message;
+        _ring->release(req->slot);
+        return true;
+    }
+    if (h->closed && state == kRequested) {
+        // No server will pick it up.
+        if (withdraw(req->slot)) {
+            req->error = "node-menoh the ring is closed";
+            return true;
+        }
+        return false;
+    }
+    if (state == kServing && !alive(s->server)) {
+        if (withdraw(req->slot)) {
+            req->error = "node-menoh the server has exited";
+            return true;
+        }
+        return false;
+    }
+    if (pollMs(req->deadline, kPollMs) == 0) {
+        if (withdraw(req->slot)) {
+            req->error = "node-menoh the request has timed out";
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SharedRing::Client::withdraw(uint32_t i) {
+    SlotHeader *s = _ring->slot(i);
+    uint32_t state = s->state.load();
+    if (state == kRequested) {
+        if (s->state.compare_exchange_strong(state, (uint32_t)kClaimed)) {
+            _ring->release(i);
+            return true;
+        }
+        return false;
+    }
+    if (state == kServing) {
+        if (!alive(s->server)) {
+            if (s->state.compare_exchange_strong(state, (uint32_t)kClaimed)) {
+                _ring->release(i);
+                return true;
+            }
+            return false;
+        }
+        // The server frees it when done.
+        return s->state.compare_exchange_strong(state, (uint32_t)kAbandoned);
+    }
+    return false;
+}
+
+static void bufferFreeCallback(char *data, void *hint) {
+    ::free(data);
+}
+
+// Called by the main thread.
+void SharedRing::Client::onAsync(uv_async_t *async) {
+    Client *client = static_cast<Client*>(async->data);
+    SharedRing *ring = client->_ring;
+    Nan::HandleScope scope;
+    v8::Local<v8::Context> context = ring->handle()->CreationContext();
+    v8::Context::Scope contextScope(context);
+
+    // The local handle keeps the ring alive after Unref().
+    v8::Local<v8::Object> ringObj = ring->handle();
+    (void)ringObj;
+
+    std::vector<Request*> done;
+    {
+        std::lock_guard<std::mutex> lock(client->_mutex);
+        done.swap(client->_done);
+    }
+    client->_pending -= done.size();
+    if (client->_pending == 0) {
+        uv_unref(reinterpret_cast<uv_handle_t*>(async));
+        ring->Unref();
+    }
+
+    for (size_t k = 0; k < done.size(); ++k) {
+        Request *req = done[k];
+        Nan::AsyncResource resource("SharedRing.Client.Callback");
+        Nan::Callback *cb = req->callback;
+        req->input.Reset();
+
+        if (!req->error.empty()) {
+            v8::Local<v8::Value> argv[] = { Nan::Error(req->error.c_str()) };
+            delete req;
+            cb->Call(1, argv, &resource);
+            delete cb;
+            continue;
+        }
+
+        // Hand the output over to a Float32Array without copying.
+        v8::Local<v8::Object> buf = Nan::NewBuffer(
+            req->output, req->outBytes, bufferFreeCallback, 0).ToLocalChecked();
+        v8::Local<v8::ArrayBufferView> view = buf.As<v8::ArrayBufferView>();
+        v8::Local<v8::Float32Array> outputs =
+            v8::Float32Array::New(view->Buffer(), view->ByteOffset(), req->outBytes / sizeof(float));
+        delete req;
+
+        v8::Local<v8::Value> argv[] = { Nan::Undefined(), outputs };
+        cb->Call(2, argv, &resource);
+        delete cb;
+    }
+}
+
+// Called by the main thread.
+void SharedRing::Client::onClosed(uv_handle_t *handle) {
+    delete static_cast<Client*>(handle->data);
+    delete reinterpret_cast<uv_async_t*>(handle);
+}
+
+}  // namespace nodeMenoh
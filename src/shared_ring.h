@@ -0,0 +1,223 @@
+#ifndef NODEMENOH_SHARED_RING_H
+#define NODEMENOH_SHARED_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <nan.h>
+#include "addon_data.h"
+#include "model.h"
+
+namespace nodeMenoh {
+
+// Ring of request slots in POSIX shared memory, through which processes
+// on the same host (e.g. cluster workers) run the models owned by another
+// process. A client copies its input tensors straight into a slot and
+// reads the outputs back from it, so tensors are never serialized nor
+// sent through a pipe. They are still copied between the slot and the
+// buffers of the model, which are fixed when the model is built. Waiting
+// sides sleep on futexes in the shared memory (Linux) or poll (other
+// POSIX systems).
+//
+// A slot records the pids of its client and server, so that the slots of
+// a process which has exited are reclaimed by the others.
+//
+// Shared memory layout:
+//   Header | Slot 0 (SlotHeader + data) | Slot 1 | ...
+class SharedRing : public Nan::ObjectWrap {
+    public:
+        // Serves the requests posted to the ring with a model on a thread
+        // of its own, so that no thread of the libuv pool is held. The
+        // main thread is notified through a uv_async handle once per round
+        // of up to kServeRoundMs (to install swapped weights) and when
+        // serving stops.
+        class Server {
+            friend class SharedRing;
+
+            public:
+                explicit Server(SharedRing *ring,
+                                Model *model,
+                                v8::Local<v8::Object> ringObj,
+                                v8::Local<v8::Object> modelObj,
+                                Nan::Callback *callback);
+
+                // Starts the thread. Throws and returns false on failure,
+                // in which case the instance is deleted. (main thread)
+                bool start();
+
+            private:
+                ~Server();
+
+                // Called by the server thread.
+                void loop();
+
+                // Runs the model on the request in `slot`. (server thread)
+                void serveSlot(uint32_t slot);
+
+                // Called by the main therad.
+                static void onAsync(uv_async_t *async);
+                static void onClosed(uv_handle_t *handle);
+
+                SharedRing *_ring;
+                Model *_model;
+                Nan::Persistent<v8::Object> _ringObj;
+                Nan::Persistent<v8::Object> _modelObj;
+                Nan::Callback *_callback;
+                uv_async_t *_async;
+                std::thread _thread;
+                std::mutex _mutex;  // held while the model runs
+                std::atomic<bool> _stopped;
+                std::atomic<uint32_t> _served;  // number of served requests
+        };
+
+        // A request of this process
+        struct Request {
+            Nan::Callback *callback;
+            Nan::Persistent<v8::Object> input;  // pinned until called back
+            char const *data;       // contents of `input`
+            size_t inBytes;
+            std::chrono::steady_clock::time_point deadline;
+            bool posted;            // to `slot`
+            uint32_t slot;
+            char *output;
+            size_t outBytes;
+            std::string error;      // of a failed request
+        };
+
+        // Posts the requests of this process and waits for their outputs
+        // on a thread of its own, so that the requests in flight hold no
+        // thread of the libuv pool. Completed requests are called back
+        // through a uv_async handle.
+        class Client {
+            friend class SharedRing;
+
+            public:
+                explicit Client(SharedRing *ring);
+
+                // Queues a request, starting the thread on the first one.
+                // Throws and returns false on failure. (main thread)
+                bool post(Request *req);
+
+                // Stops the thread. The instance is deleted once the
+                // handle is closed. (main thread, no request pending)
+                void stop();
+
+            private:
+                ~Client();
+
+                // Called by the client thread.
+                void loop();
+
+                // Claims a slot for the request and posts it, or advances
+                // the posted request. Returns true if it has completed.
+                // (client thread)
+                bool step(Request *req);
+
+                // Takes a slot back from the server, or leaves it to the
+                // server to free. Returns false if the request has completed
+                // meanwhile. (client thread)
+                bool withdraw(uint32_t slot);
+
+                // Called by the main therad.
+                static void onAsync(uv_async_t *async);
+                static void onClosed(uv_handle_t *handle);
+
+                SharedRing *_ring;
+                uv_async_t *_async;     // referenced while requests are pending
+                std::thread _thread;
+                std::mutex _mutex;
+                std::condition_variable _posted;    // signalled by post() and stop()
+                std::vector<Request*> _queue;       // posted, not taken by the thread (locked)
+                std::vector<Request*> _done;        // completed (locked)
+                bool _stopping;                     // (locked)
+                size_t _pending;    // not called back (main thread)
+        };
+
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
+
+    private:
+        enum SlotState {
+            kFree = 0,
+            kClaimed,       // being written by a client
+            kRequested,     // waiting for a server
+            kServing,
+            kDone,
+            kFailed,
+            kAbandoned,     // given up by the client, freed by the server
+            kReclaiming     // being freed by another process (see reclaim)
+        };
+
+        struct Header {
+            uint32_t magic;
+            uint32_t numSlots;
+            uint32_t slotBytes;
+            std::atomic<uint32_t> closed;
+            std::atomic<uint32_t> requestSeq;   // bumped when a request is posted
+            std::atomic<uint32_t> clientSeq;    // bumped when a slot is freed or a request completes
+        };
+
+        struct SlotHeader {
+            std::atomic<uint32_t> state;
+            uint32_t inBytes;
+            uint32_t outBytes;
+            uint32_t client;    // pid of the process which claimed the slot
+            uint32_t server;    // pid of the process serving the request
+            char message[236];  // error message of a failed request
+        };
+
+        static const uint32_t kMagic = 0x686f6e6d; // "mnoh"
+        static const size_t kHeaderBytes = 64;
+        static const size_t kSlotHeaderBytes = 256;
+        static const int kServeRoundMs = 100;
+        static const int kPollMs = 100;
+        static const uint32_t kDefaultTimeoutMs = 30000;
+
+        SharedRing(std::string const& name, bool owner, void *base, size_t mapBytes, uint32_t timeoutMs);
+        ~SharedRing();
+
+        Header* header() const;
+        SlotHeader* slot(uint32_t i) const;
+        char* slotData(uint32_t i) const;
+        bool closed() const;
+
+        // Frees the slot and wakes the clients waiting for one.
+        void release(uint32_t i);
+
+        // Wakes the client threads waiting on clientSeq.
+        void notifyClients();
+
+        // Frees the slots of the clients which have exited, and the slots
+        // abandoned while being served by a server which has exited.
+        // Returns true if a slot has been freed.
+        bool reclaim();
+
+        // Returns false if the process has exited.
+        static bool alive(uint32_t pid);
+
+        // Futex helpers on words in the shared memory.
+        static void wait(std::atomic<uint32_t> *word, uint32_t expected, int timeoutMs);
+        static void wake(std::atomic<uint32_t> *word);
+
+        std::string _name;
+        bool _owner;    // created (and unlinks) the shared memory
+        void *_base;
+        size_t _mapBytes;
+        std::atomic<bool> _closing;
+        uint32_t _timeoutMs;    // of the requests of this process
+        Client *_client;        // created by the first run()
+
+        static NAN_METHOD(New);
+
+        // NodeJS property methods
+        static NAN_METHOD(Run);
+        static NAN_METHOD(Serve);
+        static NAN_METHOD(Close);
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_SHARED_RING_H
@@ -0,0 +1,26 @@
+#ifndef NODEMENOH_SIMD_H
+#define NODEMENOH_SIMD_H
+
+// Compiler support for the kernels picked at runtime by instruction set
+// (see Isa in convert.h). Included by the kernel headers only.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define NODEMENOH_X86 1
+#include <immintrin.h>
+#endif
+
+// Compiles a function for an instruction set the addon is not built for.
+// It must only be called if the CPU supports it. (MSVC needs no flag.)
+#if defined(__GNUC__) || defined(__clang__)
+#define NODEMENOH_TARGET(isa) __attribute__((target(isa)))
+#else
+#define NODEMENOH_TARGET(isa)
+#endif
+
+#ifdef NODEMENOH_X86
+#define NODEMENOH_SSE4 NODEMENOH_TARGET("sse4.1")        // kIsaSse4
+#define NODEMENOH_AVX2 NODEMENOH_TARGET("avx2,f16c")     // kIsaAvx2
+#define NODEMENOH_AVX512 NODEMENOH_TARGET("avx512f")     // kIsaAvx512
+#endif
+
+#endif//NODEMENOH_SIMD_H
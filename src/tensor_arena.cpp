@@ -0,0 +1,109 @@
+
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "tensor_arena.h"
+
+namespace nodeMenoh {
+
+
+static size_t roundUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+static void* alignedAlloc(size_t alignment, size_t bytes) {
+#ifdef _WIN32
+    return ::_aligned_malloc(bytes, alignment);
+#else
+    void *p = NULL;
+    if (::posix_memalign(&p, alignment, bytes)) {
+        return NULL;
+    }
+    return p;
+#endif
+}
+
+static void alignedFree(void *p) {
+#ifdef _WIN32
+    ::_aligned_free(p);
+#else
+    ::free(p);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TensorArena class
+
+TensorArena::TensorArena() :    _base(NULL),
+                                _bytes(0),
+                                _hugePages(false) {
+}
+
+TensorArena::~TensorArena() {
+    if (_base) {
+        alignedFree(_base);
+    }
+}
+
+bool TensorArena::isValidAlignment(size_t alignment) {
+    // A power of two multiple of sizeof(void*), as posix_memalign requires.
+    return alignment >= sizeof(void*) &&
+           alignment <= kHugePageBytes &&
+           (alignment & (alignment - 1)) == 0;
+}
+
+bool TensorArena::allocate( std::vector<size_t> const& sizes,
+                            size_t alignment,
+                            bool hugePages,
+                            std::vector<void*> *ptrs) {
+    std::vector<size_t> offsets;
+    size_t bytes = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        offsets.push_back(bytes);
+        bytes = roundUp(bytes + sizes[i], alignment);
+    }
+    bytes = bytes > 0 ? bytes : alignment;
+
+    // Small regions would waste most of a huge page.
+    bool huge = false;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (hugePages && bytes >= kHugePageBytes) {
+        huge = true;
+        alignment = kHugePageBytes;
+        bytes = roundUp(bytes, kHugePageBytes);
+    }
+#else
+    (void)hugePages;
+#endif
+
+    void *base = alignedAlloc(alignment, bytes);
+    if (!base) {
+        return false;
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (huge) {
+        // Advisory only. (It fails if transparent huge pages are disabled.)
+        ::madvise(base, bytes, MADV_HUGEPAGE);
+    }
+#endif
+
+    // Zero the region (as calloc did), which also faults in its pages.
+    ::memset(base, 0, bytes);
+
+    _base = base;
+    _bytes = bytes;
+    _hugePages = huge;
+
+    ptrs->clear();
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        ptrs->push_back(static_cast<char*>(base) + offsets[i]);
+    }
+    return true;
+}
+
+
+}  // namespace nodeMenoh
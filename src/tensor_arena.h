@@ -0,0 +1,47 @@
+#ifndef NODEMENOH_TENSOR_ARENA_H
+#define NODEMENOH_TENSOR_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+namespace nodeMenoh {
+
+// One zeroed region holding the input/output buffers of a model, each at
+// the given alignment (64 bytes by default, a cache line, for the vector
+// loads and reorders of MKL-DNN). A large region may be backed by huge
+// pages to reduce TLB misses: it is then aligned to kHugePageBytes and
+// madvise(MADV_HUGEPAGE)'d before being touched (Linux only; ignored
+// elsewhere).
+class TensorArena {
+    public:
+        static const size_t kDefaultAlignment = 64;
+        static const size_t kHugePageBytes = 2 * 1024 * 1024;
+
+        TensorArena();
+        ~TensorArena();
+
+        // Allocates the buffers of the given sizes in bytes. Returns false
+        // on failure. Must be called once.
+        bool allocate(  std::vector<size_t> const& sizes,
+                        size_t alignment,
+                        bool hugePages,
+                        std::vector<void*> *ptrs);
+
+        size_t bytes() const { return _bytes; }
+        bool hugePages() const { return _hugePages; }
+
+        // Returns true if `alignment` is a valid alignment.
+        static bool isValidAlignment(size_t alignment);
+
+    private:
+        TensorArena(TensorArena const&);
+        TensorArena& operator=(TensorArena const&);
+
+        void *_base;
+        size_t _bytes;
+        bool _hugePages;    // madvise'd for huge pages
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_TENSOR_ARENA_H
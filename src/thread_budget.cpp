@@ -0,0 +1,134 @@
+
+#include <algorithm>
+#include <thread>
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+#include "thread_budget.h"
+
+namespace nodeMenoh {
+
+
+typedef void (*OmpSetNumThreads)(int);
+typedef int (*OmpGetMaxThreads)();
+
+// Looks up omp_set_num_threads() in the loaded OpenMP runtime, if any.
+static OmpSetNumThreads resolveOmpSetNumThreads() {
+#ifdef _WIN32
+    return NULL;
+#else
+    return (OmpSetNumThreads)::dlsym(RTLD_DEFAULT, "omp_set_num_threads");
+#endif
+}
+
+// Looks up omp_get_max_threads() likewise.
+static OmpGetMaxThreads resolveOmpGetMaxThreads() {
+#ifdef _WIN32
+    return NULL;
+#else
+    return (OmpGetMaxThreads)::dlsym(RTLD_DEFAULT, "omp_get_max_threads");
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadBudget class
+
+std::mutex ThreadBudget::_mutex;
+int ThreadBudget::_cores = (int)std::thread::hardware_concurrency();
+int ThreadBudget::_active = 0;
+int ThreadBudget::_granted = 0;
+int ThreadBudget::_lastApplied = 0;
+
+void ThreadBudget::Init(v8::Local<v8::Object> exports) {
+    exports->Set(Nan::New("setThreadBudget").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(SetThreadBudget)->GetFunction());
+    exports->Set(Nan::New("getThreadBudget").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(GetThreadBudget)->GetFunction());
+}
+
+void ThreadBudget::setOmpThreads(int n) {
+    static OmpSetNumThreads fn = resolveOmpSetNumThreads();
+    if (fn) {
+        // Sets the thread count of the parallel regions started by the
+        // calling thread.
+        fn(n);
+    }
+}
+
+int ThreadBudget::getOmpThreads() {
+    static OmpGetMaxThreads fn = resolveOmpGetMaxThreads();
+    return fn ? fn() : 0;
+}
+
+ThreadBudget::Scope::Scope(int threads) :   _threads(threads),
+                                            _applied(0),
+                                            _previous(0) {
+    if (_threads == kDefault) {
+        return;
+    }
+
+    int n = _threads;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_threads == kAuto) {
+            // An even share, within the cores left by the runs in
+            // progress.
+            _active++;
+            n = std::min(_cores / _active, _cores - _granted);
+            n = n > 0 ? n : 1;
+            _granted += n;
+        }
+        _applied = n;
+        _lastApplied = n;
+    }
+    _previous = getOmpThreads();
+    setOmpThreads(n);
+}
+
+ThreadBudget::Scope::~Scope() {
+    if (_applied == 0) {
+        return;
+    }
+    if (_previous > 0) {
+        // The worker thread runs other work afterwards.
+        setOmpThreads(_previous);
+    }
+    if (_threads == kAuto) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _active--;
+        _granted -= _applied;
+    }
+}
+
+NAN_METHOD(ThreadBudget::SetThreadBudget) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsUint32() || info[0]->Uint32Value() == 0) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be a positive integer");
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cores = (int)info[0]->Uint32Value();
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(ThreadBudget::GetThreadBudget) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    v8::Local<v8::Object> budget = Nan::New<v8::Object>();
+    budget->Set(Nan::New("cores").ToLocalChecked(), Nan::New(_cores));
+    budget->Set(Nan::New("active").ToLocalChecked(), Nan::New(_active));
+    budget->Set(Nan::New("granted").ToLocalChecked(), Nan::New(_granted));
+    budget->Set(Nan::New("applied").ToLocalChecked(), Nan::New(_lastApplied));
+    budget->Set(Nan::New("openmp").ToLocalChecked(), Nan::New(resolveOmpSetNumThreads() != NULL));
+
+    info.GetReturnValue().Set(budget);
+}
+
+
+}  // namespace nodeMenoh
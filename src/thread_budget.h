@@ -0,0 +1,61 @@
+#ifndef NODEMENOH_THREAD_BUDGET_H
+#define NODEMENOH_THREAD_BUDGET_H
+
+#include <mutex>
+#include <nan.h>
+
+namespace nodeMenoh {
+
+// Process-wide budget of cores for the intra-op (OpenMP) threads of
+// menoh_model_run. Models running concurrently with `threads: 'auto'`
+// split the budget evenly, so that replicas do not oversubscribe the CPU.
+// As the count of a run cannot change once started, a run takes at most
+// the cores not granted to the runs in progress (and at least one).
+//
+// The thread count is applied with omp_set_num_threads() on the executing
+// worker thread, resolved at runtime from the OpenMP runtime MKL-DNN is
+// linked with, and the previous count of the thread is restored after the
+// run. It is a no-op if no OpenMP runtime is loaded.
+class ThreadBudget {
+    public:
+        static const int kDefault = 0;  // leave the OpenMP default
+        static const int kAuto = -1;    // share of the budget
+
+        // Called by the worker thread around menoh_model_run. `threads` is
+        // the per-model setting.
+        class Scope {
+            public:
+                explicit Scope(int threads);
+                ~Scope();
+
+                // Returns the thread count applied, or 0 for kDefault.
+                int threads() const { return _applied; }
+
+            private:
+                int _threads;
+                int _applied;   // 0: not applied
+                int _previous;  // of the thread, to restore
+        };
+
+        static void Init(v8::Local<v8::Object> exports);
+
+    private:
+        static NAN_METHOD(SetThreadBudget);
+        static NAN_METHOD(GetThreadBudget);
+
+        static void setOmpThreads(int n);
+
+        // Returns the thread count of the calling thread, or 0 if no
+        // OpenMP runtime is loaded.
+        static int getOmpThreads();
+
+        static std::mutex _mutex;
+        static int _cores;
+        static int _active;     // running models with `threads: 'auto'`
+        static int _granted;    // threads of the running 'auto' models
+        static int _lastApplied;    // thread count applied by the last Scope
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_THREAD_BUDGET_H
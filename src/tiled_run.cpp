@@ -0,0 +1,527 @@
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "tiled_run.h"
+#include "model_registry.h"
+
+namespace nodeMenoh {
+
+
+// Reads a positive integer or an array of two. (e.g. tile, stride)
+static bool toPair(v8::Local<v8::Value> val, size_t *h, size_t *w) {
+    if (val->IsNumber()) {
+        double d = val->NumberValue();
+        if (d < 1 || d != (double)(size_t)d) {
+            return false;
+        }
+        *h = *w = (size_t)d;
+        return true;
+    }
+    if (!val->IsArray() || v8::Local<v8::Array>::Cast(val)->Length() != 2) {
+        return false;
+    }
+    size_t v[2];
+    for (uint32_t i = 0; i < 2; ++i) {
+        v8::Local<v8::Value> it = Nan::Get(val->ToObject(), i).ToLocalChecked();
+        double d = it->IsNumber() ? it->NumberValue() : 0;
+        if (d < 1 || d != (double)(size_t)d) {
+            return false;
+        }
+        v[i] = (size_t)d;
+    }
+    *h = v[0];
+    *w = v[1];
+    return true;
+}
+
+// Returns the starts of the tiles along a dimension. The last tile is
+// aligned to the end so that the tiles cover the whole dimension.
+static std::vector<size_t> tileStarts(size_t size, size_t tile, size_t stride) {
+    std::vector<size_t> starts;
+    for (size_t s = 0; ; s += stride) {
+        if (s + tile >= size) {
+            starts.push_back(size - tile);
+            break;
+        }
+        starts.push_back(s);
+    }
+    return starts;
+}
+
+static void freeCallback(char *data, void *hint) {
+    (void)hint;
+    ::free(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TiledRun class
+
+TiledRun::TiledRun() :  _dtype(kFloat32),
+                        _data(NULL),
+                        _channels(0),
+                        _height(0),
+                        _width(0),
+                        _tileH(0),
+                        _tileW(0),
+                        _batch(0),
+                        _ys(),
+                        _xs(),
+                        _numBatches(0),
+                        _outputs(),
+                        _names(),
+                        _nextBatch(0),
+                        _running(0),
+                        _failed(false),
+                        _mutex(),
+                        _pending(0),
+                        _error(),
+                        _callback(NULL) {
+}
+
+TiledRun::~TiledRun() {
+    std::vector<Output>::iterator it;
+    for (it = _outputs.begin(); it != _outputs.end(); ++it) {
+        ::free(it->sum);    // NULL if handed over
+        ::free(it->weight);
+    }
+    delete _callback;
+}
+
+void TiledRun::average() {
+    std::vector<Output>::iterator it;
+    for (it = _outputs.begin(); it != _outputs.end(); ++it) {
+        size_t plane = it->height * it->width;
+        for (size_t c = 0; c < it->channels; ++c) {
+            float *p = it->sum + c * plane;
+            for (size_t i = 0; i < plane; ++i) {
+                p[i] /= it->weight[i];
+            }
+        }
+    }
+}
+
+void TiledRun::done(TileWorker *w, char const *error) {
+    (void)w;
+    if (error && _error.empty()) {
+        _error = error;
+    }
+    if (--_pending > 0) {
+        return;
+    }
+
+    Nan::HandleScope scope;
+    Nan::AsyncResource resource("TiledRun.done");
+    if (!_error.empty()) {
+        v8::Local<v8::Value> argv[] = { Nan::Error(_error.c_str()) };
+        _callback->Call(1, argv, &resource);
+        delete this;
+        return;
+    }
+
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    for (size_t i = 0; i < _outputs.size(); ++i) {
+        Output& o = _outputs[i];
+        size_t n = o.channels * o.height * o.width;
+        v8::Local<v8::Object> buf = Nan::NewBuffer(
+            (char*)o.sum, n * sizeof(float), freeCallback, 0).ToLocalChecked();
+        o.sum = NULL;
+        v8::Local<v8::ArrayBufferView> view = buf.As<v8::ArrayBufferView>();
+
+        v8::Local<v8::Array> dims = Nan::New<v8::Array>(3);
+        dims->Set(0, Nan::New((uint32_t)o.channels));
+        dims->Set(1, Nan::New((uint32_t)o.height));
+        dims->Set(2, Nan::New((uint32_t)o.width));
+
+        v8::Local<v8::Object> output = Nan::New<v8::Object>();
+        output->Set(Nan::New("data").ToLocalChecked(),
+                    v8::Float32Array::New(view->Buffer(), view->ByteOffset(), n));
+        output->Set(Nan::New("dims").ToLocalChecked(), dims);
+        results->Set(Nan::New(_names[i]).ToLocalChecked(), output);
+    }
+
+    v8::Local<v8::Value> argv[] = { Nan::Undefined(), results };
+    Nan::Callback *callback = _callback;
+    _callback = NULL;
+    delete this;
+    callback->Call(2, argv, &resource);
+    delete callback;
+}
+
+NAN_METHOD(TiledRun::RunTiled) {
+    AddonData *addon = AddonData::from(info);
+    Model *model = Nan::ObjectWrap::Unwrap<Model>(info.Holder());
+
+    if (info.Length() < 3) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be an object");
+        return;
+    }
+    if (!info[1]->IsUndefined() && !info[1]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 2 must be an object");
+        return;
+    }
+    if (!info[2]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 3 must be a function");
+        return;
+    }
+    if (model->_ivNames.size() != 1) {
+        Nan::ThrowTypeError("node-menoh runTiled() needs a model with one input");
+        return;
+    }
+
+    // The input must be NCHW.
+    Model::VarBuffer const& input = model->_buffers[0];
+    if (input.dims.size() != 4) {
+        Nan::ThrowTypeError("node-menoh the input of the model must be NCHW");
+        return;
+    }
+    size_t capacity = input.dims[0];
+    size_t channels = input.dims[1];
+    size_t tileH = input.dims[2];
+    size_t tileW = input.dims[3];
+
+    // info[0] - image { data, dims }
+    v8::Local<v8::Object> image = info[0]->ToObject();
+    v8::Local<v8::Value> data = Nan::Get(image, Nan::New("data").ToLocalChecked()).ToLocalChecked();
+    v8::Local<v8::Value> dimsVal = Nan::Get(image, Nan::New("dims").ToLocalChecked()).ToLocalChecked();
+    Dtype dtype;
+    if (!typedArrayDtype(data, &dtype)) {
+        Nan::ThrowTypeError("node-menoh image.data must be a Float32Array, Uint8Array, Int16Array or Uint16Array");
+        return;
+    }
+    std::vector<size_t> dims;
+    if (dimsVal->IsArray()) {
+        v8::Local<v8::Array> arr = v8::Local<v8::Array>::Cast(dimsVal);
+        for (uint32_t i = 0; i < arr->Length(); ++i) {
+            v8::Local<v8::Value> it = Nan::Get(arr, i).ToLocalChecked();
+            dims.push_back(it->IsNumber() && it->NumberValue() >= 1 ? (size_t)it->NumberValue() : 0);
+        }
+    }
+    if (dims.size() == 4 && dims[0] == 1) {
+        dims.erase(dims.begin());
+    }
+    if (dims.size() != 3 || dims[0] == 0 || dims[1] == 0 || dims[2] == 0) {
+        Nan::ThrowTypeError("node-menoh image.dims must be [C, H, W]");
+        return;
+    }
+    if (dims[0] != channels) {
+        Nan::ThrowRangeError("node-menoh image has a different number of channels than the model");
+        return;
+    }
+    Nan::TypedArrayContents<char> contents(data);
+    if (contents.length() != dims[0] * dims[1] * dims[2] * dtypeSize(dtype)) {
+        Nan::ThrowRangeError("node-menoh image.data does not match image.dims");
+        return;
+    }
+    size_t height = dims[1];
+    size_t width = dims[2];
+    if (height < tileH || width < tileW) {
+        Nan::ThrowRangeError("node-menoh image is smaller than the tile");
+        return;
+    }
+
+    // info[1] - options
+    size_t strideH = tileH;
+    size_t strideW = tileW;
+    size_t batch = capacity;
+    std::vector<Model*> models(1, model);
+    std::vector<v8::Local<v8::Object> > modelObjs(1, info.Holder());
+    v8::Local<v8::Value> outputNames = Nan::Undefined();
+    if (info[1]->IsObject()) {
+        v8::Local<v8::Object> options = info[1]->ToObject();
+        v8::Local<v8::String> key;
+
+        key = Nan::New("tile").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            size_t h, w;
+            if (!toPair(Nan::Get(options, key).ToLocalChecked(), &h, &w)) {
+                Nan::ThrowTypeError("node-menoh tile must be a positive integer or an array of two");
+                return;
+            }
+            if (h != tileH || w != tileW) {
+                Nan::ThrowRangeError("node-menoh tile must match the input size of the model");
+                return;
+            }
+        }
+
+        key = Nan::New("stride").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            if (!toPair(Nan::Get(options, key).ToLocalChecked(), &strideH, &strideW)) {
+                Nan::ThrowTypeError("node-menoh stride must be a positive integer or an array of two");
+                return;
+            }
+            if (strideH > tileH || strideW > tileW) {
+                Nan::ThrowRangeError("node-menoh stride must not exceed the tile");
+                return;
+            }
+        }
+
+        key = Nan::New("batch").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            double d = val->IsNumber() ? val->NumberValue() : 0;
+            if (d < 1 || d > capacity || d != (double)(size_t)d) {
+                Nan::ThrowRangeError("node-menoh batch must be an integer from 1 to the batch size of the model");
+                return;
+            }
+            batch = (size_t)d;
+        }
+
+        key = Nan::New("outputs").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            outputNames = Nan::Get(options, key).ToLocalChecked();
+        }
+
+        // Replicas with the same inputs and outputs
+        key = Nan::New("replicas").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            if (!val->IsArray()) {
+                Nan::ThrowTypeError("node-menoh replicas must be an array of Models");
+                return;
+            }
+            v8::Local<v8::Array> arr = v8::Local<v8::Array>::Cast(val);
+            v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->modelCons);
+            for (uint32_t i = 0; i < arr->Length(); ++i) {
+                v8::Local<v8::Value> m = Nan::Get(arr, i).ToLocalChecked();
+                if (!m->IsObject() || !m->InstanceOf(Nan::GetCurrentContext(), cons).FromMaybe(false)) {
+                    Nan::ThrowTypeError("node-menoh replicas must be an array of Models");
+                    return;
+                }
+                Model *replica = Nan::ObjectWrap::Unwrap<Model>(m->ToObject());
+                bool same = replica->_ivNames == model->_ivNames &&
+                            replica->_ovNames == model->_ovNames;
+                for (size_t k = 0; same && k < model->_buffers.size(); ++k) {
+                    same = replica->_buffers[k].dims == model->_buffers[k].dims &&
+                           replica->_buffers[k].dtype == model->_buffers[k].dtype;
+                }
+                if (!same) {
+                    Nan::ThrowTypeError("node-menoh replicas must have the same inputs and outputs");
+                    return;
+                }
+                if (std::find(models.begin(), models.end(), replica) == models.end()) {
+                    models.push_back(replica);
+                    modelObjs.push_back(m->ToObject());
+                }
+            }
+        }
+    }
+
+    // Outputs to stitch, which must be NCHW on a grid aligned to the tiles.
+    std::vector<size_t> indices;
+    std::string missing;
+    if (!model->findVars(outputNames, model->_ivNames.size(), &indices, &missing)) {
+        if (!missing.empty()) {
+            Nan::ThrowTypeError(("node-menoh variable not found: " + missing).c_str());
+        } else {
+            Nan::ThrowTypeError("node-menoh outputs must be an array of names");
+        }
+        return;
+    }
+    std::vector<Output> outputs;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        Model::VarBuffer const& vb = model->_buffers[indices[i]];
+        if (indices[i] < model->_ivNames.size()) {
+            Nan::ThrowTypeError(("node-menoh " + vb.name + " is not an output").c_str());
+            return;
+        }
+        bool spatial = vb.dims.size() == 4 && (size_t)vb.dims[0] == capacity &&
+                       vb.dims[2] > 0 && vb.dims[3] > 0 &&
+                       tileH % vb.dims[2] == 0 && tileW % vb.dims[3] == 0 &&
+                       tileH / vb.dims[2] == tileW / vb.dims[3];
+        if (!spatial) {
+            Nan::ThrowTypeError(("node-menoh output " + vb.name + " is not a spatial output of the tiles").c_str());
+            return;
+        }
+        Output o;
+        o.index = indices[i];
+        o.channels = vb.dims[1];
+        o.factor = tileH / vb.dims[2];
+        if (strideH % o.factor || strideW % o.factor || height % o.factor || width % o.factor) {
+            Nan::ThrowRangeError(("node-menoh the stride and the image size must be multiples of the scale of output " + vb.name).c_str());
+            return;
+        }
+        o.height = height / o.factor;
+        o.width = width / o.factor;
+        o.sum = NULL;
+        o.weight = NULL;
+        outputs.push_back(o);
+    }
+
+    for (size_t i = 0; i < models.size(); ++i) {
+        if (models[i]->_inProgress) {
+            Nan::ThrowTypeError("node-menoh previous run is in progress");
+            return;
+        }
+    }
+
+    // The tiles, in row-major order
+    TiledRun *run = new TiledRun();
+    std::vector<size_t> ys = tileStarts(height, tileH, strideH);
+    std::vector<size_t> xs = tileStarts(width, tileW, strideW);
+    for (size_t y = 0; y < ys.size(); ++y) {
+        for (size_t x = 0; x < xs.size(); ++x) {
+            run->_ys.push_back(ys[y]);
+            run->_xs.push_back(xs[x]);
+        }
+    }
+    run->_dtype = dtype;
+    run->_data = *contents;
+    run->_channels = channels;
+    run->_height = height;
+    run->_width = width;
+    run->_tileH = tileH;
+    run->_tileW = tileW;
+    run->_batch = batch;
+    run->_numBatches = (run->_ys.size() + batch - 1) / batch;
+    run->_outputs.swap(outputs);
+    for (size_t i = 0; i < run->_outputs.size(); ++i) {
+        Output& o = run->_outputs[i];
+        o.sum = (float*)::calloc(o.channels * o.height * o.width, sizeof(float));
+        o.weight = (float*)::calloc(o.height * o.width, sizeof(float));
+        if (!o.sum || !o.weight) {
+            delete run;
+            Nan::ThrowError("node-menoh failed to allocate the outputs");
+            return;
+        }
+        run->_names.push_back(model->_buffers[o.index].name);
+    }
+    run->_callback = new Nan::Callback(info[2].As<v8::Function>());
+
+    // No more workers than batches
+    size_t numWorkers = std::min(models.size(), run->_numBatches);
+    run->_pending = (uint32_t)numWorkers;
+    run->_running = (int)numWorkers;
+    for (size_t i = 0; i < numWorkers; ++i) {
+        Model *m = models[i];
+        m->_inProgress = true;
+        if (m->_registry) {
+            // Account the model as resident. (It is rebuilt by the worker if
+            // it has been evicted.)
+            m->_registry->touch(m);
+        }
+
+        // The image is pinned until the last worker completes.
+        TileWorker *w = new TileWorker(run, m);
+        w->SaveToPersistent("model", modelObjs[i]);
+        w->SaveToPersistent("image", data);
+        Nan::AsyncQueueWorker(w);
+    }
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TiledRun::TileWorker (inner) class
+
+TiledRun::TileWorker::TileWorker(
+    TiledRun *run,
+    Model *model) : Nan::AsyncWorker(NULL, "TiledRun.TileWorker"),
+                    _run(run),
+                    _model(model) {
+}
+
+TiledRun::TileWorker::~TileWorker() {
+}
+
+void TiledRun::TileWorker::Execute() {
+    while (!_run->_failed) {
+        size_t b = _run->_nextBatch++;
+        if (b >= _run->_numBatches) {
+            break;
+        }
+        extract(b);
+        if (_model->runCached()) {
+            _run->_failed = true;
+            SetErrorMessage(menoh_get_last_error_message());
+            break;
+        }
+        blend(b);
+    }
+
+    // The last worker out averages the overlaps.
+    if (--_run->_running == 0 && !_run->_failed) {
+        _run->average();
+    }
+}
+
+void TiledRun::TileWorker::extract(size_t b) {
+    TiledRun const& r = *_run;
+    Model::VarBuffer const& input = _model->_buffers[0];
+    size_t srcSize = dtypeSize(r._dtype);
+    size_t dstSize = dtypeSize(input.dtype);
+    size_t end = std::min((b + 1) * r._batch, r._ys.size());
+
+    // Each row of a tile is converted into the buffer at once.
+    char *dst = static_cast<char*>(input.ptr);
+    for (size_t t = b * r._batch; t < end; ++t) {
+        for (size_t c = 0; c < r._channels; ++c) {
+            for (size_t y = 0; y < r._tileH; ++y) {
+                size_t src = (c * r._height + r._ys[t] + y) * r._width + r._xs[t];
+                convert(r._dtype, r._data + src * srcSize, input.dtype, dst, r._tileW);
+                dst += r._tileW * dstSize;
+            }
+        }
+    }
+}
+
+void TiledRun::TileWorker::blend(size_t b) {
+    TiledRun& r = *_run;
+    size_t end = std::min((b + 1) * r._batch, r._ys.size());
+
+    std::lock_guard<std::mutex> lock(r._mutex);
+    std::vector<Output>::iterator o;
+    for (o = r._outputs.begin(); o != r._outputs.end(); ++o) {
+        float const *src = static_cast<float const*>(_model->_buffers[o->index].ptr);
+        size_t th = r._tileH / o->factor;
+        size_t tw = r._tileW / o->factor;
+        for (size_t t = b * r._batch; t < end; ++t) {
+            size_t y0 = r._ys[t] / o->factor;
+            size_t x0 = r._xs[t] / o->factor;
+            for (size_t c = 0; c < o->channels; ++c) {
+                for (size_t y = 0; y < th; ++y) {
+                    float *dst = o->sum + (c * o->height + y0 + y) * o->width + x0;
+                    for (size_t x = 0; x < tw; ++x) {
+                        dst[x] += src[x];
+                    }
+                    src += tw;
+                }
+            }
+            for (size_t y = 0; y < th; ++y) {
+                float *w = o->weight + (y0 + y) * o->width + x0;
+                for (size_t x = 0; x < tw; ++x) {
+                    w[x] += 1;
+                }
+            }
+        }
+    }
+}
+
+void TiledRun::TileWorker::release() {
+    _model->_inProgress = false;
+    _model->applyPendingWeights();
+}
+
+// Called by the main thread.
+void TiledRun::TileWorker::HandleOKCallback() {
+    release();
+    _run->done(this, NULL);
+}
+
+// Called by the main thread.
+void TiledRun::TileWorker::HandleErrorCallback() {
+    release();
+    if (!_model->_native && _model->_registry) {
+        // The rebuild has failed.
+        _model->_registry->release(_model);
+    }
+    _run->done(this, ErrorMessage());
+}
+
+
+}  // namespace nodeMenoh
@@ -0,0 +1,109 @@
+#ifndef NODEMENOH_TILED_RUN_H
+#define NODEMENOH_TILED_RUN_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <nan.h>
+#include "addon_data.h"
+#include "convert.h"
+#include "model.h"
+
+namespace nodeMenoh {
+
+// Sliding-window inference over an image larger than the input of a model
+// (see model.runTiled()). The image is cut into tiles, written straight
+// into the NCHW input buffer of the model a batch at a time, and the
+// spatial outputs of the tiles are averaged where they overlap into one
+// tensor per output.
+//
+// One TileWorker per model (the model and its replicas) takes batches
+// until none is left, so the batches run concurrently on the replicas.
+// Everything but argument parsing happens on the worker threads.
+class TiledRun {
+    public:
+        class TileWorker : public Nan::AsyncWorker {
+            friend class TiledRun;
+
+            public:
+                explicit TileWorker(TiledRun *run, Model *model);
+
+            private:
+                virtual ~TileWorker();
+
+                // Called by the worker thread.
+                void Execute();
+
+                // Copies the tiles of batch `b` into the input buffer.
+                void extract(size_t b);
+
+                // Adds the outputs of batch `b` into the result.
+                void blend(size_t b);
+
+                // Called by the main therad.
+                virtual void HandleOKCallback();
+                virtual void HandleErrorCallback();
+
+                // Marks the model as free. (main thread)
+                void release();
+
+                TiledRun *_run;
+                Model *_model;
+        };
+
+        // model.runTiled(image, options, cb)
+        static NAN_METHOD(RunTiled);
+
+    private:
+        // A stitched output
+        struct Output {
+            size_t index;       // in Model::_buffers
+            size_t channels;
+            size_t factor;      // tile size / output tile size
+            size_t height;      // of the result
+            size_t width;
+            float *sum;         // the result, summed then averaged
+            float *weight;      // number of tiles covering each pixel
+        };
+
+        TiledRun();
+        ~TiledRun();
+
+        // Divides the sums by the weights. (worker thread, once)
+        void average();
+
+        // Called when a worker has completed. Calls back after the last
+        // one and deletes the run. (main thread)
+        void done(TileWorker *w, char const *error);
+
+        // Image
+        Dtype _dtype;
+        char const *_data;
+        size_t _channels;
+        size_t _height;
+        size_t _width;
+
+        // Tiling
+        size_t _tileH;
+        size_t _tileW;
+        size_t _batch;      // tiles per run
+        std::vector<size_t> _ys;    // top-left corners of the tiles
+        std::vector<size_t> _xs;
+        size_t _numBatches;
+
+        std::vector<Output> _outputs;
+        std::vector<std::string> _names;
+
+        std::atomic<size_t> _nextBatch;
+        std::atomic<int> _running;  // workers in Execute()
+        std::atomic<bool> _failed;
+        std::mutex _mutex;          // for blending
+        uint32_t _pending;          // workers not completed
+        std::string _error;
+        Nan::Callback *_callback;
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_TILED_RUN_H
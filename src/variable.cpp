@@ -0,0 +1,115 @@
+
+#include "variable.h"
+
+namespace nodeMenoh {
+
+
+static void bufferFreeCallback(char* buf, void* hint) {
+    (void)buf;
+    (void)hint;
+    // The buffer is owned by the model. (See Model::_arena)
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Variable class
+
+Variable::Variable(Model *model, size_t index) :    _model(model),
+                                                    _index(index) {
+}
+
+Variable::~Variable() {
+    _modelObj.Reset();
+}
+
+void Variable::Init(v8::Local<v8::Object> exports, AddonData *addon) {
+    // Prepare constructor template
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
+    tpl->SetClassName(Nan::New("Variable").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    Nan::SetPrototypeMethod(tpl, "set", Set, addon->external());
+    Nan::SetPrototypeMethod(tpl, "get", Get, addon->external());
+
+    addon->variableCons.Reset(tpl->GetFunction());
+    exports->Set(Nan::New("Variable").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+v8::Local<v8::Object> Variable::create(AddonData *addon, v8::Local<v8::Object> modelObj, size_t index) {
+    Nan::EscapableHandleScope scope;
+    const int argc = 2;
+    v8::Local<v8::Value> argv[argc] = { modelObj, Nan::New((uint32_t)index) };
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->variableCons);
+    v8::Local<v8::Object> obj = Nan::NewInstance(cons, argc, argv).ToLocalChecked();
+
+    // The descriptor does not change, so it is exposed as plain properties.
+    Model *model = ObjectWrap::Unwrap<Model>(modelObj);
+    Model::VarBuffer const& vb = model->_buffers[index];
+    obj->Set(Nan::New("name").ToLocalChecked(), Nan::New(vb.name).ToLocalChecked());
+    obj->Set(Nan::New("dims").ToLocalChecked(), Model::dimsArray(vb));
+    obj->Set(Nan::New("dtype").ToLocalChecked(), Nan::New(dtypeName(vb.dtype)).ToLocalChecked());
+    obj->Set(Nan::New("isInput").ToLocalChecked(), Nan::New(index < model->_ivNames.size()));
+    obj->Set(
+        Nan::New("buf").ToLocalChecked(),
+        Nan::NewBuffer((char *)vb.ptr, vb.size, bufferFreeCallback, 0).ToLocalChecked());
+    return scope.Escape(obj);
+}
+
+Model::VarBuffer const& Variable::buffer() const {
+    return _model->_buffers[_index];
+}
+
+NAN_METHOD(Variable::New) {
+    // Only created by model.getVariable(). (see Variable::create)
+    AddonData *addon = AddonData::from(info);
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->modelCons);
+    if (!info.IsConstructCall() ||
+        info.Length() < 2 ||
+        !info[0]->IsObject() ||
+        !info[0]->InstanceOf(Nan::GetCurrentContext(), cons).FromMaybe(false) ||
+        !info[1]->IsUint32()) {
+        Nan::ThrowTypeError("node-menoh use model.getVariable() to get a Variable");
+        return;
+    }
+
+    v8::Local<v8::Object> modelObj = info[0]->ToObject();
+    Model *model = ObjectWrap::Unwrap<Model>(modelObj);
+    size_t index = info[1]->Uint32Value();
+    if (index >= model->_buffers.size()) {
+        Nan::ThrowTypeError("node-menoh variable index out of range");
+        return;
+    }
+
+    Variable *var = new Variable(model, index);
+    var->_modelObj.Reset(modelObj);
+    var->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(Variable::Set) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be an array");
+        return;
+    }
+
+    Variable* var = ObjectWrap::Unwrap<Variable>(info.Holder());
+    char const *err = Model::copyIn(var->buffer(), info[0]->ToObject());
+    if (err) {
+        Nan::ThrowTypeError(err);
+        return;
+    }
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(Variable::Get) {
+    Variable* var = ObjectWrap::Unwrap<Variable>(info.Holder());
+    info.GetReturnValue().Set(Model::copyOut(var->buffer()));
+}
+
+
+}  // namespace nodeMenoh
@@ -0,0 +1,42 @@
+#ifndef NODEMENOH_VARIABLE_H
+#define NODEMENOH_VARIABLE_H
+
+#include <nan.h>
+#include "addon_data.h"
+#include "model.h"
+
+namespace nodeMenoh {
+
+// Handle to an input/output variable of a model, returned by
+// model.getVariable(). It refers to the descriptor of the variable in the
+// model (see Model::VarBuffer), so that repeated accesses need neither the
+// name nor the C API. It keeps the model alive.
+class Variable : public Nan::ObjectWrap {
+    friend class VectorIndex;
+
+    public:
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
+
+        // Returns a new handle to the variable at `index` of the model.
+        static v8::Local<v8::Object> create(AddonData *addon, v8::Local<v8::Object> modelObj, size_t index);
+
+    private:
+        Variable(Model *model, size_t index);
+        ~Variable();
+
+        Model::VarBuffer const& buffer() const;
+
+        Model *_model;
+        Nan::Persistent<v8::Object> _modelObj;
+        size_t _index;  // in Model::_buffers
+
+        static NAN_METHOD(New);
+
+        // NodeJS property methods
+        static NAN_METHOD(Set);
+        static NAN_METHOD(Get);
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_VARIABLE_H
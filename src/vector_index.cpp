@@ -0,0 +1,692 @@
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <system_error>
+#include <thread>
+#include "vector_index.h"
+#include "convert.h"
+#include "distance_kernels.h"
+#include "thread_budget.h"
+#include "variable.h"
+
+namespace nodeMenoh {
+
+
+static const size_t kBlockBytes = 4 << 20;      // of the rows of a block
+static const size_t kTileBytes = 256 << 10;     // of the rows scanned at once
+static const size_t kWorkPerThread = 1 << 20;   // multiply-adds (see Search)
+
+static void freeCallback(char *data, void *hint) {
+    (void)hint;
+    ::free(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// VectorIndex class
+
+VectorIndex::Kernels VectorIndex::kernelsOf(Isa isa) {
+    Kernels k;
+    switch (isa) {
+#ifdef NODEMENOH_X86
+    case kIsaSse4:
+        k.dot = kernels::dotSse4;
+        k.l2 = kernels::l2Sse4;
+        k.dotInt8 = kernels::dotInt8Sse4;
+        return k;
+    case kIsaAvx2:
+        k.dot = kernels::dotAvx2;
+        k.l2 = kernels::l2Avx2;
+        k.dotInt8 = kernels::dotInt8Avx2;
+        return k;
+    case kIsaAvx512:
+        k.dot = kernels::dotAvx512;
+        k.l2 = kernels::l2Avx512;
+        k.dotInt8 = kernels::dotInt8Avx512;
+        return k;
+#endif
+    default:
+        k.dot = kernels::dotScalar;
+        k.l2 = kernels::l2Scalar;
+        k.dotInt8 = kernels::dotInt8Scalar;
+        return k;
+    }
+}
+
+VectorIndex::VectorIndex(size_t dims, Metric metric, bool quantized) :  _dims(dims),
+                                                                        _metric(metric),
+                                                                        _quantized(quantized),
+                                                                        _blockRows(0),
+                                                                        _blocks(),
+                                                                        _size(0),
+                                                                        _searching(0),
+                                                                        _searches(0) {
+    size_t rowBytes = dims * (quantized ? sizeof(int8_t) : sizeof(float));
+    _blockRows = std::max<size_t>(1, kBlockBytes / rowBytes);
+}
+
+VectorIndex::~VectorIndex() {
+    freeBlocks();
+}
+
+void VectorIndex::Init(v8::Local<v8::Object> exports, AddonData *addon) {
+    // Prepare constructor template
+    v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New, addon->external());
+    tpl->SetClassName(Nan::New("VectorIndex").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    // Prototype
+    Nan::SetPrototypeMethod(tpl, "add", Add, addon->external());
+    Nan::SetPrototypeMethod(tpl, "search", Search, addon->external());
+    Nan::SetPrototypeMethod(tpl, "getStats", GetStats, addon->external());
+    Nan::SetPrototypeMethod(tpl, "clear", Clear, addon->external());
+
+    addon->vectorIndexCons.Reset(tpl->GetFunction());
+    exports->Set(Nan::New("VectorIndex").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+}
+
+char const* VectorIndex::metricName(Metric metric) {
+    return metric == kCosine ? "cosine" : "l2";
+}
+
+bool VectorIndex::reserve(size_t n) {
+    while (_blocks.size() * _blockRows < _size + n) {
+        Block b = { NULL, NULL, NULL, NULL };
+        if (_quantized) {
+            b.codes = (int8_t*)::malloc(_blockRows * _dims);
+            b.scales = (float*)::malloc(_blockRows * sizeof(float));
+            b.norms = (float*)::malloc(_blockRows * sizeof(float));
+        } else {
+            b.data = (float*)::malloc(_blockRows * _dims * sizeof(float));
+        }
+        if (_quantized ? (!b.codes || !b.scales || !b.norms) : !b.data) {
+            ::free(b.codes);
+            ::free(b.scales);
+            ::free(b.norms);
+            return false;
+        }
+        _blocks.push_back(b);
+    }
+    return true;
+}
+
+void VectorIndex::append(float const *rows, size_t n) {
+    for (size_t i = 0; i < n; ++i, ++_size) {
+        Block const& b = _blocks[_size / _blockRows];
+        size_t r = _size % _blockRows;
+        float const *x = rows + i * _dims;
+
+        // Cosine rows are stored normalized. (A zero row stays zero.)
+        float norm = 1;
+        if (_metric == kCosine) {
+            double sum = 0;
+            for (size_t j = 0; j < _dims; ++j) {
+                sum += (double)x[j] * x[j];
+            }
+            norm = sum > 0 ? (float)(1 / std::sqrt(sum)) : 0;
+        }
+
+        if (!_quantized) {
+            float *dst = b.data + r * _dims;
+            for (size_t j = 0; j < _dims; ++j) {
+                dst[j] = x[j] * norm;
+            }
+            continue;
+        }
+
+        // Symmetric per-row quantization: x ~ code * scale
+        float absMax = 0;
+        for (size_t j = 0; j < _dims; ++j) {
+            absMax = std::max(absMax, std::fabs(x[j] * norm));
+        }
+        float scale = absMax / 127;
+        float inv = scale > 0 ? 1 / scale : 0;
+        int8_t *codes = b.codes + r * _dims;
+        float sum = 0;
+        for (size_t j = 0; j < _dims; ++j) {
+            float c = x[j] * norm * inv;
+            c = c == c ? std::min(127.0f, std::max(-127.0f, std::nearbyint(c))) : 0;   // NaN as 0
+            codes[j] = (int8_t)c;
+            sum += (float)codes[j] * codes[j];
+        }
+        b.scales[r] = scale;
+        b.norms[r] = scale * scale * sum;
+    }
+}
+
+char const* VectorIndex::toRows(AddonData *addon,
+                                v8::Local<v8::Value> val,
+                                float const **rows,
+                                size_t *count,
+                                std::vector<float> *copy,
+                                Model **model) const {
+    *model = NULL;
+    size_t n = 0;
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(addon->variableCons);
+    if (val->IsFloat32Array()) {
+        Nan::TypedArrayContents<float> contents(val);
+        *rows = *contents;
+        n = contents.length();
+    } else if (val->IsObject() && val->InstanceOf(Nan::GetCurrentContext(), cons).FromMaybe(false)) {
+        Variable *var = ObjectWrap::Unwrap<Variable>(val->ToObject());
+        Model::VarBuffer const& vb = var->buffer();
+        if (vb.dtype != kFloat32) {
+            return "node-menoh the variable must be float32";
+        }
+        if (var->_model->_inProgress) {
+            return "node-menoh previous run is in progress";
+        }
+        *rows = static_cast<float const*>(vb.ptr);
+        n = vb.size / sizeof(float);
+        *model = var->_model;
+    } else if (val->IsArray()) {
+        v8::Local<v8::Array> arr = v8::Local<v8::Array>::Cast(val);
+        copy->resize(arr->Length());
+        for (uint32_t i = 0; i < arr->Length(); ++i) {
+            v8::Local<v8::Value> it = Nan::Get(arr, i).ToLocalChecked();
+            if (!it->IsNumber()) {
+                return "node-menoh vectors must be an array of numbers";
+            }
+            (*copy)[i] = (float)it->NumberValue();
+        }
+        *rows = copy->empty() ? NULL : &(*copy)[0];
+        n = copy->size();
+    } else {
+        return "node-menoh vectors must be a Float32Array, an array or a Variable";
+    }
+
+    if (n % _dims != 0) {
+        return "node-menoh the length of vectors must be a multiple of dims";
+    }
+    *count = n / _dims;
+    return NULL;
+}
+
+void VectorIndex::freeBlocks() {
+    std::vector<Block>::iterator it;
+    for (it = _blocks.begin(); it != _blocks.end(); ++it) {
+        ::free(it->data);
+        ::free(it->codes);
+        ::free(it->scales);
+        ::free(it->norms);
+    }
+    _blocks.clear();
+}
+
+// Reads an optional row count, which defaults to and must not exceed
+// `max`. Throws and returns false if invalid.
+static bool toRowCount(v8::Local<v8::Value> val, size_t max, size_t *count) {
+    if (val.IsEmpty() || val->IsUndefined()) {
+        *count = max;
+        return true;
+    }
+    double d = val->IsNumber() ? val->NumberValue() : -1;
+    if (d < 0 || d > (double)max || d != (double)(size_t)d) {
+        Nan::ThrowRangeError("node-menoh rows must be an integer not greater than the number of vectors");
+        return false;
+    }
+    *count = (size_t)d;
+    return true;
+}
+
+NAN_METHOD(VectorIndex::New) {
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[0]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 1 must be an object");
+        return;
+    }
+
+    if (!info.IsConstructCall()) {
+        // Invoked as plain function `VectorIndex(...)`, turn into construct call.
+        const int argc = 1;
+        v8::Local<v8::Value> argv[argc] = { info[0] };
+        v8::Local<v8::Function> cons = Nan::New<v8::Function>(AddonData::from(info)->vectorIndexCons);
+        info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+        return;
+    }
+
+    v8::Local<v8::Object> config = info[0]->ToObject();
+    v8::Local<v8::String> key;
+
+    key = Nan::New("dims").ToLocalChecked();
+    v8::Local<v8::Value> val;
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+    }
+    double dims = !val.IsEmpty() && val->IsNumber() ? val->NumberValue() : 0;
+    if (dims < 1 || dims != (double)(uint32_t)dims) {
+        Nan::ThrowTypeError("node-menoh dims must be a positive integer");
+        return;
+    }
+
+    Metric metric = kL2;
+    key = Nan::New("metric").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+        std::string name = val->IsString() ? *Nan::Utf8String(val) : "";
+        if (name == metricName(kL2)) {
+            metric = kL2;
+        } else if (name == metricName(kCosine)) {
+            metric = kCosine;
+        } else {
+            Nan::ThrowTypeError("node-menoh metric must be 'l2' or 'cosine'");
+            return;
+        }
+    }
+
+    bool quantized = false;
+    key = Nan::New("dtype").ToLocalChecked();
+    if (Nan::Has(config, key).FromJust()) {
+        val = Nan::Get(config, key).ToLocalChecked();
+        std::string name = val->IsString() ? *Nan::Utf8String(val) : "";
+        if (name != "float32" && name != "int8") {
+            Nan::ThrowTypeError("node-menoh dtype must be 'float32' or 'int8'");
+            return;
+        }
+        quantized = name == "int8";
+    }
+
+    // Invoked as constructor: `new VectorIndex(...)`
+    VectorIndex* index = new VectorIndex((size_t)dims, metric, quantized);
+    index->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(VectorIndex::Add) {
+    AddonData *addon = AddonData::from(info);
+    VectorIndex* index = ObjectWrap::Unwrap<VectorIndex>(info.Holder());
+
+    if (info.Length() < 1) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+
+    // info[0] - vectors, info[1] - rows (optional)
+    float const *rows = NULL;
+    size_t count = 0;
+    std::vector<float> copy;
+    Model *model = NULL;
+    char const *err = index->toRows(addon, info[0], &rows, &count, &copy, &model);
+    if (err) {
+        Nan::ThrowTypeError(err);
+        return;
+    }
+    if (!toRowCount(info.Length() > 1 ? info[1] : v8::Local<v8::Value>(), count, &count)) {
+        return;
+    }
+    if (index->_size + count > 0xffffffffu) {
+        Nan::ThrowRangeError("node-menoh the index is full");
+        return;
+    }
+    if (!index->reserve(count)) {
+        Nan::ThrowError("node-menoh failed to allocate the index");
+        return;
+    }
+
+    uint32_t first = (uint32_t)index->_size;
+    index->append(rows, count);
+    info.GetReturnValue().Set(Nan::New(first));
+}
+
+NAN_METHOD(VectorIndex::Search) {
+    AddonData *addon = AddonData::from(info);
+    VectorIndex* index = ObjectWrap::Unwrap<VectorIndex>(info.Holder());
+
+    if (info.Length() < 4) {
+        // Throw an Error that is passed back to JavaScript
+        Nan::ThrowTypeError("node-menoh insufficient number of arguments");
+        return;
+    }
+    if (!info[1]->IsNumber() || info[1]->NumberValue() < 1 ||
+        info[1]->NumberValue() != (double)(uint32_t)info[1]->NumberValue()) {
+        Nan::ThrowTypeError("node-menoh k must be a positive integer");
+        return;
+    }
+    if (!info[2]->IsUndefined() && !info[2]->IsObject()) {
+        Nan::ThrowTypeError("node-menoh arg 3 must be an object");
+        return;
+    }
+    if (!info[3]->IsFunction()) {
+        Nan::ThrowTypeError("node-menoh arg 4 must be a function");
+        return;
+    }
+
+    // The worker is created first, so that the copy of an array of queries
+    // is made in place.
+    Nan::Callback *callback = new Nan::Callback(info[3].As<v8::Function>());
+    SearchWorker *w = new SearchWorker(index, callback);
+
+    // info[0] - queries
+    Model *model = NULL;
+    char const *err = index->toRows(addon, info[0], &w->_queries, &w->_numQueries, &w->_copy, &model);
+    if (err) {
+        delete w;
+        Nan::ThrowTypeError(err);
+        return;
+    }
+
+    // info[2] - options
+    v8::Local<v8::Value> rows;
+    size_t threads = 0;
+    Isa isa = kIsaAuto;
+    if (info[2]->IsObject()) {
+        v8::Local<v8::Object> options = info[2]->ToObject();
+        v8::Local<v8::String> key;
+
+        key = Nan::New("rows").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            rows = Nan::Get(options, key).ToLocalChecked();
+        }
+
+        key = Nan::New("threads").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            double d = val->IsNumber() ? val->NumberValue() : 0;
+            if (d < 1 || d != (double)(uint32_t)d) {
+                delete w;
+                Nan::ThrowTypeError("node-menoh threads must be a positive integer");
+                return;
+            }
+            threads = (size_t)d;
+        }
+
+        key = Nan::New("isa").ToLocalChecked();
+        if (Nan::Has(options, key).FromJust()) {
+            v8::Local<v8::Value> val = Nan::Get(options, key).ToLocalChecked();
+            if (!val->IsString() || !toIsa(*Nan::Utf8String(val), &isa)) {
+                delete w;
+                Nan::ThrowTypeError("node-menoh isa must be 'scalar', 'sse4', 'avx2' or 'avx512'");
+                return;
+            }
+            if (isa > detectIsa()) {
+                delete w;
+                Nan::ThrowError("node-menoh isa is not supported by the CPU");
+                return;
+            }
+        }
+    }
+    if (!toRowCount(rows, w->_numQueries, &w->_numQueries)) {
+        delete w;
+        return;
+    }
+
+    // Enough rows per thread to pay for starting it, within the share of
+    // the thread budget (see Execute). More threads than cores only add
+    // overhead.
+    size_t cores = std::max<size_t>(1, std::thread::hardware_concurrency());
+    w->_autoThreads = threads == 0;
+    if (threads == 0) {
+        size_t work = index->_size * index->_dims * w->_numQueries;
+        threads = std::max<size_t>(1, work / kWorkPerThread);
+    }
+    threads = std::min(threads, cores);
+
+    w->_blocks = index->_blocks;
+    w->_size = index->_size;
+    w->_dims = index->_dims;
+    w->_blockRows = index->_blockRows;
+    w->_metric = index->_metric;
+    w->_quantized = index->_quantized;
+    w->_kernels = kernelsOf(isa == kIsaAuto ? detectIsa() : isa);
+    w->_k = std::min((size_t)info[1]->NumberValue(), index->_size);
+    w->_scanThreads = std::max<size_t>(1, std::min(threads, index->_size));
+    w->_mergeThreads = std::max<size_t>(1, std::min(threads, w->_numQueries));
+
+    // The queries are pinned and, if they are the output of a model, the
+    // model is held until the search completes.
+    w->SaveToPersistent("index", info.Holder());
+    w->SaveToPersistent("queries", info[0]);
+    if (model) {
+        model->_inProgress = true;
+        w->_model = model;
+    }
+    index->_searching++;
+    Nan::AsyncQueueWorker(w);
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+NAN_METHOD(VectorIndex::GetStats) {
+    VectorIndex* index = ObjectWrap::Unwrap<VectorIndex>(info.Holder());
+
+    size_t rowBytes = index->_quantized ?
+                        index->_dims * sizeof(int8_t) + 2 * sizeof(float) :
+                        index->_dims * sizeof(float);
+
+    v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+    stats->Set(Nan::New("dims").ToLocalChecked(), Nan::New((uint32_t)index->_dims));
+    stats->Set(Nan::New("metric").ToLocalChecked(), Nan::New(metricName(index->_metric)).ToLocalChecked());
+    stats->Set(Nan::New("dtype").ToLocalChecked(), Nan::New(index->_quantized ? "int8" : "float32").ToLocalChecked());
+    stats->Set(Nan::New("size").ToLocalChecked(), Nan::New((double)index->_size));
+    stats->Set(Nan::New("bytes").ToLocalChecked(),
+               Nan::New((double)(index->_blocks.size() * index->_blockRows * rowBytes)));
+    stats->Set(Nan::New("searching").ToLocalChecked(), Nan::New(index->_searching));
+    stats->Set(Nan::New("searches").ToLocalChecked(), Nan::New(index->_searches));
+
+    info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(VectorIndex::Clear) {
+    VectorIndex* index = ObjectWrap::Unwrap<VectorIndex>(info.Holder());
+    if (index->_searching > 0) {
+        Nan::ThrowTypeError("node-menoh the index is being searched");
+        return;
+    }
+
+    index->freeBlocks();
+    index->_size = 0;
+
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// VectorIndex::SearchWorker (inner) class
+
+VectorIndex::SearchWorker::SearchWorker(
+    VectorIndex *index,
+    Nan::Callback *callback) :  Nan::AsyncWorker(callback, "VectorIndex.SearchWorker"),
+                                _index(index),
+                                _model(NULL),
+                                _blocks(),
+                                _size(0),
+                                _dims(0),
+                                _blockRows(0),
+                                _metric(kL2),
+                                _quantized(false),
+                                _kernels(),
+                                _queries(NULL),
+                                _copy(),
+                                _numQueries(0),
+                                _qnorms(),
+                                _k(0),
+                                _scanThreads(1),
+                                _mergeThreads(1),
+                                _autoThreads(false),
+                                _heaps(),
+                                _counts(),
+                                _ids(NULL),
+                                _distances(NULL) {
+}
+
+VectorIndex::SearchWorker::~SearchWorker() {
+    ::free(_ids);   // NULL if handed over
+    ::free(_distances);
+}
+
+void VectorIndex::SearchWorker::Execute() {
+    size_t n = _numQueries * _k;
+    _ids = (uint32_t*)::malloc(std::max<size_t>(1, n * sizeof(uint32_t)));
+    _distances = (float*)::malloc(std::max<size_t>(1, n * sizeof(float)));
+    if (!_ids || !_distances) {
+        SetErrorMessage("node-menoh failed to allocate the results");
+        return;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    // A search with the default thread count takes a share of the thread
+    // budget, like a model run with `threads: 'auto'`, so that searches
+    // and runs in progress do not oversubscribe the CPU.
+    ThreadBudget::Scope budget(_autoThreads ? ThreadBudget::kAuto : ThreadBudget::kDefault);
+    if (_autoThreads) {
+        _scanThreads = std::min<size_t>(_scanThreads, budget.threads());
+        _mergeThreads = std::min<size_t>(_mergeThreads, budget.threads());
+    }
+
+    try {
+        // Squared norms for L2 (int8 rows), inverse norms for cosine
+        _qnorms.resize(_numQueries);
+        for (size_t q = 0; q < _numQueries; ++q) {
+            float const *query = _queries + q * _dims;
+            float n2 = _kernels.dot(query, query, _dims);
+            _qnorms[q] = _metric == kCosine ? (n2 > 0 ? 1 / std::sqrt(n2) : 0) : n2;
+        }
+
+        _heaps.resize(_scanThreads * _numQueries * _k);
+        _counts.assign(_scanThreads * _numQueries, 0);
+        parallel(&SearchWorker::scan, _scanThreads);
+        parallel(&SearchWorker::merge, _mergeThreads);
+    } catch (std::system_error const& e) {
+        SetErrorMessage((std::string("node-menoh failed to start a search thread: ") + e.what()).c_str());
+    } catch (std::bad_alloc const&) {
+        SetErrorMessage("node-menoh failed to allocate the search buffers");
+    }
+}
+
+void VectorIndex::SearchWorker::parallel(void (SearchWorker::*fn)(size_t), size_t n) {
+    std::vector<std::thread> threads;
+    try {
+        threads.reserve(n - 1);
+        for (size_t t = 1; t < n; ++t) {
+            threads.push_back(std::thread(fn, this, t));
+        }
+    } catch (...) {
+        // The threads started must be joined before unwinding.
+        for (size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+        }
+        throw;
+    }
+    (this->*fn)(0);
+    for (size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+}
+
+float VectorIndex::SearchWorker::distance(size_t q, Block const& b, size_t r) const {
+    float const *query = _queries + q * _dims;
+    float d;
+    if (!_quantized) {
+        float const *row = b.data + r * _dims;
+        d = _metric == kL2 ?
+                _kernels.l2(query, row, _dims) :
+                1 - _kernels.dot(query, row, _dims) * _qnorms[q];
+    } else {
+        float dot = _kernels.dotInt8(query, b.codes + r * _dims, _dims) * b.scales[r];
+        d = _metric == kL2 ?
+                std::max(0.0f, _qnorms[q] + b.norms[r] - 2 * dot) :
+                1 - dot * _qnorms[q];
+    }
+    return d == d ? d : INFINITY;   // NaN last
+}
+
+void VectorIndex::SearchWorker::scan(size_t t) {
+    size_t begin = _size * t / _scanThreads;
+    size_t end = _size * (t + 1) / _scanThreads;
+    Candidate *heaps = &_heaps[t * _numQueries * _k];
+    size_t *counts = &_counts[t * _numQueries];
+
+    // Rows are taken a tile at a time, so that they stay in the cache
+    // across the queries.
+    size_t rowBytes = _dims * (_quantized ? sizeof(int8_t) : sizeof(float));
+    size_t tile = std::max<size_t>(1, kTileBytes / rowBytes);
+    for (size_t r0 = begin; r0 < end; r0 += tile) {
+        size_t r1 = std::min(r0 + tile, end);
+        for (size_t q = 0; q < _numQueries; ++q) {
+            // Max-heap of the best k so far
+            Candidate *heap = heaps + q * _k;
+            size_t& count = counts[q];
+            for (size_t r = r0; r < r1; ++r) {
+                Candidate c = { distance(q, _blocks[r / _blockRows], r % _blockRows), (uint32_t)r };
+                if (count < _k) {
+                    heap[count++] = c;
+                    std::push_heap(heap, heap + count);
+                } else if (c < heap[0]) {
+                    std::pop_heap(heap, heap + _k);
+                    heap[_k - 1] = c;
+                    std::push_heap(heap, heap + _k);
+                }
+            }
+        }
+    }
+}
+
+void VectorIndex::SearchWorker::merge(size_t t) {
+    size_t begin = _numQueries * t / _mergeThreads;
+    size_t end = _numQueries * (t + 1) / _mergeThreads;
+    std::vector<Candidate> all;
+    for (size_t q = begin; q < end; ++q) {
+        all.clear();
+        for (size_t s = 0; s < _scanThreads; ++s) {
+            Candidate const *heap = &_heaps[(s * _numQueries + q) * _k];
+            all.insert(all.end(), heap, heap + _counts[s * _numQueries + q]);
+        }
+        std::partial_sort(all.begin(), all.begin() + _k, all.end());
+        for (size_t i = 0; i < _k; ++i) {
+            _ids[q * _k + i] = all[i].id;
+            _distances[q * _k + i] = all[i].distance;
+        }
+    }
+}
+
+void VectorIndex::SearchWorker::release() {
+    _index->_searching--;
+    if (_model) {
+        _model->_inProgress = false;
+        _model->applyPendingWeights();
+    }
+}
+
+// Called by the main thread.
+void VectorIndex::SearchWorker::HandleOKCallback() {
+    Nan::HandleScope scope;
+    Nan::AsyncResource resource("VectorIndex.SearchWorker.OKCallback");
+    release();
+    _index->_searches++;
+
+    size_t n = _numQueries * _k;
+    v8::Local<v8::Object> idsBuf = Nan::NewBuffer(
+        (char*)_ids, n * sizeof(uint32_t), freeCallback, 0).ToLocalChecked();
+    _ids = NULL;
+    v8::Local<v8::Object> distancesBuf = Nan::NewBuffer(
+        (char*)_distances, n * sizeof(float), freeCallback, 0).ToLocalChecked();
+    _distances = NULL;
+    v8::Local<v8::ArrayBufferView> ids = idsBuf.As<v8::ArrayBufferView>();
+    v8::Local<v8::ArrayBufferView> distances = distancesBuf.As<v8::ArrayBufferView>();
+
+    v8::Local<v8::Object> results = Nan::New<v8::Object>();
+    results->Set(Nan::New("k").ToLocalChecked(), Nan::New((uint32_t)_k));
+    results->Set(Nan::New("ids").ToLocalChecked(),
+                 v8::Uint32Array::New(ids->Buffer(), ids->ByteOffset(), n));
+    results->Set(Nan::New("distances").ToLocalChecked(),
+                 v8::Float32Array::New(distances->Buffer(), distances->ByteOffset(), n));
+
+    v8::Local<v8::Value> argv[] = { Nan::Undefined(), results };
+    callback->Call(2, argv, &resource);
+}
+
+// Called by the main thread.
+void VectorIndex::SearchWorker::HandleErrorCallback() {
+    release();
+    Nan::AsyncWorker::HandleErrorCallback();
+}
+
+
+}  // namespace nodeMenoh
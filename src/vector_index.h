@@ -0,0 +1,170 @@
+#ifndef NODEMENOH_VECTOR_INDEX_H
+#define NODEMENOH_VECTOR_INDEX_H
+
+#include <string>
+#include <vector>
+#include <nan.h>
+#include "addon_data.h"
+#include "convert.h"
+#include "model.h"
+
+namespace nodeMenoh {
+
+// Brute-force nearest-neighbour index of embeddings, e.g. the output of a
+// fully connected layer. Vectors are added from typed arrays or straight
+// from the output buffer of a model (see Variable), and searched by L2 or
+// cosine distance with the distance kernels of the CPU.
+//
+// Rows are stored in float32 or, quantized per row, in int8. They are
+// kept in blocks that never move, so vectors can be added while searches
+// read the existing ones.
+//
+// A search scans disjoint ranges of rows on several threads, each keeping
+// the top k of every query, then merges the candidates by query, also in
+// parallel. Ties are broken by id, so results do not depend on the number
+// of threads.
+class VectorIndex : public Nan::ObjectWrap {
+    public:
+        enum Metric {
+            kL2 = 0,    // squared euclidean distance
+            kCosine     // 1 - cosine similarity
+        };
+
+        static void Init(v8::Local<v8::Object> exports, AddonData *addon);
+
+    private:
+        // _blockRows rows of the index (the members of the other dtype are
+        // NULL)
+        struct Block {
+            float *data;        // float32 rows
+            int8_t *codes;      // int8 rows
+            float *scales;      // of the int8 rows
+            float *norms;       // squared norms of the int8 rows (L2)
+        };
+
+        struct Candidate {
+            float distance;
+            uint32_t id;
+
+            bool operator<(Candidate const& c) const {
+                return distance < c.distance || (distance == c.distance && id < c.id);
+            }
+        };
+
+        // Distance kernels of an instruction set (see distance_kernels.h)
+        struct Kernels {
+            float (*dot)(float const *a, float const *b, size_t n);
+            float (*l2)(float const *a, float const *b, size_t n);
+            float (*dotInt8)(float const *a, int8_t const *b, size_t n);
+        };
+
+        class SearchWorker : public Nan::AsyncWorker {
+            friend class VectorIndex;
+
+            public:
+                explicit SearchWorker(VectorIndex *index, Nan::Callback *callback);
+
+            private:
+                virtual ~SearchWorker();
+
+                // Called by the worker thread.
+                void Execute();
+
+                // Runs (this->*fn)(t) for t in [0, n), on n threads
+                // including the calling one. Throws std::system_error if
+                // a thread cannot be started.
+                void parallel(void (SearchWorker::*fn)(size_t), size_t n);
+
+                // Keeps the top k of each query among the rows of range `t`.
+                void scan(size_t t);
+
+                // Merges the candidates of the queries of range `t`.
+                void merge(size_t t);
+
+                // Returns the distance of query `q` to row `r` of `b`.
+                float distance(size_t q, Block const& b, size_t r) const;
+
+                // Called by the main therad.
+                virtual void HandleOKCallback();
+                virtual void HandleErrorCallback();
+
+                // Allows changes to the index and runs of the model.
+                // (main thread)
+                void release();
+
+                VectorIndex *_index;
+                Model *_model;          // of the queries, if a Variable
+
+                // Snapshot of the index
+                std::vector<Block> _blocks;
+                size_t _size;
+                size_t _dims;
+                size_t _blockRows;
+                Metric _metric;
+                bool _quantized;
+                Kernels _kernels;
+
+                float const *_queries;  // in place, or `_copy`
+                std::vector<float> _copy;
+                size_t _numQueries;
+                std::vector<float> _qnorms; // squared (L2) or inverse (cosine) norms
+                size_t _k;
+                size_t _scanThreads;
+                size_t _mergeThreads;
+                bool _autoThreads;      // capped by the thread budget
+
+                std::vector<Candidate> _heaps;  // k per thread and query
+                std::vector<size_t> _counts;    // of the heaps
+                uint32_t *_ids;                 // the results
+                float *_distances;
+        };
+
+        VectorIndex(size_t dims, Metric metric, bool quantized);
+        ~VectorIndex();
+
+        // Allocates the blocks for `n` more rows. Returns false if out of
+        // memory.
+        bool reserve(size_t n);
+
+        // Appends `n` rows, normalized if cosine, quantized if int8.
+        void append(float const *rows, size_t n);
+
+        // Reads the rows of `val`: a Float32Array or a float32 Variable,
+        // read in place, or an array of numbers, copied into `copy`.
+        // `model` is set to the model of a Variable. Returns an error
+        // message on failure.
+        char const* toRows( AddonData *addon,
+                            v8::Local<v8::Value> val,
+                            float const **rows,
+                            size_t *count,
+                            std::vector<float> *copy,
+                            Model **model) const;
+
+        void freeBlocks();
+
+        static char const* metricName(Metric metric);
+
+        // Returns the kernels of an instruction set supported by the CPU.
+        static Kernels kernelsOf(Isa isa);
+
+        size_t _dims;
+        Metric _metric;
+        bool _quantized;        // int8 rows
+        size_t _blockRows;
+        std::vector<Block> _blocks;
+        size_t _size;
+        uint32_t _searching;    // searches in progress
+        uint32_t _searches;     // completed
+
+        static NAN_METHOD(New);
+
+        // NodeJS property methods
+        static NAN_METHOD(Add);
+        static NAN_METHOD(Search);
+        static NAN_METHOD(GetStats);
+        static NAN_METHOD(Clear);
+};
+
+}  // namespace nodeMenoh
+
+#endif//NODEMENOH_VECTOR_INDEX_H
@@ -74,6 +74,24 @@ function findIndicesOfTopK(a, k) {
     return outp;
 }
 
+// Minimal AbortSignal for NodeJS versions without AbortController.
+class FakeAbortSignal {
+    constructor() {
+        this.aborted = false;
+        this.listeners = [];
+    }
+    addEventListener(type, fn) {
+        this.listeners.push(fn);
+    }
+    removeEventListener(type, fn) {
+        this.listeners = this.listeners.filter((l) => l !== fn);
+    }
+    abort() {
+        this.aborted = true;
+        this.listeners.slice().forEach((fn) => fn());
+    }
+}
+
 function validateOutput(output, batchSize) {
     if (Array.isArray(output.data)) {
         // sanity check
@@ -99,6 +117,71 @@ function validateOutput(output, batchSize) {
 
 }
 
+// Writes a copy of an ONNX file with the sign of every float initializer
+// flipped, i.e. the same topology with different weights. The protobuf
+// fields are edited in place, so their lengths are unchanged.
+function writeNegatedWeights(src, dst) {
+    const buf = fs.readFileSync(src);
+
+    // Returns the fields of the message in [start, end) as
+    // { num, wire, value, start, end }.
+    function fields(start, end) {
+        const result = [];
+        let i = start;
+        function varint() {
+            let v = 0;
+            let mul = 1;
+            let b;
+            do {
+                b = buf[i++];
+                v += (b & 0x7f) * mul;
+                mul *= 128;
+            } while (b & 0x80);
+            return v;
+        }
+        while (i < end) {
+            const key = varint();
+            const f = { num: Math.floor(key / 8), wire: key % 8 };
+            if (f.wire === 0) {
+                f.value = varint();
+            } else if (f.wire === 1 || f.wire === 5) {
+                f.start = i;
+                i += f.wire === 1 ? 8 : 4;
+                f.end = i;
+            } else if (f.wire === 2) {
+                const len = varint();
+                f.start = i;
+                i += len;
+                f.end = i;
+            } else {
+                throw new Error('unexpected wire type ' + f.wire);
+            }
+            result.push(f);
+        }
+        return result;
+    }
+
+    fields(0, buf.length)
+    .filter((f) => f.num === 7 && f.wire === 2)             // ModelProto.graph
+    .forEach((graph) => {
+        fields(graph.start, graph.end)
+        .filter((f) => f.num === 5 && f.wire === 2)         // GraphProto.initializer
+        .forEach((tensor) => {
+            const tf = fields(tensor.start, tensor.end);
+            if (!tf.some((f) => f.num === 2 && f.value === 1)) {
+                return; // not FLOAT (e.g. the shape of a Reshape)
+            }
+            tf.filter((f) => (f.num === 4 || f.num === 9) && f.wire !== 0)
+            .forEach((f) => {                               // float_data, raw_data
+                for (let i = f.start + 3; i < f.end; i += 4) {
+                    buf[i] ^= 0x80; // sign bit (little endian)
+                }
+            });
+        });
+    });
+    fs.writeFileSync(dst, buf);
+}
+
 describe('MNIST tests', function () {
     let imageList;
     let batchSize;
@@ -264,6 +347,1563 @@ describe('MNIST tests', function () {
             });
         });
     });
+
+    it('Share model data between builders of the same file', function () {
+        // Load the same ONNX file twice concurrently
+        const before = menoh.getModelDataCacheStats();
+        return Promise.all([
+            menoh.create(ONNX_FILE_PATH),
+            menoh.create(ONNX_FILE_PATH)
+        ])
+        .then((builders) => {
+            // The second load finds the entry of the first one.
+            const after = menoh.getModelDataCacheStats();
+            assert.equal(after.hits + after.misses, before.hits + before.misses + 2);
+            assert.ok(after.hits > before.hits);
+
+            const models = builders.map((builder) => {
+                builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+                builder.addOutput(MNIST_OUT_NAME);
+                return builder.buildModel({
+                    backendName: 'mkldnn'
+                });
+            });
+
+            const ovs = models.map((model) => {
+                const iv = createBufferView(model, MNIST_IN_NAME);
+                data.forEach((v, i) => {
+                    iv.data[i] = v;
+                });
+                return createBufferView(model, MNIST_OUT_NAME);
+            });
+
+            return Promise.all(models.map((model) => model.run()))
+            .then(() => {
+                ovs.forEach((ov) => validateOutput(ov, batchSize));
+            });
+        });
+    });
+});
+
+describe('ModelRegistry tests', function () {
+    let imageList;
+    let batchSize;
+    let data;
+
+    before(function () {
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((_imageList) => {
+            imageList = _imageList;
+            batchSize = imageList.length;
+            data = preprocessImages(imageList);
+        });
+    })
+
+    it('Evict and rebuild models transparently', function () {
+        // Budget for only one model at a time.
+        const registry = new menoh.ModelRegistry({ budget: 1 });
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+
+            const model1 = builder.buildModel({ registry, footprint: 1 });
+            const iv1 = createBufferView(model1, MNIST_IN_NAME);
+            const ov1 = createBufferView(model1, MNIST_OUT_NAME);
+
+            // Building model2 evicts model1.
+            const model2 = builder.buildModel({ registry, footprint: 1 });
+            let stats = registry.getStats();
+            assert.equal(stats.models, 2);
+            assert.equal(stats.resident, 1);
+            assert.equal(stats.evictions, 1);
+
+            data.forEach((v, i) => {
+                iv1.data[i] = v;
+            });
+
+            // Views obtained before the eviction remain valid.
+            return model1.run()
+            .then(() => {
+                validateOutput(ov1, batchSize);
+                stats = registry.getStats();
+                assert.equal(stats.rebuilds, 1);
+                assert.equal(stats.evictions, 2);
+                assert.equal(stats.used, 1);
+            });
+        });
+    });
+
+    it('should throw with invalid registry', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            builder.buildModel({ registry: {} }); // should throw
+        })
+        .then(assert.fail, (err) => {
+            assert.ok(err instanceof Error);
+            assert.ok(err.message.includes('registry'));
+        });
+    });
+});
+
+describe('ResultCache tests', function () {
+    let imageList;
+    let batchSize;
+    let data;
+
+    before(function () {
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((_imageList) => {
+            imageList = _imageList;
+            batchSize = imageList.length;
+            data = preprocessImages(imageList);
+        });
+    })
+
+    it('Serve repeated inputs from the cache', function () {
+        const cache = new menoh.ResultCache({ maxBytes: 1024 * 1024 });
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+
+            const models = [
+                builder.buildModel({ resultCache: cache }),
+                builder.buildModel({ resultCache: cache })
+            ];
+            const ovs = models.map((model) => {
+                const iv = createBufferView(model, MNIST_IN_NAME);
+                data.forEach((v, i) => {
+                    iv.data[i] = v;
+                });
+                return createBufferView(model, MNIST_OUT_NAME);
+            });
+
+            // Identical inputs on two models: one run, one hit or coalesced.
+            return Promise.all(models.map((model) => model.run()))
+            .then(() => {
+                ovs.forEach((ov) => validateOutput(ov, batchSize));
+                ovs[0].data.fill(0);
+                return models[0].run();
+            })
+            .then(() => {
+                validateOutput(ovs[0], batchSize);
+                const stats = cache.getStats();
+                assert.equal(stats.misses, 1);
+                assert.equal(stats.hits + stats.coalesced, 2);
+                assert.ok(stats.hits >= 1);
+                assert.equal(stats.collisions, 0);
+                assert.equal(stats.entries, 1);
+            });
+        });
+    });
+
+    it('Run different inputs instead of taking cached outputs', function () {
+        const cache = new menoh.ResultCache({ maxBytes: 1024 * 1024 });
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+
+            const model = builder.buildModel({ resultCache: cache });
+            const iv = createBufferView(model, MNIST_IN_NAME);
+            const ov = createBufferView(model, MNIST_OUT_NAME);
+            data.forEach((v, i) => {
+                iv.data[i] = v;
+            });
+
+            let first;
+            return model.run()
+            .then(() => {
+                validateOutput(ov, batchSize);
+                first = Array.from(ov.data);
+                iv.data.fill(0);
+                return model.run();
+            })
+            .then(() => {
+                const stats = cache.getStats();
+                assert.equal(stats.misses, 2);
+                assert.equal(stats.hits, 0);
+                assert.equal(stats.entries, 2);
+                assert.notDeepEqual(Array.from(ov.data), first);
+            });
+        });
+    });
+
+    it('should throw when used by another builder', function () {
+        const cache = new menoh.ResultCache({ maxBytes: 1024 });
+
+        return Promise.all([
+            menoh.create(ONNX_FILE_PATH),
+            menoh.create(ONNX_FILE_PATH)
+        ])
+        .then((builders) => {
+            builders.forEach((builder) => {
+                builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+                builder.addOutput(MNIST_OUT_NAME);
+                builder.buildModel({ resultCache: cache }); // 2nd should throw
+            });
+        })
+        .then(assert.fail, (err) => {
+            assert.ok(err instanceof Error);
+            assert.ok(err.message.includes('resultCache'));
+        });
+    });
+});
+
+describe('Graph editing tests', function () {
+    let imageList;
+    let batchSize;
+    let data;
+
+    before(function () {
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((_imageList) => {
+            imageList = _imageList;
+            batchSize = imageList.length;
+            data = preprocessImages(imageList);
+        });
+    })
+
+    it('Prepend normalization to the input', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            // Feed pixel values scaled down by 1/255 and let the graph undo it.
+            const rawName = builder.prependNormalization(MNIST_IN_NAME, {
+                scale: 255,
+                mean: 0,
+                std: 1
+            });
+            assert.equal(rawName, MNIST_IN_NAME + '_raw');
+
+            builder.addInput(rawName, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({
+                backendName: 'mkldnn'
+            });
+
+            const iv = createBufferView(model, rawName);
+            const ov = createBufferView(model, MNIST_OUT_NAME);
+            data.forEach((v, i) => {
+                iv.data[i] = v / 255;
+            });
+
+            return model.run()
+            .then(() => {
+                validateOutput(ov, batchSize);
+            });
+        });
+    });
+
+    it('Build a graph from scratch', function () {
+        const builder = menoh.createEmpty();
+
+        // y = x * W^T + b
+        const W = new Float32Array([
+            1, 0, 0, 0,
+            0, 1, 0, 0,
+            0, 0, 0, 1
+        ]);
+        const b = new Float32Array([ 0.5, 0.5, 0.5 ]);
+        builder.addParameter('W', [ 3, 4 ], W);
+        builder.addParameter('b', [ 3 ], b);
+        builder.addNode('Gemm', [ 'x', 'W', 'b' ], [ 'y' ], {
+            alpha: { type: 'float', value: 1 },
+            beta: { type: 'float', value: 1 },
+            transA: 0,
+            transB: 1
+        });
+
+        builder.addInput('x', [ 1, 4 ]);
+        builder.addOutput('y');
+        const model = builder.buildModel({});
+
+        const x = createBufferView(model, 'x');
+        const y = createBufferView(model, 'y');
+        [ 1, 2, 3, 4 ].forEach((v, i) => {
+            x.data[i] = v;
+        });
+
+        return model.run()
+        .then(() => {
+            assert.deepEqual(Array.from(y.data), [ 1.5, 2.5, 4.5 ]);
+
+            // The parameters are referenced. Rebuild with new weights.
+            W.fill(0);
+            const model2 = builder.buildModel({});
+            const x2 = createBufferView(model2, 'x');
+            const y2 = createBufferView(model2, 'y');
+            x2.data.set(x.data);
+            return model2.run()
+            .then(() => {
+                assert.deepEqual(Array.from(y2.data), [ 0.5, 0.5, 0.5 ]);
+            });
+        });
+    });
+
+    it('should throw with invalid attribute value', function () {
+        const builder = menoh.createEmpty();
+        assert.throws(() => {
+            builder.addNode('Relu', [ 'x' ], [ 'y' ], { bad: 'string' });
+        }, (err) => {
+            assert.ok(err instanceof Error);
+            assert.ok(err.message.includes('bad'));
+            return true;
+        });
+
+        // The node has not been added, so it can be added again.
+        builder.addNode('Relu', [ 'x' ], [ 'y' ]);
+        builder.addInput('x', [ 1, 4 ]);
+        builder.addOutput('y');
+        const model = builder.buildModel({});
+        const x = createBufferView(model, 'x');
+        const y = createBufferView(model, 'y');
+        x.data.set([ -1, 2, -3, 4 ]);
+        return model.run()
+        .then(() => {
+            assert.deepEqual(Array.from(y.data), [ 0, 2, 0, 4 ]);
+        });
+    });
+
+    it('should throw after the model has been built', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            builder.buildModel({});
+            builder.prependNormalization(MNIST_IN_NAME, { mean: 0 }); // should throw
+        })
+        .then(assert.fail, (err) => {
+            assert.ok(err instanceof Error);
+            assert.ok(err.message.includes('already been built'));
+        });
+    });
+});
+
+describe('Weight swap tests', function () {
+    let imageList;
+    let batchSize;
+    let data;
+
+    before(function () {
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((_imageList) => {
+            imageList = _imageList;
+            batchSize = imageList.length;
+            data = preprocessImages(imageList);
+        });
+    })
+
+    it('Swap weights while a run is in progress', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({
+                backendName: 'mkldnn'
+            });
+
+            const iv = createBufferView(model, MNIST_IN_NAME);
+            const ov = createBufferView(model, MNIST_OUT_NAME);
+            data.forEach((v, i) => {
+                iv.data[i] = v;
+            });
+
+            // Views remain valid after the swap.
+            return Promise.all([ model.run(), model.swapWeights(ONNX_FILE_PATH) ])
+            .then(() => {
+                validateOutput(ov, batchSize);
+                ov.data.fill(0);
+                return model.run();
+            })
+            .then(() => {
+                validateOutput(ov, batchSize);
+            });
+        });
+    });
+
+    it('Swap in different weights', function () {
+        const negatedPath = require('os').tmpdir() + '/node-menoh-negated.onnx';
+        writeNegatedWeights(ONNX_FILE_PATH, negatedPath);
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+
+            const iv = createBufferView(model, MNIST_IN_NAME);
+            const ov = createBufferView(model, MNIST_OUT_NAME);
+            data.forEach((v, i) => {
+                iv.data[i] = v;
+            });
+
+            let before;
+            return model.run()
+            .then(() => {
+                validateOutput(ov, batchSize);
+                before = Array.from(ov.data);
+                return model.swapWeights(negatedPath);
+            })
+            .then(() => model.run())
+            .then(() => {
+                assert.notDeepEqual(Array.from(ov.data), before);
+                return model.swapWeights(ONNX_FILE_PATH);
+            })
+            .then(() => model.run())
+            .then(() => {
+                assert.deepEqual(Array.from(ov.data), before);
+            });
+        })
+        .then(() => fs.unlinkSync(negatedPath));
+    });
+
+    it('should throw when the graph has been edited', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            const rawName = builder.prependNormalization(MNIST_IN_NAME, { mean: 0 });
+            builder.addInput(rawName, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            return model.swapWeights(ONNX_FILE_PATH);
+        })
+        .then(assert.fail, (err) => {
+            assert.ok(err instanceof Error);
+            assert.ok(err.message.includes('edited graph'));
+        });
+    });
+
+    it('should fail when the new model does not exist', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            return model.swapWeights('bad_onnx_file_path');
+        })
+        .then(assert.fail, (err) => {
+            assert.ok(err instanceof Error);
+            assert.ok(err.message.includes('bad_onnx_file_path'));
+        });
+    });
+});
+
+describe('ModelPool tests', function () {
+    let samples;
+
+    before(function () {
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((imageList) => {
+            const data = preprocessImages(imageList);
+            samples = _.chunk(data, 28 * 28).map((v) => new Float32Array(v));
+        });
+    })
+
+    function buildModels(n, batchSize) {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ batchSize || 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            return _.times(n, () => builder.buildModel({ backendName: 'mkldnn' }));
+        });
+    }
+
+    it('Run requests on replicas', function () {
+        return buildModels(2)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models });
+            return Promise.all(samples.map((sample) => pool.run(sample)))
+            .then((results) => {
+                results.forEach((outputs, i) => {
+                    const output = Array.from(outputs[MNIST_OUT_NAME]);
+                    assert.deepEqual(findIndicesOfTopK(output, 1), [ i ]);
+                });
+                const stats = pool.getStats();
+                assert.equal(stats.models, 2);
+                assert.equal(stats.completed, samples.length);
+                assert.equal(stats.queued, 0);
+                assert.equal(stats.busy, 0);
+            });
+        });
+    });
+
+    it('Build replicas with the swapped weights', function () {
+        const negatedPath = require('os').tmpdir() + '/node-menoh-negated-pool.onnx';
+        writeNegatedWeights(ONNX_FILE_PATH, negatedPath);
+
+        return buildModels(1)
+        .then((models) => {
+            const model = models[0];
+            const iv = createBufferView(model, MNIST_IN_NAME);
+            const ov = createBufferView(model, MNIST_OUT_NAME);
+            iv.data.set(samples[0]);
+
+            let expected;
+            return model.swapWeights(negatedPath)
+            .then(() => model.run())
+            .then(() => {
+                expected = Array.from(ov.data);
+                const pool = new menoh.ModelPool({
+                    models,
+                    autoscale: { min: 2, max: 2 },
+                });
+                assert.throws(() => model.swapWeights(ONNX_FILE_PATH, () => {}), /in a pool/);
+
+                const whenGrown = () => new Promise((resolve) => {
+                    const check = () => {
+                        const stats = pool.getStats();
+                        if (stats.growing === 0 && (stats.models === 2 || stats.buildErrors > 0)) {
+                            return resolve(stats);
+                        }
+                        setTimeout(check, 10);
+                    };
+                    check();
+                });
+                return whenGrown()
+                .then((stats) => {
+                    assert.equal(stats.buildErrors, 0);
+                    assert.equal(stats.models, 2);
+
+                    // One request on each model
+                    return Promise.all([ pool.run(samples[0]), pool.run(samples[0]) ]);
+                });
+            })
+            .then((results) => {
+                results.forEach((outputs) => {
+                    assert.deepEqual(Array.from(outputs[MNIST_OUT_NAME]), expected);
+                });
+            });
+        })
+        .then(() => fs.unlinkSync(negatedPath));
+    });
+
+    it('Add replicas under load', function () {
+        return buildModels(1)
+        .then((models) => {
+            const pool = new menoh.ModelPool({
+                models,
+                autoscale: { min: 1, max: 2, scaleUpWait: 0 },
+            });
+            const inputs = _.flatten(_.times(10, () => samples));
+            const whenGrown = () => new Promise((resolve) => {
+                const check = () => {
+                    if (pool.getStats().growing === 0) {
+                        return resolve(pool.getStats());
+                    }
+                    setTimeout(check, 10);
+                };
+                check();
+            });
+            return Promise.all(inputs.map((sample) => pool.run(sample)))
+            .then(whenGrown)
+            .then((stats) => {
+                assert.equal(stats.scaleUps, 1);
+                assert.equal(stats.models, 2);
+                assert.equal(stats.buildErrors, 0);
+                assert.equal(stats.completed, inputs.length);
+                return pool.run(samples[0]);
+            })
+            .then((outputs) => {
+                const output = Array.from(outputs[MNIST_OUT_NAME]);
+                assert.deepEqual(findIndicesOfTopK(output, 1), [ 0 ]);
+            });
+        });
+    });
+
+    it('Split a large batch across replicas', function () {
+        return buildModels(3, 4)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models });
+            const batch = new Float32Array(samples.length * 28 * 28);
+            samples.forEach((sample, i) => batch.set(sample, i * 28 * 28));
+            return pool.runLarge(batch)
+            .then((outputs) => {
+                const output = outputs[MNIST_OUT_NAME];
+                assert.equal(output.length, samples.length * 10);
+                for (let i = 0; i < samples.length; i++) {
+                    const scores = Array.from(output.subarray(i * 10, (i + 1) * 10));
+                    assert.deepEqual(findIndicesOfTopK(scores, 1), [ i ]);
+                }
+                const stats = pool.getStats();
+                assert.equal(stats.completed, 3); // chunks of 4, 4 and 2
+                assert.equal(stats.busy, 0);
+                assert.throws(() => pool.runLarge(batch.subarray(1), () => {}), /whole number of samples/);
+            });
+        });
+    });
+
+    it('Fail all the chunks of a large batch', function () {
+        return buildModels(1, 2)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models });
+            const batch = new Float32Array(8 * 28 * 28);
+            const signal = new FakeAbortSignal();
+            const p = pool.runLarge(batch, { signal });
+            signal.abort();
+            return p.then(() => assert.fail('should be rejected'), (err) => {
+                assert.equal(err.code, 'MENOH_CANCELLED');
+                assert.equal(pool.getStats().queued, 0);
+            });
+        });
+    });
+
+    it('Dispatch requests by priority', function () {
+        return buildModels(1)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models });
+            const order = [];
+            const run = (i, priority) => pool.run(samples[i], { priority }).then(() => order.push(i));
+            const all = [ run(0, 0), run(1, 0), run(2, 0), run(3, 1) ];
+            return Promise.all(all).then(() => {
+                // 0 was running. 3 overtakes the queued ones.
+                assert.deepEqual(order, [ 0, 3, 1, 2 ]);
+            });
+        });
+    });
+
+    it('Share models between priorities by weight', function () {
+        return buildModels(1)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models, weights: [ 1, 3 ] });
+            const order = [];
+            const run = (i, priority) => pool.run(samples[i], { priority }).then(() => order.push(priority));
+            const all = [ run(0, 1) ];
+            for (let i = 1; i <= 8; ++i) {
+                all.push(run(i, i <= 4 ? 0 : 1));
+            }
+            return Promise.all(all).then(() => {
+                // The low priority is not starved by the high one.
+                assert.ok(order.slice(1, 5).includes(0));
+            });
+        });
+    });
+
+    it('Cancel a queued request', function () {
+        return buildModels(1)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models });
+            const signal = new FakeAbortSignal();
+            const first = pool.run(samples[0]);
+            const second = pool.run(samples[1], { signal });
+            signal.abort();
+            return second
+            .then(() => assert.fail('should be cancelled'), (err) => {
+                assert.equal(err.code, 'MENOH_CANCELLED');
+                assert.equal(pool.getStats().cancelled, 1);
+                assert.equal(pool.getStats().queued, 0);
+                return first;
+            });
+        });
+    });
+
+    it('Cancel a model run not started yet', function () {
+        if (process.platform === 'win32') {
+            this.skip(); // no mkfifo
+        }
+
+        // Occupy every thread of the libuv pool with opening a FIFO that
+        // has no writer, so that the run stays queued until it is opened
+        // for writing.
+        const threads = parseInt(process.env.UV_THREADPOOL_SIZE, 10) || 4;
+        const fifo = `/tmp/node-menoh-cancel-${process.pid}`;
+        require('child_process').execFileSync('mkfifo', [ fifo ]);
+
+        return buildModels(1)
+        .then((models) => {
+            const model = models[0];
+            const blockers = _.times(threads, () => new Promise((resolve, reject) => {
+                fs.open(fifo, 'r', (err, fd) => err ? reject(err) : resolve(fd));
+            }));
+            const run = model.run();
+            assert.equal(model.cancel(), true);
+            return run.then(() => assert.fail('should be cancelled'), (err) => {
+                assert.equal(err.code, 'MENOH_CANCELLED');
+                const writer = fs.openSync(fifo, 'w');
+                return Promise.all(blockers)
+                .then((fds) => {
+                    fds.concat(writer).forEach((fd) => fs.closeSync(fd));
+                });
+            })
+            .then(() => {
+                // The model can run again.
+                assert.equal(model.cancel(), false);
+                return model.run();
+            })
+            .then(() => {
+                fs.unlinkSync(fifo);
+            });
+        });
+    });
+
+    it('Shed load when the queue is full', function () {
+        return buildModels(1)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models, maxQueue: 1 });
+            const first = pool.run(samples[0]);   // runs
+            const second = pool.run(samples[1]);  // queued
+            return pool.run(samples[2])
+            .then(() => assert.fail('should be rejected'), (err) => {
+                assert.equal(err.code, 'MENOH_QUEUE_FULL');
+                assert.equal(pool.getStats().rejected, 1);
+                return Promise.all([ first, second ]);
+            });
+        });
+    });
+
+    it('Drop requests past their deadline', function () {
+        return buildModels(1)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models });
+            const first = pool.run(samples[0]);
+            return pool.run(samples[1], { timeout: 0 })
+            .then(() => assert.fail('should expire'), (err) => {
+                assert.equal(err.code, 'MENOH_DEADLINE_EXCEEDED');
+                assert.equal(pool.getStats().expired, 1);
+                return first;
+            });
+        });
+    });
+
+    it('should throw when a model is already in a pool', function () {
+        return buildModels(2)
+        .then((models) => {
+            assert.throws(() => new menoh.ModelPool({ models: [ models[0], models[0] ] }), /already in a pool/);
+            const pool = new menoh.ModelPool({ models: [ models[0] ] });
+            assert.throws(() => new menoh.ModelPool({ models }), /already in a pool/);
+            return pool.run(samples[0]);
+        });
+    });
+
+    it('Call back expired requests asynchronously', function () {
+        return buildModels(1)
+        .then((models) => {
+            const pool = new menoh.ModelPool({ models });
+            return new Promise((resolve) => {
+                let returned = false;
+                pool.run(samples[0], { timeout: 0 }, (err) => {
+                    assert.ok(returned, 'called back from within run()');
+                    assert.equal(err.code, 'MENOH_DEADLINE_EXCEEDED');
+                    resolve();
+                });
+                returned = true;
+            });
+        });
+    });
+});
+
+describe('Inference stream tests', function () {
+    let samples;
+
+    before(function () {
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((imageList) => {
+            const data = preprocessImages(imageList);
+            samples = _.chunk(data, 28 * 28).map((v) => new Float32Array(v));
+        });
+    })
+
+    it('Stream samples through a model and its replica in order', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 3, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({ backendName: 'mkldnn' });
+            const replica = builder.buildModel({ backendName: 'mkldnn' });
+
+            const s = model.createInferenceStream({ replicas: [ replica ] });
+            return new Promise((resolve, reject) => {
+                const results = [];
+                s.on('data', (output) => results.push(output));
+                s.on('end', () => resolve(results));
+                s.on('error', reject);
+                samples.forEach((sample) => s.write(sample));
+                s.end();
+            });
+        })
+        .then((results) => {
+            // 10 samples in 3 full batches and a partial one.
+            assert.equal(results.length, samples.length);
+            results.forEach((output, i) => {
+                assert.ok(output instanceof Float32Array);
+                assert.equal(output.length, 10);
+                assert.deepEqual(findIndicesOfTopK(Array.from(output), 1), [ i ]);
+            });
+        });
+    });
+
+    it('Fails on a sample of the wrong size', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({ backendName: 'mkldnn' });
+
+            const s = model.createInferenceStream();
+            return new Promise((resolve, reject) => {
+                s.on('data', () => reject(new Error('should fail')));
+                s.on('error', resolve);
+                s.write(new Float32Array(3));
+            });
+        })
+        .then((err) => {
+            assert.ok(err instanceof RangeError);
+        });
+    });
+});
+
+describe('SharedRing tests', function () {
+    before(function () {
+        if (process.platform === 'win32') {
+            this.skip();
+        }
+    })
+
+    it('Run requests through a shared ring', function () {
+        const name = `/node-menoh-test-${process.pid}`;
+        const server = new menoh.SharedRing({
+            name,
+            create: true,
+            slots: 4,
+            slotBytes: 28 * 28 * 4
+        });
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({ backendName: 'mkldnn' });
+            const serving = server.serve(model);
+
+            // The model is owned by the ring while serving.
+            assert.throws(() => model.run(() => {}), /in progress/);
+
+            const client = new menoh.SharedRing({ name });
+            const input = new Float32Array(28 * 28);
+            return Promise.all([ client.run(input), client.run(input) ])
+            .then((results) => {
+                results.forEach((outputs) => {
+                    assert.ok(outputs instanceof Float32Array);
+                    assert.equal(outputs.length, 10);
+                });
+                assert.deepEqual(Array.from(results[0]), Array.from(results[1]));
+
+                // Input of the wrong size
+                return client.run(new Float32Array(3))
+                .then(() => assert.fail('should fail'), (err) => {
+                    assert.ok(err.message.includes('input size'));
+                });
+            })
+            .then(() => {
+                server.close();
+                return serving;
+            })
+            .then((served) => {
+                assert.equal(served, 2);
+            });
+        });
+    });
+
+    it('Fail a request that is not served in time', function () {
+        const name = `/node-menoh-timeout-${process.pid}`;
+        const ring = new menoh.SharedRing({
+            name,
+            create: true,
+            slots: 1,
+            slotBytes: 64,
+            timeout: 100
+        });
+
+        return ring.run(new Float32Array(4))
+        .then(() => assert.fail('should fail'), (err) => {
+            assert.ok(err.message.includes('timed out'));
+            ring.close();
+        });
+    });
+
+    it('Keep the libuv pool free while requests wait', function () {
+        // More requests than threads in the pool, to a ring nobody serves
+        const threads = parseInt(process.env.UV_THREADPOOL_SIZE, 10) || 4;
+        const ring = new menoh.SharedRing({
+            name: `/node-menoh-pool-${process.pid}`,
+            create: true,
+            slots: threads + 1,
+            slotBytes: 64,
+            timeout: 1000
+        });
+        let waiting = true;
+        const requests = _.times(threads + 1, () => ring.run(new Float32Array(4)).catch((err) => {
+            waiting = false;
+            return err;
+        }));
+
+        // File system calls run on the pool meanwhile.
+        return new Promise((resolve, reject) => {
+            fs.stat(ONNX_FILE_PATH, (err) => err ? reject(err) : resolve());
+        })
+        .then(() => {
+            assert.ok(waiting);
+            return Promise.all(requests);
+        })
+        .then((errors) => {
+            errors.forEach((err) => assert.ok(err.message.includes('timed out')));
+            ring.close();
+        });
+    });
+
+    it('Reclaim the slot of an exited client', function () {
+        const name = `/node-menoh-reclaim-${process.pid}`;
+        const server = new menoh.SharedRing({
+            name,
+            create: true,
+            slots: 1,
+            slotBytes: 28 * 28 * 4
+        });
+
+        // The child posts a request in the only slot and is killed.
+        const child = require('child_process').spawnSync(process.execPath, [ '-e', `
+            const menoh = require('.');
+            const ring = new menoh.SharedRing({ name: '${name}' });
+            ring.run(new Float32Array(28 * 28)).catch(() => {});
+            setTimeout(() => process.kill(process.pid, 'SIGKILL'), 200);
+        ` ]);
+        assert.equal(child.signal, 'SIGKILL');
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            const serving = server.serve(model);
+
+            const client = new menoh.SharedRing({ name, timeout: 5000 });
+            return client.run(new Float32Array(28 * 28))
+            .then((outputs) => {
+                assert.equal(outputs.length, 10);
+                server.close();
+                return serving;
+            })
+            .then((served) => {
+                assert.equal(served, 1);
+            });
+        });
+    });
+
+    it('Throws if the ring does not exist', function () {
+        assert.throws(() => {
+            new menoh.SharedRing({ name: `/node-menoh-missing-${process.pid}` });
+        }, /failed to open shared memory/);
+    });
+});
+
+describe('Thread budget tests', function () {
+    let budget;
+
+    before(function () {
+        budget = menoh.getThreadBudget().cores;
+    })
+
+    after(function () {
+        menoh.setThreadBudget(budget);
+    })
+
+    it('Run models with a share of the thread budget', function () {
+        assert.ok(budget > 0);
+        menoh.setThreadBudget(2);
+        assert.equal(menoh.getThreadBudget().cores, 2);
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const models = [
+                builder.buildModel({ threads: 'auto' }),
+                builder.buildModel({ threads: 'auto' }),
+                builder.buildModel({ threads: 1 })
+            ];
+            return Promise.all(models.map((model) => model.run()));
+        })
+        .then(() => {
+            assert.equal(menoh.getThreadBudget().active, 0);
+        });
+    });
+
+    it('Apply the thread count of a run', function () {
+        menoh.setThreadBudget(3);
+
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const auto = builder.buildModel({ threads: 'auto' });
+            const fixed = builder.buildModel({ threads: 2 });
+
+            // Alone, an 'auto' model takes the whole budget.
+            return auto.run()
+            .then(() => {
+                assert.equal(menoh.getThreadBudget().applied, 3);
+                return fixed.run();
+            })
+            .then(() => {
+                assert.equal(menoh.getThreadBudget().applied, 2);
+                auto.runSync();
+                assert.equal(menoh.getThreadBudget().applied, 3);
+                assert.equal(menoh.getThreadBudget().granted, 0);
+            });
+        });
+    });
+
+    it('Throws on an invalid threads option', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            assert.throws(() => builder.buildModel({ threads: 0 }), /threads must be/);
+            assert.throws(() => menoh.setThreadBudget(0), /positive integer/);
+        });
+    });
+});
+
+describe('Variable handle tests', function () {
+    let samples;
+
+    before(function () {
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((imageList) => {
+            const data = preprocessImages(imageList);
+            samples = _.chunk(data, 28 * 28).map((v) => new Float32Array(v));
+        });
+    })
+
+    it('Run a model through variable handles', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            const input = model.getVariable(MNIST_IN_NAME);
+            const output = model.getVariable(MNIST_OUT_NAME);
+            assert.equal(input.name, MNIST_IN_NAME);
+            assert.deepEqual(input.dims, [ 1, 1, 28, 28 ]);
+            assert.equal(input.dtype, 'float32');
+            assert.ok(input.isInput);
+            assert.ok(!output.isInput);
+            assert.deepEqual(output.dims, model.getProfile(MNIST_OUT_NAME).dims);
+
+            return samples.reduce((p, sample, i) => p.then(() => {
+                input.set(sample);
+                return model.run().then(() => {
+                    assert.deepEqual(findIndicesOfTopK(output.get(), 1), [ i ]);
+                    const view = new Float32Array(output.buf.buffer, output.buf.byteOffset, 10);
+                    assert.deepEqual(Array.from(view), output.get());
+                });
+            }), Promise.resolve());
+        });
+    });
+
+    it('Get the outputs in a single call', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            model.getVariable(MNIST_IN_NAME).set(samples[3]);
+
+            const profiles = model.getProfiles();
+            assert.deepEqual(Object.keys(profiles), [ MNIST_IN_NAME, MNIST_OUT_NAME ]);
+            assert.deepEqual(profiles[MNIST_OUT_NAME].dims, [ 1, 10 ]);
+
+            return model.run({ outputs: true })
+            .then((outputs) => {
+                assert.deepEqual(Object.keys(outputs), [ MNIST_OUT_NAME ]);
+                const output = Array.from(outputs[MNIST_OUT_NAME]);
+                assert.deepEqual(findIndicesOfTopK(output, 1), [ 3 ]);
+
+                const results = model.getOutputs([ MNIST_OUT_NAME ]);
+                assert.deepEqual(results[MNIST_OUT_NAME].data, output);
+                assert.deepEqual(results[MNIST_OUT_NAME].dims, [ 1, 10 ]);
+                assert.throws(() => model.getOutputs([ 'bad_name' ]), /bad_name/);
+                return model.run();
+            })
+            .then((outputs) => {
+                assert.strictEqual(outputs, undefined);
+            });
+        });
+    });
+
+    it('Run a model synchronously', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            const input = model.getVariable(MNIST_IN_NAME);
+            samples.forEach((sample, i) => {
+                input.set(sample);
+                const outputs = model.runSync({ outputs: [ MNIST_OUT_NAME ] });
+                assert.deepEqual(findIndicesOfTopK(Array.from(outputs[MNIST_OUT_NAME]), 1), [ i ]);
+            });
+            assert.strictEqual(model.runSync(), undefined);
+
+            const running = model.run();
+            assert.throws(() => model.runSync(), /in progress/);
+            return running.then(() => {
+                const stats = model.getRunStats();
+                assert.equal(stats.syncRuns, samples.length + 1);
+                assert.ok(stats.meanSyncMs > 0);
+                assert.equal(stats.runs, 1);
+                assert.ok(stats.meanTotalMs >= stats.meanRunMs);
+            });
+        });
+    });
+
+    it('Run repeatedly on the reused promise path', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            const input = model.getVariable(MNIST_IN_NAME);
+            const runs = 50;
+            let p = Promise.resolve();
+            for (let i = 0; i < runs; ++i) {
+                const k = i % samples.length;
+                p = p.then(() => {
+                    input.set(samples[k]);
+                    const running = model.run({ outputs: true });
+                    assert.ok(running instanceof Promise);
+                    return Promise.all([ running, model.run().then(assert.fail, (err) => err) ]);
+                })
+                .then(([ outputs, err ]) => {
+                    assert.ok(/in progress/.test(err.message));
+                    assert.deepEqual(findIndicesOfTopK(Array.from(outputs[MNIST_OUT_NAME]), 1), [ k ]);
+                });
+            }
+            return p.then(() => {
+                assert.equal(model.getRunStats().runs, runs);
+            });
+        });
+    });
+
+    it('Throws on an unknown variable or a wrong length', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({});
+            assert.throws(() => model.getVariable('bad_name'), /bad_name/);
+            const input = model.getVariable(MNIST_IN_NAME);
+            assert.throws(() => input.set(new Float32Array(3)), /too short/);
+            assert.throws(() => input.set(new Array(28 * 28 + 1).fill(0)), /too long/);
+            assert.throws(() => new menoh.Variable({}, 0), /getVariable/);
+        });
+    });
+});
+
+describe('Buffer allocation tests', function () {
+    it('Run a model with aligned buffers on huge pages', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            // Huge pages are only used for buffers of 2 MiB or more.
+            builder.addInput(MNIST_IN_NAME, [ 1024, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            const model = builder.buildModel({ alignment: 4096, hugePages: true });
+            const input = model.getProfile(MNIST_IN_NAME);
+            assert.equal(input.buf.byteLength, 1024 * 28 * 28 * 4);
+            assert.ok(input.buf.byteLength >= 2 * 1024 * 1024);
+            assert.ok(input.buf.every((v) => v === 0));
+            return model.run();
+        });
+    });
+
+    it('Throws on an invalid alignment', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            assert.throws(() => builder.buildModel({ alignment: 48 }), /alignment must be/);
+            assert.throws(() => builder.buildModel({ alignment: 4 }), /alignment must be/);
+        });
+    });
+});
+
+describe('Source dtype tests', function () {
+    function build(sourceDtype) {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ INPUT_IMAGE_LIST.length, 1, 28, 28 ], { sourceDtype });
+            builder.addOutput(MNIST_OUT_NAME);
+            return builder.buildModel({ backendName: 'mkldnn' });
+        });
+    }
+
+    it('Widens uint8, int16 and float16 inputs to the same results', function () {
+        let data;
+        let expected;
+        return loadInputImages(INPUT_IMAGE_LIST)
+        .then((imageList) => {
+            data = preprocessImages(imageList);
+            return build();
+        })
+        .then((model) => {
+            model.setInputData(MNIST_IN_NAME, data);
+            return model.run().then(() => {
+                expected = model.getOutput(MNIST_OUT_NAME).data;
+            });
+        })
+        .then(() => Promise.all([ 'uint8', 'int16', 'float16' ].map((sourceDtype) => {
+            return build(sourceDtype).then((model) => {
+                const profile = model.getProfile(MNIST_IN_NAME);
+                assert.equal(profile.dtype, sourceDtype);
+                assert.equal(profile.buf.length, data.length * (sourceDtype === 'uint8' ? 1 : 2));
+                model.setInputData(MNIST_IN_NAME, data);
+                // Pixel values are exact in all the dtypes.
+                assert.deepEqual(model.getVariable(MNIST_IN_NAME).get(), data);
+                return model.run().then(() => {
+                    const output = model.getOutput(MNIST_OUT_NAME);
+                    assert.equal(output.data.length, expected.length);
+                    output.data.forEach((v, i) => {
+                        assert.ok(Math.abs(v - expected[i]) < 1e-4);
+                    });
+                });
+            });
+        })));
+    });
+
+    it('Copies a typed array of the source dtype as is', function () {
+        return build('uint8')
+        .then((model) => {
+            const pixels = new Uint8Array(INPUT_IMAGE_LIST.length * 28 * 28);
+            pixels.fill(255);
+            model.setInputData(MNIST_IN_NAME, pixels);
+            assert.ok(model.getProfile(MNIST_IN_NAME).buf.every((v) => v === 255));
+            // Values out of range are saturated.
+            model.setInputData(MNIST_IN_NAME, new Float32Array(pixels.length).fill(-3));
+            assert.ok(model.getProfile(MNIST_IN_NAME).buf.every((v) => v === 0));
+            return model.run();
+        });
+    });
+
+    it('Throws on an unknown source dtype', function () {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            assert.throws(() => {
+                builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ], { sourceDtype: 'int8' });
+            }, /sourceDtype must be/);
+        });
+    });
+});
+
+describe('Conversion kernel tests', function () {
+    const types = [ Float32Array, Uint8Array, Int16Array, Uint16Array ];
+
+    // Random bits, and for float32 special and in-range values as well
+    function randomArray(Type, n) {
+        const arr = new Type(n);
+        const bytes = new Uint8Array(arr.buffer);
+        for (let i = 0; i < bytes.length; i++) {
+            bytes[i] = Math.floor(Math.random() * 256);
+        }
+        if (Type === Float32Array) {
+            for (let i = 0; i < n; i += 3) {
+                arr[i] = (Math.random() - 0.5) * 70000;
+            }
+            arr.set([ NaN, -Infinity, Infinity, -0, 65519, 1e-8, 255.5, -32768.5 ]);
+        }
+        return arr;
+    }
+
+    it('Reports the supported instruction sets', function () {
+        const kernels = menoh.getConvertKernels();
+        assert.equal(kernels.supported[0], 'scalar');
+        assert.equal(kernels.supported[kernels.supported.length - 1], kernels.isa);
+    });
+
+    it('Gives bit-exact results with every instruction set', function () {
+        const supported = menoh.getConvertKernels().supported;
+        const n = 10007; // not a multiple of any vector width
+        types.forEach((SrcType) => {
+            const src = randomArray(SrcType, n);
+            types.forEach((DstType) => {
+                [ {}, { scale: 0.0173, bias: -3.25 } ].forEach((options) => {
+                    const expected = new DstType(n);
+                    menoh.convert(src, expected, Object.assign({ isa: 'scalar' }, options));
+                    const ref = Buffer.from(expected.buffer);
+                    supported.forEach((isa) => {
+                        const actual = new DstType(n);
+                        menoh.convert(src, actual, Object.assign({ isa }, options));
+                        assert.ok(Buffer.from(actual.buffer).equals(ref),
+                            `${SrcType.name} to ${DstType.name} (${isa}) ${JSON.stringify(options)}`);
+                    });
+                });
+            });
+        });
+    });
+
+    it('Converts, saturates and normalizes', function () {
+        const src = new Float32Array([ -1, 0.5, 1.5, 254.9, 300, NaN ]);
+        const u8 = new Uint8Array(src.length);
+        menoh.convert(src, u8);
+        assert.deepEqual(Array.from(u8), [ 0, 0, 1, 254, 255, 0 ]);
+
+        const f32 = new Float32Array(3);
+        menoh.convert(new Uint8Array([ 0, 51, 255 ]), f32, { scale: 1 / 255, bias: -0.5 });
+        assert.ok(Math.abs(f32[0] + 0.5) < 1e-6 && Math.abs(f32[1] + 0.3) < 1e-6 && Math.abs(f32[2] - 0.5) < 1e-6);
+
+        const f16 = new Uint16Array(2);
+        menoh.convert(new Float32Array([ 1, -2 ]), f16);
+        assert.deepEqual(Array.from(f16), [ 0x3c00, 0xc000 ]);
+    });
+
+    it('Throws on invalid arguments', function () {
+        assert.throws(() => menoh.convert(new Float64Array(1), new Float32Array(1)), /must be a Float32Array/);
+        assert.throws(() => menoh.convert(new Float32Array(2), new Uint8Array(1)), /same length/);
+        assert.throws(() => menoh.convert(new Float32Array(1), new Uint8Array(1), { isa: 'neon' }), /isa must be/);
+    });
+});
+
+describe('Tiled run tests', function () {
+    // y = Relu(x) (the input itself) and z = MaxPool(x) 2x2, on 8x8 tiles
+    function build(batch) {
+        const builder = menoh.createEmpty();
+        builder.addNode('Relu', [ 'x' ], [ 'y' ]);
+        builder.addNode('MaxPool', [ 'x' ], [ 'z' ], {
+            kernel_shape: [ 2, 2 ],
+            strides: [ 2, 2 ],
+            pads: [ 0, 0, 0, 0 ]
+        });
+        builder.addInput('x', [ batch, 1, 8, 8 ]);
+        builder.addOutput('y');
+        builder.addOutput('z');
+        return builder.buildModel({});
+    }
+
+    const H = 20;
+    const W = 28;
+    const pixels = new Uint8Array(H * W).map((v, i) => (i * 7) % 251);
+
+    function maxPool(data, h, w) {
+        const out = new Float32Array((h / 2) * (w / 2));
+        for (let y = 0; y < h / 2; y++) {
+            for (let x = 0; x < w / 2; x++) {
+                const i = 2 * y * w + 2 * x;
+                out[y * (w / 2) + x] = Math.max(data[i], data[i + 1], data[i + w], data[i + w + 1]);
+            }
+        }
+        return out;
+    }
+
+    it('Stitches overlapping tiles into the whole image', function () {
+        const model = build(4);
+        return model.runTiled({ data: pixels, dims: [ 1, H, W ] }, { stride: 4, batch: 3 })
+        .then((outputs) => {
+            assert.deepEqual(outputs.y.dims, [ 1, H, W ]);
+            assert.deepEqual(Array.from(outputs.y.data), Array.from(pixels));
+            assert.deepEqual(outputs.z.dims, [ 1, H / 2, W / 2 ]);
+            assert.deepEqual(Array.from(outputs.z.data), Array.from(maxPool(pixels, H, W)));
+        });
+    });
+
+    it('Runs the batches of tiles on replicas', function () {
+        const models = [ build(2), build(2), build(2) ];
+        const image = { data: Float32Array.from(pixels), dims: [ 1, 1, H, W ] };
+        return models[0].runTiled(image, { tile: 8, stride: [ 2, 6 ], outputs: [ 'y' ], replicas: models.slice(1) })
+        .then((outputs) => {
+            assert.deepEqual(Object.keys(outputs), [ 'y' ]);
+            assert.deepEqual(Array.from(outputs.y.data), Array.from(pixels));
+            assert.ok(models.every((m) => m.getRunStats().runs === 0)); // not counted as runs
+            return models[1].run(); // released
+        });
+    });
+
+    it('Throws on invalid tiling', function () {
+        const model = build(1);
+        const image = { data: pixels, dims: [ 1, H, W ] };
+        assert.throws(() => model.runTiled(image, { tile: 16 }, () => {}), /tile must match/);
+        assert.throws(() => model.runTiled(image, { stride: 9 }, () => {}), /stride must not exceed/);
+        assert.throws(() => model.runTiled(image, { stride: 3 }, () => {}), /multiples of the scale/);
+        assert.throws(() => model.runTiled(image, { batch: 2 }, () => {}), /batch must be/);
+        assert.throws(() => model.runTiled({ data: pixels, dims: [ 1, 4, 4 ] }, () => {}), /smaller than the tile/);
+        assert.throws(() => model.runTiled({ data: pixels, dims: [ 1, H, H ] }, () => {}), /does not match/);
+    });
+});
+
+describe('Vector index tests', function () {
+    // Five vectors along the axes and the diagonal
+    const vectors = new Float32Array([
+        1, 0, 0,
+        0, 1, 0,
+        0, 0, 1,
+        1, 1, 1,
+        2, 0, 0,
+    ]);
+
+    it('Find the nearest vectors by L2 distance', function () {
+        const index = new menoh.VectorIndex({ dims: 3 });
+        assert.equal(index.add(vectors), 0);
+        assert.equal(index.add([ 0, 0, 3 ]), 5);
+        const queries = new Float32Array([ 1.8, 0, 0, 0, 0.2, 1.4 ]);
+        return Promise.all([
+            index.search(queries, 2),
+            index.search(queries, 2, { threads: 3, isa: 'scalar' }),
+            index.search(queries, 2, { threads: 100000 }),    // up to the cores
+        ])
+        .then((results) => {
+            results.forEach((r) => {
+                assert.equal(r.k, 2);
+                assert.deepEqual(Array.from(r.ids), [ 4, 0, 2, 3 ]);
+                assert.ok(Math.abs(r.distances[0] - 0.04) < 1e-5);
+                assert.ok(Math.abs(r.distances[1] - 0.64) < 1e-5);
+            });
+            assert.equal(index.getStats().searches, 3);
+        });
+    });
+
+    it('Find the nearest vectors by cosine distance in int8', function () {
+        const index = new menoh.VectorIndex({ dims: 3, metric: 'cosine', dtype: 'int8' });
+        index.add(vectors);
+        return index.search(new Float32Array([ 5, 5, 4 ]), 10)
+        .then((r) => {
+            assert.equal(r.k, 5);   // the size of the index
+            assert.deepEqual(Array.from(r.ids), [ 3, 0, 1, 4, 2 ]); // ties by id
+            assert.ok(Math.abs(r.distances[0] - (1 - 14 / Math.sqrt(66 * 3))) < 1e-2);
+            const stats = index.getStats();
+            assert.equal(stats.dtype, 'int8');
+            assert.equal(stats.size, 5);
+        });
+    });
+
+    it('Add and search the output of a model', function () {
+        const builder = menoh.createEmpty();
+        builder.addNode('Relu', [ 'x' ], [ 'y' ]);
+        builder.addInput('x', [ 2, 1, 2, 2 ]);
+        builder.addOutput('y');
+        const model = builder.buildModel({});
+        model.getVariable('x').set([ 1, -1, 2, 0, 0, 3, -4, 1 ]);
+        return model.run()
+        .then(() => {
+            const y = model.getVariable('y');
+            const index = new menoh.VectorIndex({ dims: 4 });
+            assert.equal(index.add(y), 0);
+            assert.equal(index.add(y, 1), 2);
+            const p = index.search(y, 1, { rows: 2 });
+            assert.throws(() => index.add(y), /previous run is in progress/);
+            assert.throws(() => index.clear(), /being searched/);
+            return p.then((r) => {
+                assert.deepEqual(Array.from(r.ids), [ 0, 1 ]);
+                assert.deepEqual(Array.from(r.distances), [ 0, 0 ]);
+                index.clear();
+                assert.equal(index.getStats().size, 0);
+                return model.run(); // released
+            });
+        });
+    });
+
+    it('Throws on invalid arguments', function () {
+        assert.throws(() => new menoh.VectorIndex({}), /dims must be/);
+        assert.throws(() => new menoh.VectorIndex({ dims: 3, metric: 'dot' }), /metric must be/);
+        assert.throws(() => new menoh.VectorIndex({ dims: 3, dtype: 'uint8' }), /dtype must be/);
+        const index = new menoh.VectorIndex({ dims: 3 });
+        assert.throws(() => index.add(new Float32Array(4)), /multiple of dims/);
+        assert.throws(() => index.add(new Float32Array(3), 2), /rows must be/);
+        assert.throws(() => index.search(new Float32Array(3), 0, () => {}), /k must be/);
+        assert.throws(() => index.search(new Float32Array(3), 1, { threads: 0 }, () => {}), /threads must be/);
+    });
+});
+
+describe('Warm-up tests', function () {
+    function build(config) {
+        return menoh.create(ONNX_FILE_PATH)
+        .then((builder) => {
+            builder.addInput(MNIST_IN_NAME, [ 1, 1, 28, 28 ]);
+            builder.addOutput(MNIST_OUT_NAME);
+            return builder.buildModel(config || {});
+        });
+    }
+
+    it('Warm up a model', function () {
+        return build()
+        .then((model) => {
+            assert.strictEqual(model.getWarmupStats(), null);
+            return model.warmup({ iterations: 4 })
+            .then((stats) => {
+                assert.equal(stats.iterations, 4);
+                assert.equal(stats.latencies.length, 4);
+                assert.equal(stats.first, stats.latencies[0]);
+                assert.ok(stats.steady > 0);
+                assert.deepEqual(model.getWarmupStats(), stats);
+                return model.run();
+            });
+        });
+    });
+
+    it('Warm up a model on build', function () {
+        return build({ warmup: { iterations: 2 } })
+        .then((model) => {
+            assert.equal(model.getWarmupStats().iterations, 2);
+        });
+    });
+
+    it('Throws on invalid iterations', function () {
+        return build()
+        .then((model) => {
+            assert.throws(() => model.warmup({ iterations: 0 }, () => {}), /iterations must be/);
+        });
+    });
+});
+
+describe('Worker thread tests', function () {
+    let Worker;
+
+    before(function () {
+        try {
+            Worker = require('worker_threads').Worker;
+        } catch (e) {
+            this.skip(); // worker_threads not available
+        }
+    })
+
+    it('Load the addon and run models in worker threads', function () {
+        const script = `
+            const { parentPort, workerData } = require('worker_threads');
+            const menoh = require(workerData.modulePath);
+            menoh.create(workerData.onnxPath)
+            .then((builder) => {
+                builder.addInput(workerData.inName, [ 1, 1, 28, 28 ]);
+                builder.addOutput(workerData.outName);
+                const model = builder.buildModel({ backendName: 'mkldnn' });
+                return model.run().then(() => {
+                    parentPort.postMessage(model.getProfile(workerData.outName).dims);
+                });
+            })
+            .catch((err) => {
+                parentPort.postMessage({ error: err.message });
+            });
+        `;
+        const workerData = {
+            modulePath: require('path').resolve(__dirname, '..'),
+            onnxPath: ONNX_FILE_PATH,
+            inName: MNIST_IN_NAME,
+            outName: MNIST_OUT_NAME
+        };
+
+        return Promise.all([ 0, 1 ].map(() => {
+            return new Promise((resolve, reject) => {
+                const worker = new Worker(script, { eval: true, workerData });
+                worker.on('message', resolve);
+                worker.on('error', reject);
+            });
+        }))
+        .then((results) => {
+            results.forEach((dims) => {
+                assert.deepEqual(dims, [ 1, 10 ]);
+            });
+        });
+    });
 });
 
 describe('Failure tests with callback', function () {